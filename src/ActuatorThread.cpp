@@ -0,0 +1,57 @@
+/*
+ * Copyright (C) 2023 Konsulko Group
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#include <csignal>
+#include <cstring>
+#include <pthread.h>
+
+#include "ActuatorThread.h"
+#include "Realtime.h"
+#include "Watchdog.h"
+#include "Logger.h"
+
+// Stack touched up front so it is resident once memory is locked
+#define STACK_PREFAULT (64 * 1024)
+
+ActuatorThread::ActuatorThread(const HvacConfig::Sched &sched) :
+	m_sched(sched)
+{
+	m_thread = std::thread(&ActuatorThread::run, this);
+}
+
+ActuatorThread::~ActuatorThread()
+{
+	stop();
+}
+
+void ActuatorThread::stop()
+{
+	if (!m_thread.joinable())
+		return;
+
+	m_loop.quit();
+	m_thread.join();
+}
+
+// Private
+
+void ActuatorThread::run()
+{
+	// Signals are handled by the main loop, apart from the watchdog's
+	// request for a stack dump
+	sigset_t mask;
+	sigfillset(&mask);
+	sigdelset(&mask, Watchdog::STACK_DUMP_SIGNAL);
+	pthread_sigmask(SIG_BLOCK, &mask, NULL);
+
+	pthread_setname_np(pthread_self(), "hvac-actuator");
+	Realtime::apply(m_sched, "actuator thread");
+
+	volatile char stack[STACK_PREFAULT];
+	memset((char*) stack, 0, sizeof(stack));
+
+	m_loop.run();
+}
@@ -0,0 +1,44 @@
+/*
+ * Copyright (C) 2023 Konsulko Group
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#ifndef _ACTUATOR_THREAD_H
+#define _ACTUATOR_THREAD_H
+
+#include <thread>
+
+#include "HvacConfig.h"
+#include "EpollEventLoop.h"
+
+// Dedicated thread for the CAN and LED writes
+//
+// Runs its own epoll loop with the [can] scheduling settings applied, so
+// hardware updates do not queue behind broker traffic or anything else on
+// the main loop.  Work is handed over with loop()->post().
+
+class ActuatorThread
+{
+public:
+	explicit ActuatorThread(const HvacConfig::Sched &sched);
+
+	~ActuatorThread();
+
+	EventLoop *loop() { return &m_loop; };
+
+	pthread_t handle() { return m_thread.native_handle(); };
+
+	// Quit the loop and wait for the thread, sources may be removed
+	// from any thread afterwards.
+	void stop();
+
+private:
+	void run();
+
+	HvacConfig::Sched m_sched;
+	EpollEventLoop m_loop;
+	std::thread m_thread;
+};
+
+#endif // _ACTUATOR_THREAD_H
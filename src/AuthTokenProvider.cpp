@@ -0,0 +1,205 @@
+/*
+ * Copyright (C) 2023 Konsulko Group
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#include <fstream>
+#include <sstream>
+#include <ctime>
+#include <cstdlib>
+
+#include "AuthTokenProvider.h"
+#include "Logger.h"
+
+// Longest single wait for the expiry check, tokens may be valid for
+// months; checking early just waits again
+#define MAX_EXPIRY_CHECK_S (24 * 60 * 60)
+
+namespace {
+
+std::string read_token(const std::string &path)
+{
+	std::ifstream file(path, std::ios_base::binary);
+	if (!file.is_open())
+		return std::string();
+
+	std::stringstream ss;
+	ss << file.rdbuf();
+	std::string token = ss.str();
+
+	// A trailing newline is not valid in a metadata value
+	auto end = token.find_last_not_of(" \t\r\n");
+	token.erase(end == std::string::npos ? 0 : end + 1);
+	return token;
+}
+
+std::string base64url_decode(const std::string &in)
+{
+	std::string out;
+	unsigned buf = 0;
+	int bits = 0;
+	for (char c : in) {
+		int v;
+		if (c >= 'A' && c <= 'Z')
+			v = c - 'A';
+		else if (c >= 'a' && c <= 'z')
+			v = c - 'a' + 26;
+		else if (c >= '0' && c <= '9')
+			v = c - '0' + 52;
+		else if (c == '-' || c == '+')
+			v = 62;
+		else if (c == '_' || c == '/')
+			v = 63;
+		else
+			break;
+		buf = (buf << 6) | v;
+		bits += 6;
+		if (bits >= 8) {
+			bits -= 8;
+			out += (char) ((buf >> bits) & 0xFF);
+		}
+	}
+	return out;
+}
+
+} // namespace
+
+AuthTokenProvider::AuthTokenProvider(EventLoop *loop,
+				     const std::string &path,
+				     unsigned refresh_interval,
+				     unsigned expiry_margin) :
+	m_loop(loop),
+	m_path(path),
+	m_refresh_interval(refresh_interval),
+	m_expiry_margin(expiry_margin),
+	m_watcher(loop, [this](const std::set<std::string> &changed) { refresh(); }),
+	m_refresh_source(0),
+	m_expiry_source(0)
+{
+	m_token = read_token(m_path);
+	m_watcher.add(m_path);
+
+	if (m_refresh_interval && m_loop) {
+		m_refresh_source = m_loop->addTimeout(m_refresh_interval * 1000, [this]() {
+			refresh();
+			return true;
+		});
+	}
+
+	scheduleExpiryCheck();
+}
+
+AuthTokenProvider::~AuthTokenProvider()
+{
+	if (m_loop) {
+		m_loop->remove(m_refresh_source);
+		m_loop->remove(m_expiry_source);
+	}
+}
+
+std::string AuthTokenProvider::token()
+{
+	const std::lock_guard<std::mutex> lock(m_mutex);
+	return m_token;
+}
+
+void AuthTokenProvider::setPath(const std::string &path)
+{
+	if (path == m_path)
+		return;
+
+	m_path = path;
+	m_watcher.clear();
+	m_watcher.add(m_path);
+	refresh();
+}
+
+void AuthTokenProvider::refresh()
+{
+	std::string token = read_token(m_path);
+	if (token.empty()) {
+		// Most likely caught in the middle of the file being replaced,
+		// keep using the current token.
+		Logger::warning("AuthTokenProvider", "Could not read authorization token {}", m_path);
+		return;
+	}
+
+	{
+		const std::lock_guard<std::mutex> lock(m_mutex);
+		if (token == m_token)
+			return;
+		m_token = token;
+	}
+
+	Logger::info("AuthTokenProvider", "Authorization token updated");
+	scheduleExpiryCheck();
+	if (m_cb)
+		m_cb(token);
+}
+
+int64_t AuthTokenProvider::expiry(const std::string &token)
+{
+	auto first = token.find('.');
+	if (first == std::string::npos)
+		return 0;
+	auto second = token.find('.', first + 1);
+	if (second == std::string::npos)
+		return 0;
+
+	// Not a full JSON parse, the claims are flat and "exp" is numeric
+	std::string payload = base64url_decode(token.substr(first + 1, second - first - 1));
+	auto pos = payload.find("\"exp\"");
+	if (pos == std::string::npos)
+		return 0;
+	pos = payload.find(':', pos);
+	if (pos == std::string::npos)
+		return 0;
+
+	return strtoll(payload.c_str() + pos + 1, NULL, 10);
+}
+
+// Private
+
+void AuthTokenProvider::expiryCheck()
+{
+	m_expiry_source = 0;
+	std::string before = token();
+	refresh();
+	if (token() == before) {
+		int64_t remaining = expiry(before) - (int64_t) time(NULL);
+		if (remaining > (int64_t) m_expiry_margin) {
+			// Woke up ahead of the margin after a capped wait
+			scheduleExpiryCheck();
+			return;
+		}
+		Logger::warning("AuthTokenProvider",
+				"Authorization token expires in {} s and has not been replaced",
+				remaining);
+	}
+}
+
+void AuthTokenProvider::scheduleExpiryCheck()
+{
+	if (!m_loop)
+		return;
+
+	if (m_expiry_source) {
+		m_loop->remove(m_expiry_source);
+		m_expiry_source = 0;
+	}
+
+	int64_t exp = expiry(token());
+	if (!exp)
+		return;
+
+	int64_t delay = exp - (int64_t) m_expiry_margin - (int64_t) time(NULL);
+	if (delay < 1)
+		delay = 1;
+	if (delay > MAX_EXPIRY_CHECK_S)
+		delay = MAX_EXPIRY_CHECK_S;
+	m_expiry_source = m_loop->addTimeout((unsigned) (delay * 1000), [this]() {
+		expiryCheck();
+		return false;
+	});
+}
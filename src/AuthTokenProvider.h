@@ -0,0 +1,70 @@
+/*
+ * Copyright (C) 2023 Konsulko Group
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#ifndef _AUTH_TOKEN_PROVIDER_H
+#define _AUTH_TOKEN_PROVIDER_H
+
+#include <string>
+#include <mutex>
+#include <functional>
+#include <cstdint>
+
+#include "EventLoop.h"
+#include "ConfigWatcher.h"
+
+typedef std::function<void(const std::string &token)> AuthTokenCallback;
+
+// Source of the databroker authorization token
+//
+// The token file is watched for replacement and optionally re-read on a
+// fixed interval.  If the token is a JWT with an "exp" claim, a check is
+// also scheduled shortly before it expires so a late replacement is
+// picked up (or the impending expiry reported) ahead of the broker
+// rejecting requests.  The callback is invoked on the main event loop
+// whenever the token content changes.
+
+class AuthTokenProvider
+{
+public:
+	AuthTokenProvider(EventLoop *loop,
+			  const std::string &path,
+			  unsigned refresh_interval = 0,
+			  unsigned expiry_margin = 60);
+
+	~AuthTokenProvider();
+
+	std::string token();
+
+	void setPath(const std::string &path);
+
+	void setCallback(AuthTokenCallback cb) { m_cb = cb; };
+
+	// Re-read the token file now
+	void refresh();
+
+	// Returns the JWT "exp" claim (seconds since the epoch), or 0 if the
+	// token is not a JWT or has no expiry
+	static int64_t expiry(const std::string &token);
+
+private:
+	void expiryCheck();
+
+	void scheduleExpiryCheck();
+
+	EventLoop *m_loop;
+	std::string m_path;
+	unsigned m_refresh_interval;
+	unsigned m_expiry_margin;
+	ConfigWatcher m_watcher;
+	unsigned m_refresh_source;
+	unsigned m_expiry_source;
+
+	std::mutex m_mutex;
+	std::string m_token;
+	AuthTokenCallback m_cb;
+};
+
+#endif // _AUTH_TOKEN_PROVIDER_H
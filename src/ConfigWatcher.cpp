@@ -0,0 +1,131 @@
+/*
+ * Copyright (C) 2023 Konsulko Group
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/inotify.h>
+
+#include "ConfigWatcher.h"
+#include "Logger.h"
+
+#define WATCH_MASK (IN_CLOSE_WRITE | IN_MOVED_TO | IN_CREATE | IN_DELETE)
+
+ConfigWatcher::ConfigWatcher(EventLoop *loop, ConfigChangedCallback cb, unsigned debounce_ms) :
+	m_loop(loop),
+	m_cb(cb),
+	m_debounce_ms(debounce_ms),
+	m_fd(-1),
+	m_fd_source(0),
+	m_debounce_source(0)
+{
+	m_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+	if (m_fd < 0) {
+		Logger::error("ConfigWatcher", "Could not create inotify instance");
+		return;
+	}
+
+	if (m_loop) {
+		m_fd_source = m_loop->addFd(m_fd, EventLoop::IN, [this](uint32_t events) {
+			handle_events();
+			return true;
+		});
+	}
+}
+
+ConfigWatcher::~ConfigWatcher()
+{
+	if (m_loop) {
+		m_loop->remove(m_debounce_source);
+		m_loop->remove(m_fd_source);
+	}
+	if (m_fd >= 0)
+		close(m_fd);
+}
+
+bool ConfigWatcher::add(const std::string &path)
+{
+	if (m_fd < 0 || path.empty())
+		return false;
+
+	std::string dir(".");
+	std::string name(path);
+	auto pos = path.rfind('/');
+	if (pos != std::string::npos) {
+		dir = pos ? path.substr(0, pos) : std::string("/");
+		name = path.substr(pos + 1);
+	}
+
+	if (m_files.find(dir) == m_files.end()) {
+		int wd = inotify_add_watch(m_fd, dir.c_str(), WATCH_MASK);
+		if (wd < 0) {
+			Logger::warning("ConfigWatcher", "Could not watch {}", dir);
+			return false;
+		}
+		m_watches[wd] = dir;
+	}
+	m_files[dir].insert(name);
+
+	if (Logger::verbose())
+		Logger::info("ConfigWatcher", "Watching {}", path);
+
+	return true;
+}
+
+void ConfigWatcher::clear()
+{
+	for (auto it = m_watches.cbegin(); it != m_watches.cend(); ++it)
+		inotify_rm_watch(m_fd, it->first);
+	m_watches.clear();
+	m_files.clear();
+}
+
+// Private
+
+void ConfigWatcher::debounce_done()
+{
+	m_debounce_source = 0;
+	std::set<std::string> changed;
+	changed.swap(m_pending);
+	if (m_cb && !changed.empty())
+		m_cb(changed);
+}
+
+void ConfigWatcher::handle_events()
+{
+	alignas(struct inotify_event) char buf[4096];
+	for (;;) {
+		ssize_t len = read(m_fd, buf, sizeof(buf));
+		if (len <= 0)
+			break;
+
+		for (char *p = buf; p < buf + len; ) {
+			struct inotify_event *event = (struct inotify_event*) p;
+			p += sizeof(struct inotify_event) + event->len;
+
+			auto watch = m_watches.find(event->wd);
+			if (watch == m_watches.end() || !event->len)
+				continue;
+
+			const std::set<std::string> &names = m_files[watch->second];
+			if (names.find(event->name) == names.end())
+				continue;
+
+			std::string path(watch->second);
+			if (path.back() != '/')
+				path += "/";
+			path += event->name;
+			m_pending.insert(path);
+		}
+	}
+
+	// Coalesce the burst of events a single save usually generates
+	if (!m_pending.empty() && !m_debounce_source) {
+		m_debounce_source = m_loop->addTimeout(m_debounce_ms, [this]() {
+			debounce_done();
+			return false;
+		});
+	}
+}
@@ -0,0 +1,59 @@
+/*
+ * Copyright (C) 2023 Konsulko Group
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#ifndef _CONFIG_WATCHER_H
+#define _CONFIG_WATCHER_H
+
+#include <string>
+#include <vector>
+#include <map>
+#include <set>
+#include <functional>
+
+#include "EventLoop.h"
+
+typedef std::function<void(const std::set<std::string> &changed)> ConfigChangedCallback;
+
+// inotify based watcher for configuration files
+//
+// The containing directories are watched rather than the files
+// themselves so that editors and deployment tools that replace a file
+// via rename are picked up.  Events are handled on the main event loop
+// and debounced, the callback gets the set of files that changed.
+
+class ConfigWatcher
+{
+public:
+	ConfigWatcher(EventLoop *loop, ConfigChangedCallback cb, unsigned debounce_ms = 200);
+
+	~ConfigWatcher();
+
+	// Start watching path, returns false if it could not be watched
+	bool add(const std::string &path);
+
+	// Drop all watches, e.g. before re-adding an updated file list
+	void clear();
+
+private:
+	void handle_events();
+
+	void debounce_done();
+
+	EventLoop *m_loop;
+	ConfigChangedCallback m_cb;
+	unsigned m_debounce_ms;
+	int m_fd;
+	unsigned m_fd_source;
+	unsigned m_debounce_source;
+
+	// watch descriptor -> directory, directory -> watched file names
+	std::map<int, std::string> m_watches;
+	std::map<std::string, std::set<std::string>> m_files;
+
+	std::set<std::string> m_pending;
+};
+
+#endif // _CONFIG_WATCHER_H
@@ -0,0 +1,400 @@
+/*
+ * Copyright (C) 2023 Konsulko Group
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#include <ctime>
+#include <cerrno>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/signalfd.h>
+
+#include "EpollEventLoop.h"
+#include "Logger.h"
+
+#define MAX_EVENTS 16
+
+// Recycled source and timer nodes kept around
+#define SPARE_NODES 64
+
+EpollEventLoop::EpollEventLoop() :
+	m_epoll_fd(-1),
+	m_event_fd(-1),
+	m_signal_fd(-1),
+	m_next_id(FIRST_ID),
+	m_dispatching(0),
+	m_quit(false)
+{
+	sigemptyset(&m_signals);
+
+	m_epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+	if (m_epoll_fd < 0) {
+		Logger::error("EpollEventLoop", "Could not create epoll instance");
+		return;
+	}
+
+	m_event_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (m_event_fd < 0) {
+		Logger::error("EpollEventLoop", "Could not create eventfd");
+		return;
+	}
+
+	struct epoll_event ev = {};
+	ev.events = EPOLLIN;
+	ev.data.u64 = POST_ID;
+	epoll_ctl(m_epoll_fd, EPOLL_CTL_ADD, m_event_fd, &ev);
+}
+
+EpollEventLoop::~EpollEventLoop()
+{
+	if (m_signal_fd >= 0)
+		close(m_signal_fd);
+	if (m_event_fd >= 0)
+		close(m_event_fd);
+	if (m_epoll_fd >= 0)
+		close(m_epoll_fd);
+}
+
+void EpollEventLoop::blockSignals(const std::vector<int> &signals)
+{
+	sigset_t mask;
+	sigemptyset(&mask);
+	for (auto it = signals.cbegin(); it != signals.cend(); ++it)
+		sigaddset(&mask, *it);
+	pthread_sigmask(SIG_BLOCK, &mask, NULL);
+}
+
+void EpollEventLoop::unblockSignals(const std::vector<int> &signals)
+{
+	sigset_t mask;
+	sigemptyset(&mask);
+	for (auto it = signals.cbegin(); it != signals.cend(); ++it)
+		sigaddset(&mask, *it);
+	pthread_sigmask(SIG_UNBLOCK, &mask, NULL);
+}
+
+unsigned EpollEventLoop::addTimeout(unsigned ms, EventSourceFunc fn)
+{
+	unsigned id = m_next_id++;
+	Source &source = insertSource(id);
+	source.type = Source::TIMEOUT;
+	source.fd = -1;
+	source.signo = 0;
+	source.interval = ms;
+	source.deadline = now_ms() + ms;
+	source.fn = fn;
+	source.removed = false;
+	insertTimer(source.deadline, id);
+
+	return id;
+}
+
+unsigned EpollEventLoop::addFd(int fd, uint32_t events, EventFdFunc fn)
+{
+	struct epoll_event ev = {};
+	if (events & IN)
+		ev.events |= EPOLLIN;
+	if (events & OUT)
+		ev.events |= EPOLLOUT;
+	if (events & ERR)
+		ev.events |= EPOLLERR | EPOLLHUP;
+
+	unsigned id = m_next_id;
+	ev.data.u64 = id;
+	if (epoll_ctl(m_epoll_fd, EPOLL_CTL_ADD, fd, &ev) < 0) {
+		Logger::error("EpollEventLoop", "Could not add fd {} to epoll set", fd);
+		return 0;
+	}
+	m_next_id++;
+
+	Source &source = insertSource(id);
+	source.type = Source::FD;
+	source.fd = fd;
+	source.signo = 0;
+	source.interval = 0;
+	source.deadline = 0;
+	source.fd_fn = fn;
+	source.removed = false;
+
+	return id;
+}
+
+unsigned EpollEventLoop::addSignal(int signo, EventSourceFunc fn)
+{
+	if (!sigismember(&m_signals, signo)) {
+		sigaddset(&m_signals, signo);
+
+		// Only takes care of the calling thread, see blockSignals()
+		pthread_sigmask(SIG_BLOCK, &m_signals, NULL);
+
+		bool created = m_signal_fd < 0;
+		m_signal_fd = signalfd(m_signal_fd, &m_signals, SFD_NONBLOCK | SFD_CLOEXEC);
+		if (m_signal_fd < 0) {
+			Logger::error("EpollEventLoop", "Could not create signalfd");
+			return 0;
+		}
+		if (created) {
+			struct epoll_event ev = {};
+			ev.events = EPOLLIN;
+			ev.data.u64 = SIGNAL_ID;
+			epoll_ctl(m_epoll_fd, EPOLL_CTL_ADD, m_signal_fd, &ev);
+		}
+	}
+
+	unsigned id = m_next_id++;
+	Source &source = insertSource(id);
+	source.type = Source::SIGNAL;
+	source.fd = -1;
+	source.signo = signo;
+	source.interval = 0;
+	source.deadline = 0;
+	source.fn = fn;
+	source.removed = false;
+
+	return id;
+}
+
+void EpollEventLoop::remove(unsigned id)
+{
+	auto it = m_sources.find(id);
+	if (it == m_sources.end())
+		return;
+
+	// Do not destroy the callback while it is running
+	if (id == m_dispatching)
+		it->second.removed = true;
+	else
+		erase(id);
+}
+
+void EpollEventLoop::post(std::function<void()> fn)
+{
+	{
+		const std::lock_guard<std::mutex> lock(m_post_mutex);
+		m_posts.push_back(fn);
+	}
+	uint64_t one = 1;
+	if (write(m_event_fd, &one, sizeof(one)) < 0) {
+		// Counter saturated, the loop has been woken up anyway
+	}
+}
+
+void EpollEventLoop::run()
+{
+	struct epoll_event events[MAX_EVENTS];
+
+	while (!m_quit.load(std::memory_order_acquire)) {
+		int n = epoll_wait(m_epoll_fd, events, MAX_EVENTS, next_timeout());
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			Logger::error("EpollEventLoop", "epoll_wait failed ({})", errno);
+			break;
+		}
+
+		for (int i = 0; i < n; i++) {
+			uint64_t id = events[i].data.u64;
+			if (id == POST_ID) {
+				dispatch_posts();
+			} else if (id == SIGNAL_ID) {
+				dispatch_signals();
+			} else {
+				uint32_t flags = 0;
+				if (events[i].events & EPOLLIN)
+					flags |= IN;
+				if (events[i].events & EPOLLOUT)
+					flags |= OUT;
+				if (events[i].events & (EPOLLERR | EPOLLHUP))
+					flags |= ERR;
+				dispatch_fd((unsigned) id, flags);
+			}
+		}
+
+		dispatch_timers();
+	}
+	m_quit.store(false);
+}
+
+void EpollEventLoop::quit()
+{
+	m_quit.store(true, std::memory_order_release);
+	uint64_t one = 1;
+	if (write(m_event_fd, &one, sizeof(one)) < 0) {
+		// Counter saturated, the loop has been woken up anyway
+	}
+}
+
+// Private
+
+uint64_t EpollEventLoop::now_ms()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+int EpollEventLoop::next_timeout()
+{
+	if (m_timers.empty())
+		return -1;
+
+	uint64_t now = now_ms();
+	uint64_t deadline = m_timers.begin()->first;
+	if (deadline <= now)
+		return 0;
+
+	return (int) (deadline - now);
+}
+
+void EpollEventLoop::dispatch_fd(unsigned id, uint32_t events)
+{
+	auto it = m_sources.find(id);
+	if (it == m_sources.end() || it->second.removed)
+		return;
+
+	m_dispatching = id;
+	bool keep = it->second.fd_fn && it->second.fd_fn(events);
+	m_dispatching = 0;
+	finish_dispatch(id, keep);
+}
+
+void EpollEventLoop::dispatch_signals()
+{
+	struct signalfd_siginfo info;
+	while (read(m_signal_fd, &info, sizeof(info)) == sizeof(info)) {
+		std::vector<unsigned> ids;
+		for (auto it = m_sources.cbegin(); it != m_sources.cend(); ++it) {
+			if (it->second.type == Source::SIGNAL && it->second.signo == (int) info.ssi_signo)
+				ids.push_back(it->first);
+		}
+
+		for (auto id = ids.cbegin(); id != ids.cend(); ++id) {
+			auto it = m_sources.find(*id);
+			if (it == m_sources.end() || it->second.removed)
+				continue;
+
+			m_dispatching = *id;
+			bool keep = it->second.fn && it->second.fn();
+			m_dispatching = 0;
+			finish_dispatch(*id, keep);
+		}
+	}
+}
+
+void EpollEventLoop::dispatch_timers()
+{
+	// Collect what is due first so a zero interval timer that keeps
+	// rescheduling itself cannot starve the fds
+	uint64_t now = now_ms();
+	m_due.clear();
+	while (!m_timers.empty() && m_timers.begin()->first <= now) {
+		m_due.push_back(m_timers.begin()->second);
+		eraseTimer(m_timers.begin());
+	}
+
+	for (auto id_it = m_due.cbegin(); id_it != m_due.cend(); ++id_it) {
+		unsigned id = *id_it;
+		auto it = m_sources.find(id);
+		if (it == m_sources.end() || it->second.removed)
+			continue;
+
+		m_dispatching = id;
+		bool keep = it->second.fn && it->second.fn();
+		m_dispatching = 0;
+		finish_dispatch(id, keep);
+	}
+}
+
+void EpollEventLoop::dispatch_posts()
+{
+	uint64_t count;
+	if (read(m_event_fd, &count, sizeof(count)) < 0) {
+		// Spurious wakeup, still check the queue
+	}
+
+	{
+		const std::lock_guard<std::mutex> lock(m_post_mutex);
+		m_dispatched_posts.swap(m_posts);
+	}
+	for (auto it = m_dispatched_posts.begin(); it != m_dispatched_posts.end(); ++it) {
+		if (*it)
+			(*it)();
+	}
+	m_dispatched_posts.clear();
+}
+
+void EpollEventLoop::finish_dispatch(unsigned id, bool keep)
+{
+	auto it = m_sources.find(id);
+	if (it == m_sources.end())
+		return;
+
+	if (!keep || it->second.removed) {
+		erase(id);
+		return;
+	}
+
+	if (it->second.type == Source::TIMEOUT) {
+		it->second.deadline = now_ms() + it->second.interval;
+		insertTimer(it->second.deadline, id);
+	}
+}
+
+void EpollEventLoop::erase(unsigned id)
+{
+	auto it = m_sources.find(id);
+	if (it == m_sources.end())
+		return;
+
+	if (it->second.type == Source::TIMEOUT) {
+		auto timer = m_timers.find(std::make_pair(it->second.deadline, id));
+		if (timer != m_timers.end())
+			eraseTimer(timer);
+	} else if (it->second.type == Source::FD) {
+		epoll_ctl(m_epoll_fd, EPOLL_CTL_DEL, it->second.fd, NULL);
+	}
+
+	if (m_spare_sources.size() >= SPARE_NODES) {
+		m_sources.erase(it);
+		return;
+	}
+	auto node = m_sources.extract(it);
+	node.mapped().fn = nullptr;
+	node.mapped().fd_fn = nullptr;
+	m_spare_sources.push_back(std::move(node));
+}
+
+EpollEventLoop::Source &EpollEventLoop::insertSource(unsigned id)
+{
+	if (m_spare_sources.empty())
+		return m_sources[id];
+
+	auto node = std::move(m_spare_sources.back());
+	m_spare_sources.pop_back();
+	node.key() = id;
+	return m_sources.insert(std::move(node)).position->second;
+}
+
+void EpollEventLoop::insertTimer(uint64_t deadline, unsigned id)
+{
+	if (m_spare_timers.empty()) {
+		m_timers.insert(std::make_pair(deadline, id));
+		return;
+	}
+
+	auto node = std::move(m_spare_timers.back());
+	m_spare_timers.pop_back();
+	node.value() = std::make_pair(deadline, id);
+	m_timers.insert(std::move(node));
+}
+
+void EpollEventLoop::eraseTimer(std::set<std::pair<uint64_t, unsigned>>::iterator it)
+{
+	if (m_spare_timers.size() >= SPARE_NODES)
+		m_timers.erase(it);
+	else
+		m_spare_timers.push_back(m_timers.extract(it));
+}
@@ -0,0 +1,122 @@
+/*
+ * Copyright (C) 2023 Konsulko Group
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#ifndef _EPOLL_EVENT_LOOP_H
+#define _EPOLL_EVENT_LOOP_H
+
+#include <map>
+#include <set>
+#include <vector>
+#include <mutex>
+#include <atomic>
+#include <signal.h>
+
+#include "EventLoop.h"
+
+// Single-threaded epoll reactor
+//
+// File descriptors, timers (kept in a deadline ordered set and used to
+// compute the epoll_wait timeout), signals (via a signalfd) and work
+// posted from other threads (via an eventfd) are all dispatched from the
+// thread calling run().
+//
+// Signals handled through addSignal() must be blocked in every thread,
+// so they need to be added (or blocked with blockSignals()) before any
+// other threads are created.
+
+class EpollEventLoop : public EventLoop
+{
+public:
+	EpollEventLoop();
+
+	~EpollEventLoop();
+
+	bool valid() { return m_epoll_fd >= 0 && m_event_fd >= 0; };
+
+	// Block signals for the calling thread (and threads it creates
+	// afterwards) so they can be delivered via the signalfd
+	static void blockSignals(const std::vector<int> &signals);
+
+	static void unblockSignals(const std::vector<int> &signals);
+
+	unsigned addTimeout(unsigned ms, EventSourceFunc fn) override;
+
+	unsigned addFd(int fd, uint32_t events, EventFdFunc fn) override;
+
+	unsigned addSignal(int signo, EventSourceFunc fn) override;
+
+	void remove(unsigned id) override;
+
+	void post(std::function<void()> fn) override;
+
+	void run() override;
+
+	void quit() override;
+
+private:
+	struct Source {
+		enum { TIMEOUT, FD, SIGNAL } type;
+		int fd;
+		int signo;
+		unsigned interval;
+		uint64_t deadline;
+		EventSourceFunc fn;
+		EventFdFunc fd_fn;
+		bool removed;
+	};
+
+	// Reserved epoll data values
+	enum {
+		POST_ID = 0,
+		SIGNAL_ID = 1,
+		FIRST_ID = 2
+	};
+
+	static uint64_t now_ms();
+
+	int next_timeout();
+
+	void dispatch_fd(unsigned id, uint32_t events);
+
+	void dispatch_signals();
+
+	void dispatch_timers();
+
+	void dispatch_posts();
+
+	void finish_dispatch(unsigned id, bool keep);
+
+	void erase(unsigned id);
+
+	// Sources and timers come and go all the time (e.g. the LED update
+	// timeout), their map and set nodes are recycled rather than freed
+	Source &insertSource(unsigned id);
+
+	void insertTimer(uint64_t deadline, unsigned id);
+
+	void eraseTimer(std::set<std::pair<uint64_t, unsigned>>::iterator it);
+
+	int m_epoll_fd;
+	int m_event_fd;
+	int m_signal_fd;
+	sigset_t m_signals;
+
+	unsigned m_next_id;
+	unsigned m_dispatching;
+	std::map<unsigned, Source> m_sources;
+	std::set<std::pair<uint64_t, unsigned>> m_timers;
+	std::vector<std::map<unsigned, Source>::node_type> m_spare_sources;
+	std::vector<std::set<std::pair<uint64_t, unsigned>>::node_type> m_spare_timers;
+	std::vector<unsigned> m_due;
+
+	// Swapped with m_dispatched_posts, so both keep their capacity
+	std::mutex m_post_mutex;
+	std::vector<std::function<void()>> m_posts;
+	std::vector<std::function<void()>> m_dispatched_posts;
+	std::atomic<bool> m_quit;
+};
+
+#endif // _EPOLL_EVENT_LOOP_H
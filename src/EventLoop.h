@@ -0,0 +1,54 @@
+/*
+ * Copyright (C) 2023 Konsulko Group
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#ifndef _EVENT_LOOP_H
+#define _EVENT_LOOP_H
+
+#include <cstdint>
+#include <functional>
+
+// Callbacks return true to keep the source, false to remove it
+typedef std::function<bool()> EventSourceFunc;
+typedef std::function<bool(uint32_t events)> EventFdFunc;
+
+// Main event loop interface
+//
+// Implemented on top of GLib (GLibEventLoop, the default) and as a
+// single-threaded epoll reactor (EpollEventLoop).  Sources may only be
+// added and removed from the loop thread; post() and quit() are safe to
+// call from any thread.
+
+class EventLoop
+{
+public:
+	// fd event flags
+	enum {
+		IN = 1 << 0,
+		OUT = 1 << 1,
+		ERR = 1 << 2
+	};
+
+	virtual ~EventLoop() {};
+
+	virtual unsigned addTimeout(unsigned ms, EventSourceFunc fn) = 0;
+
+	virtual unsigned addFd(int fd, uint32_t events, EventFdFunc fn) = 0;
+
+	virtual unsigned addSignal(int signo, EventSourceFunc fn) = 0;
+
+	// Remove a source that is still active, i.e. whose callback has
+	// not returned false
+	virtual void remove(unsigned id) = 0;
+
+	// Run fn on the loop thread
+	virtual void post(std::function<void()> fn) = 0;
+
+	virtual void run() = 0;
+
+	virtual void quit() = 0;
+};
+
+#endif // _EVENT_LOOP_H
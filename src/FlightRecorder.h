@@ -0,0 +1,136 @@
+/*
+ * Copyright (C) 2023 Konsulko Group
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#ifndef _FLIGHT_RECORDER_H
+#define _FLIGHT_RECORDER_H
+
+#include <cstdint>
+#include <string>
+#include <vector>
+#include <atomic>
+
+// Always-on history of actuator commands and what became of them
+//
+// Events go into a fixed-size ring in an mmap'd file, so recording is a
+// few stores into the page cache (no locks, no syscalls) and whatever
+// was recorded survives the process crashing.  The file is kept across
+// restarts, new events continue after the old ones; agl-hvac-flightdump
+// decodes it.
+//
+// The file is a 64 byte FlightHeader followed by capacity 32 byte
+// FlightRecords, in host byte order.  Event n goes into slot
+// n % capacity.  A record's seq is zeroed while it is written and set to
+// n + 1 last, so a record torn by a crash is recognized and skipped.
+// Timestamps come from the coarse clock (a tick, i.e. a few ms, of
+// resolution), the sequence numbers give the exact order.
+
+#define FLIGHT_MAGIC	0x544c4646	// "FFLT"
+#define FLIGHT_VERSION	2	// 2: fan speed always the VSS value
+
+struct FlightHeader {
+	uint32_t magic;
+	uint32_t version;
+	uint32_t capacity;		// records, a power of two
+	uint32_t record_size;
+	std::atomic<uint64_t> next;	// number of the next event
+	uint8_t reserved[40];
+};
+
+struct FlightRecord {
+	std::atomic<uint64_t> seq;	// event number + 1, 0 while written
+	uint64_t time;			// CLOCK_REALTIME_COARSE in ns
+	int64_t value;
+	uint16_t signal;		// FlightRecorder::SignalId
+	uint8_t source;			// FlightRecorder::Source
+	uint8_t outcome;		// FlightRecorder::Outcome
+	int32_t detail;			// errno, gRPC status or broker error code
+};
+
+// A record copied out of the ring
+struct FlightEvent {
+	uint64_t seq;
+	uint64_t time;
+	int64_t value;
+	uint16_t signal;
+	uint8_t source;
+	uint8_t outcome;
+	int32_t detail;
+};
+
+class FlightRecorder
+{
+public:
+	enum SignalId : uint16_t {
+		SIGNAL_NONE = 0,
+		TEMP_LEFT,
+		TEMP_RIGHT,
+		FAN_SPEED_LEFT,
+		FAN_SPEED_RIGHT,
+		AC,
+		FRONT_DEFROST,
+		REAR_DEFROST,
+		RECIRCULATION,
+		STATE,			// value is packState()
+		CAN_FRAME,		// value is packState() of the state sent
+		SIGNAL_COUNT
+	};
+
+	enum Source : uint8_t {
+		SOURCE_STARTUP = 0,
+		SOURCE_BROKER,
+		SOURCE_CAN,
+		SOURCE_COUNT
+	};
+
+	enum Outcome : uint8_t {
+		STARTED = 0,		// value is the pid
+		RECEIVED,		// command from the broker
+		RESTORED,		// saved state applied
+		TX_OK,
+		TX_RETRY,		// transmit queue full, resent later
+		TX_FAILED,
+		SET_ERROR,		// write back rejected by the broker
+		SET_FAILED,		// write back call failed
+		OUTCOME_COUNT
+	};
+
+	// The default capacity keeps 128 KB of history
+	explicit FlightRecorder(const std::string &path, unsigned capacity = 4096);
+
+	~FlightRecorder();
+
+	bool valid() { return m_records != NULL; };
+
+	// Lock-free, safe to call from any thread; a no-op if the file
+	// could not be set up
+	void record(SignalId signal, Source source, Outcome outcome, int64_t value = 0, int32_t detail = 0);
+
+	// temperatures, fan speed (VSS 0-100, also for CAN frames) and the
+	// flags (ac, front defrost, rear defrost, recirculation from bit 24
+	// on) in one value
+	static int64_t packState(uint8_t temp_left, uint8_t temp_right, uint8_t fan_speed, unsigned flags = 0);
+
+	// The events in a recording, oldest first; false if path is not one
+	static bool read(const std::string &path, std::vector<FlightEvent> &events);
+
+	static const char *signalName(unsigned signal);
+
+	static const char *sourceName(unsigned source);
+
+	static const char *outcomeName(unsigned outcome);
+
+	// Next to the saved state (see HvacStateStore::defaultPath)
+	static std::string defaultPath(const std::string &vehicle = "");
+
+private:
+	std::string m_path;
+	size_t m_size;
+	FlightHeader *m_header;
+	FlightRecord *m_records;
+	uint64_t m_mask;
+};
+
+#endif // _FLIGHT_RECORDER_H
@@ -0,0 +1,136 @@
+/*
+ * Copyright (C) 2023 Konsulko Group
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#include <glib-unix.h>
+
+#include "GLibEventLoop.h"
+
+GLibEventLoop::GLibEventLoop() :
+	m_loop(NULL)
+{
+	m_loop = g_main_loop_new(NULL, FALSE);
+}
+
+GLibEventLoop::~GLibEventLoop()
+{
+	if (m_loop)
+		g_main_loop_unref(m_loop);
+}
+
+unsigned GLibEventLoop::addTimeout(unsigned ms, EventSourceFunc fn)
+{
+	return g_timeout_add_full(G_PRIORITY_DEFAULT,
+				  ms,
+				  source_cb,
+				  new EventSourceFunc(fn),
+				  destroy_source_func);
+}
+
+unsigned GLibEventLoop::addFd(int fd, uint32_t events, EventFdFunc fn)
+{
+	int condition = 0;
+	if (events & IN)
+		condition |= G_IO_IN;
+	if (events & OUT)
+		condition |= G_IO_OUT;
+	if (events & ERR)
+		condition |= G_IO_ERR | G_IO_HUP;
+
+	return g_unix_fd_add_full(G_PRIORITY_DEFAULT,
+				  fd,
+				  (GIOCondition) condition,
+				  fd_cb,
+				  new EventFdFunc(fn),
+				  destroy_fd_func);
+}
+
+unsigned GLibEventLoop::addSignal(int signo, EventSourceFunc fn)
+{
+	return g_unix_signal_add_full(G_PRIORITY_DEFAULT,
+				      signo,
+				      source_cb,
+				      new EventSourceFunc(fn),
+				      destroy_source_func);
+}
+
+void GLibEventLoop::remove(unsigned id)
+{
+	if (id)
+		g_source_remove(id);
+}
+
+void GLibEventLoop::post(std::function<void()> fn)
+{
+	// g_idle_add is safe to call from any thread for the default context
+	g_idle_add_full(G_PRIORITY_DEFAULT,
+			post_cb,
+			new std::function<void()>(fn),
+			destroy_post_func);
+}
+
+void GLibEventLoop::run()
+{
+	if (m_loop)
+		g_main_loop_run(m_loop);
+}
+
+void GLibEventLoop::quit()
+{
+	if (m_loop)
+		g_idle_add(G_SOURCE_FUNC(g_main_loop_quit), m_loop);
+}
+
+// Private
+
+gboolean GLibEventLoop::source_cb(gpointer data)
+{
+	EventSourceFunc *fn = (EventSourceFunc*) data;
+	if (fn && *fn && (*fn)())
+		return G_SOURCE_CONTINUE;
+
+	return G_SOURCE_REMOVE;
+}
+
+gboolean GLibEventLoop::fd_cb(gint fd, GIOCondition condition, gpointer data)
+{
+	EventFdFunc *fn = (EventFdFunc*) data;
+	uint32_t events = 0;
+	if (condition & G_IO_IN)
+		events |= IN;
+	if (condition & G_IO_OUT)
+		events |= OUT;
+	if (condition & (G_IO_ERR | G_IO_HUP | G_IO_NVAL))
+		events |= ERR;
+
+	if (fn && *fn && (*fn)(events))
+		return G_SOURCE_CONTINUE;
+
+	return G_SOURCE_REMOVE;
+}
+
+gboolean GLibEventLoop::post_cb(gpointer data)
+{
+	std::function<void()> *fn = (std::function<void()>*) data;
+	if (fn && *fn)
+		(*fn)();
+
+	return G_SOURCE_REMOVE;
+}
+
+void GLibEventLoop::destroy_source_func(gpointer data)
+{
+	delete (EventSourceFunc*) data;
+}
+
+void GLibEventLoop::destroy_fd_func(gpointer data)
+{
+	delete (EventFdFunc*) data;
+}
+
+void GLibEventLoop::destroy_post_func(gpointer data)
+{
+	delete (std::function<void()>*) data;
+}
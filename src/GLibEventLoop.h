@@ -0,0 +1,55 @@
+/*
+ * Copyright (C) 2023 Konsulko Group
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#ifndef _GLIB_EVENT_LOOP_H
+#define _GLIB_EVENT_LOOP_H
+
+#include <glib.h>
+
+#include "EventLoop.h"
+
+// EventLoop on top of the GLib default main context
+
+class GLibEventLoop : public EventLoop
+{
+public:
+	GLibEventLoop();
+
+	~GLibEventLoop();
+
+	bool valid() { return m_loop != NULL; };
+
+	unsigned addTimeout(unsigned ms, EventSourceFunc fn) override;
+
+	unsigned addFd(int fd, uint32_t events, EventFdFunc fn) override;
+
+	unsigned addSignal(int signo, EventSourceFunc fn) override;
+
+	void remove(unsigned id) override;
+
+	void post(std::function<void()> fn) override;
+
+	void run() override;
+
+	void quit() override;
+
+private:
+	static gboolean source_cb(gpointer data);
+
+	static gboolean fd_cb(gint fd, GIOCondition condition, gpointer data);
+
+	static gboolean post_cb(gpointer data);
+
+	static void destroy_source_func(gpointer data);
+
+	static void destroy_fd_func(gpointer data);
+
+	static void destroy_post_func(gpointer data);
+
+	GMainLoop *m_loop;
+};
+
+#endif // _GLIB_EVENT_LOOP_H
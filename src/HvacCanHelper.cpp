@@ -5,30 +5,30 @@
  */
 
 #include "HvacCanHelper.h"
-#include <iostream>
-#include <iomanip>
-#include <sstream>
+#include "Logger.h"
+#include <cstring>
+#include <cerrno>
 #include <unistd.h>
 #include <sys/socket.h>
 #include <sys/ioctl.h>
 #include <net/if.h>
-#include <boost/property_tree/ptree.hpp>
-#include <boost/property_tree/ini_parser.hpp>
-#include <boost/property_tree/ini_parser.hpp>
 
-namespace property_tree = boost::property_tree;
+// Back-off while the interface transmit queue is full
+#define CAN_RETRY_MS 5
 
-HvacCanHelper::HvacCanHelper() :
+HvacCanHelper::HvacCanHelper(std::shared_ptr<const HvacConfig> config, EventLoop *loop) :
+	m_loop(loop),
+	m_recorder(NULL),
+	m_timestamps(loop),
+	m_received_ns(0),
+	m_retry_source(0),
 	m_temp_left(21),
 	m_temp_right(21),
 	m_fan_speed(0),
-	m_port("can0"),
-	m_config_valid(false),
+	m_config(config),
 	m_active(false),
-	m_verbose(0)
+	m_down_recorded(false)
 {
-	read_config();
-
 	can_open();
 }
 
@@ -37,63 +37,14 @@ HvacCanHelper::~HvacCanHelper()
 	can_close();
 }
 
-void HvacCanHelper::read_config()
-{
-	// Using a separate configuration file now, it may make sense
-	// to revisit this if a workable scheme to handle overriding
-	// values for the full demo setup can be come up with.
-	std::string config("/etc/xdg/AGL/agl-service-hvac-can.conf");
-	char *home = getenv("XDG_CONFIG_HOME");
-	if (home) {
-		config = home;
-		config += "/AGL/agl-service-hvac.conf";
-	}
-
-	std::cout << "Using configuration " << config << std::endl;
-	property_tree::ptree pt;
-	try {
-		property_tree::ini_parser::read_ini(config, pt);
-	}
-	catch (std::exception &ex) {
-		// Continue with defaults if file missing/broken
-		std::cerr << "Could not read " << config << std::endl;
-		m_config_valid = true;
-		return;
-	}
-	const property_tree::ptree &settings =
-		pt.get_child("can", property_tree::ptree());
-
-	m_port = settings.get("port", "can0");
-	std::stringstream ss;
-	ss << m_port;
-	ss >> std::quoted(m_port);
-	if (m_port.empty()) {
-		std::cerr << "Invalid CAN port path" << std::endl;
-		return;
-	}
-
-	m_verbose = 0;
-	std::string verbose = settings.get("verbose", "");
-	std::stringstream().swap(ss);
-	ss << verbose;
-	ss >> std::quoted(verbose);
-	if (!verbose.empty()) {
-		if (verbose == "true" || verbose == "1")
-			m_verbose = 1;
-		if (verbose == "2")
-			m_verbose = 2;
-	}
-
-	m_config_valid = true;
-}
-
 void HvacCanHelper::can_open()
 {
-	if (!m_config_valid)
+	if (!(m_config && m_config->can().valid))
 		return;
 
-	if (m_verbose > 1)
-		std::cout << "HvacCanHelper::HvacCanHelper: using port " << m_port << std::endl;
+	const std::string &port = m_config->can().port;
+	if (m_config->can().verbose > 1)
+		Logger::debug("HvacCanHelper", "Using port {}", port);
 
 	// Open raw CAN socket
 	m_can_socket = socket(PF_CAN, SOCK_RAW, CAN_RAW);
@@ -103,7 +54,8 @@ void HvacCanHelper::can_open()
 
 	// Look up port address
 	struct ifreq ifr;
-	strcpy(ifr.ifr_name, m_port.c_str());
+	strncpy(ifr.ifr_name, port.c_str(), IFNAMSIZ - 1);
+	ifr.ifr_name[IFNAMSIZ - 1] = '\0';
 	if (ioctl(m_can_socket, SIOCGIFINDEX, &ifr) < 0) {
 		close(m_can_socket);
 		return;
@@ -117,14 +69,51 @@ void HvacCanHelper::can_open()
 	}
 
 	m_active = true;
-	if (m_verbose > 1)
-		std::cout << "HvacCanHelper::HvacCanHelper: opened " << m_port << std::endl;
+	m_down_recorded = false;
+	if (m_config->can().verbose > 1)
+		Logger::debug("HvacCanHelper", "Opened {}", port);
+
+	TxTimestamper::Mode mode = TxTimestamper::OFF;
+	TxTimestamper::parseMode(m_config->can().txTimestamping, mode);
+	if (mode != TxTimestamper::OFF) {
+		m_timestamps.start(m_can_socket, mode, port);
+	}
 }
 
 void HvacCanHelper::can_close()
 {
+	if (m_retry_source) {
+		m_loop->remove(m_retry_source);
+		m_retry_source = 0;
+	}
+	m_timestamps.stop();
 	if (m_active)
 		close(m_can_socket);
+	m_active = false;
+}
+
+void HvacCanHelper::reload(std::shared_ptr<const HvacConfig> config)
+{
+	if (!config)
+		return;
+
+	if (!config->can().valid) {
+		Logger::warning("HvacCanHelper", "Keeping previous CAN configuration");
+		return;
+	}
+
+	std::shared_ptr<const HvacConfig> old = m_config;
+	m_config = config;
+	if (old && old->can().port == config->can().port &&
+	    old->can().txTimestamping == config->can().txTimestamping && m_active)
+		return;
+
+	Logger::info("HvacCanHelper", "Rebinding CAN socket to {}", config->can().port);
+	can_close();
+	can_open();
+
+	// Bring the new port up to date with the current state
+	can_update();
 }
 
 void HvacCanHelper::set_left_temperature(uint8_t temp)
@@ -141,39 +130,103 @@ void HvacCanHelper::set_right_temperature(uint8_t temp)
 
 void HvacCanHelper::set_fan_speed(uint8_t speed)
 {
-	// Scale incoming 0-100 VSS signal to 0-255 to match hardware expectations
-	double value = speed * 255.0 / 100.0;
-	m_fan_speed = (uint8_t) (value + 0.5);
+	m_fan_speed = speed;
 	can_update();
 }
 
-void HvacCanHelper::can_update()
+void HvacCanHelper::set_state(uint8_t temp_left, uint8_t temp_right, uint8_t speed, uint64_t received_ns)
 {
-	if (!m_active)
-		return;
+	m_received_ns = received_ns;
+	m_temp_left = temp_left;
+	m_temp_right = temp_right;
+	m_fan_speed = speed;
+	can_update();
+}
 
-	struct can_frame frame;
+void HvacCanHelper::make_frame(uint8_t temp_left, uint8_t temp_right, uint8_t speed,
+			       struct can_frame &frame)
+{
 	frame.can_id = 0x30;
 	frame.can_dlc = 8;
-	frame.data[0] = convert_temp(m_temp_left);
-	frame.data[1] = convert_temp(m_temp_right);
-	frame.data[2] = convert_temp((uint8_t) (((int) m_temp_left + (int) m_temp_right) >> 1));
+	frame.data[0] = convert_temp(temp_left);
+	frame.data[1] = convert_temp(temp_right);
+	frame.data[2] = convert_temp((uint8_t) (((int) temp_left + (int) temp_right) >> 1));
 	frame.data[3] = 0xF0;
-	frame.data[4] = m_fan_speed;
+	frame.data[4] = convert_fan_speed(speed);
 	frame.data[5] = 1;
 	frame.data[6] = 0;
 	frame.data[7] = 0;
+}
 
+void HvacCanHelper::can_update()
+{
+	// Recorded once per outage, not for every change made meanwhile
+	if (!m_active) {
+		if (!m_down_recorded)
+			record(FlightRecorder::TX_FAILED, ENETDOWN);
+		m_down_recorded = true;
+		return;
+	}
+
+	// A resend is already pending, it will pick up the current state
+	if (m_retry_source)
+		return;
+
+	struct can_frame frame;
+	make_frame(m_temp_left, m_temp_right, m_fan_speed, frame);
+
+	uint64_t send_ns = m_timestamps.enabled() ? TxTimestamper::now() : 0;
 	auto written = sendto(m_can_socket,
 			      &frame,
 			      sizeof(struct can_frame),
-			      0,
+			      MSG_DONTWAIT,
 			      (struct sockaddr*) &m_can_addr,
 			      sizeof(m_can_addr));
 	if (written < 0) {
-		std::cerr << "Write to " << m_port << " failed!" << std::endl;
+		int error = errno;
+		if ((error == EAGAIN || error == EWOULDBLOCK || error == ENOBUFS) && m_loop) {
+			record(FlightRecorder::TX_RETRY, error);
+			can_retry(error == ENOBUFS);
+			return;
+		}
+		record(FlightRecorder::TX_FAILED, error);
+		Logger::error("HvacCanHelper", "Write to {} failed!", m_config->can().port);
 		close(m_can_socket);
 		m_active = false;
+		m_down_recorded = true;
+		return;
+	}
+	record(FlightRecorder::TX_OK);
+	m_timestamps.sent(send_ns, m_received_ns);
+}
+
+void HvacCanHelper::record(FlightRecorder::Outcome outcome, int detail)
+{
+	if (m_recorder)
+		m_recorder->record(FlightRecorder::CAN_FRAME, FlightRecorder::SOURCE_CAN, outcome,
+				   FlightRecorder::packState(m_temp_left, m_temp_right, m_fan_speed), detail);
+}
+
+void HvacCanHelper::can_retry(bool queue_full)
+{
+	if (m_config->can().verbose > 1)
+		Logger::debug("HvacCanHelper", "{} busy, retrying", m_config->can().port);
+
+	// CAN_RAW reports a full interface queue as ENOBUFS without the
+	// socket ever polling as not writable, so that case is retried on
+	// a timer instead of waiting for POLLOUT.
+	if (queue_full) {
+		m_retry_source = m_loop->addTimeout(CAN_RETRY_MS, [this]() {
+			m_retry_source = 0;
+			can_update();
+			return false;
+		});
+	} else {
+		m_retry_source = m_loop->addFd(m_can_socket, EventLoop::OUT, [this](uint32_t events) {
+			m_retry_source = 0;
+			can_update();
+			return false;
+		});
 	}
 }
 
@@ -9,12 +9,22 @@
 
 #include <cstdint>
 #include <string>
+#include <memory>
 #include <linux/can.h>
 
+#include "HvacConfig.h"
+#include "EventLoop.h"
+#include "FlightRecorder.h"
+#include "TxTimestamper.h"
+
+// All methods are expected to be called from the event loop thread.  The
+// socket is never blocked on; if the transmit queue is full the frame is
+// resent (with the then current state) once there is room again.
+
 class HvacCanHelper
 {
 public:
-	HvacCanHelper();
+	explicit HvacCanHelper(std::shared_ptr<const HvacConfig> config, EventLoop *loop = NULL);
 
 	~HvacCanHelper();
 
@@ -24,8 +34,27 @@ public:
 
 	void set_fan_speed(uint8_t temp);
 
+	// Set everything at once with a single frame, e.g. when restoring
+	// saved state; received_ns is when the update behind it came in,
+	// for the tx-timestamping latencies
+	void set_state(uint8_t temp_left, uint8_t temp_right, uint8_t speed, uint64_t received_ns = 0);
+
+	// Build the HVAC control frame; speed is the VSS 0-100 value
+	static void make_frame(uint8_t temp_left, uint8_t temp_right, uint8_t speed,
+			       struct can_frame &frame);
+
+	// Apply a new configuration, rebinding the socket if the port
+	// changed; current temperature and fan state are kept.
+	void reload(std::shared_ptr<const HvacConfig> config);
+
+	// True while a frame is waiting for room to be resent
+	bool busy() const { return m_retry_source != 0; };
+
+	// Record the outcome of every frame sent
+	void setRecorder(FlightRecorder *recorder) { m_recorder = recorder; };
+
 private:
-	uint8_t convert_temp(uint8_t value) {
+	static uint8_t convert_temp(uint8_t value) {
 		int result = ((0xF0 - 0x10) / 15) * (value - 15) + 0x10;
 		if (result < 0x10)
 			result = 0x10;
@@ -35,7 +64,11 @@ private:
 		return (uint8_t) result;
 	}
 
-	void read_config();
+	static uint8_t convert_fan_speed(uint8_t speed) {
+		// Scale incoming 0-100 VSS signal to 0-255 to match hardware expectations
+		double value = speed * 255.0 / 100.0;
+		return (uint8_t) (value + 0.5);
+	}
 
 	void can_open();
 
@@ -43,16 +76,24 @@ private:
 
 	void can_update();
 
-	std::string m_port;
-	unsigned m_verbose;
-	bool m_config_valid;
+	void can_retry(bool queue_full);
+
+	void record(FlightRecorder::Outcome outcome, int detail = 0);
+
+	EventLoop *m_loop;
+	FlightRecorder *m_recorder;
+	TxTimestamper m_timestamps;
+	uint64_t m_received_ns;		// behind the current state
+	unsigned m_retry_source;
+	std::shared_ptr<const HvacConfig> m_config;
 	bool m_active;
+	bool m_down_recorded;		// the outage is in the flight recorder
 	int m_can_socket;
 	struct sockaddr_can m_can_addr;
 
 	uint8_t m_temp_left;
 	uint8_t m_temp_right;
-	uint8_t m_fan_speed;
+	uint8_t m_fan_speed;		// VSS 0-100, scaled in the frame
 };
 
 #endif // _HVAC_CAN_HELPER_H
@@ -0,0 +1,496 @@
+/*
+ * Copyright (C) 2023 Konsulko Group
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#include <fstream>
+#include <sstream>
+#include <map>
+#include <cstdlib>
+#include <cstring>
+#include <algorithm>
+#include <sched.h>
+#include <dirent.h>
+
+#include "HvacConfig.h"
+#include "Logger.h"
+
+#define DEFAULT_CA_CERT_FILE     "/etc/kuksa-val/CA.pem"
+
+#define DEFAULT_LED_RED   "/sys/class/leds/blinkm-3-9-red/brightness"
+#define DEFAULT_LED_GREEN "/sys/class/leds/blinkm-3-9-green/brightness"
+#define DEFAULT_LED_BLUE  "/sys/class/leds/blinkm-3-9-blue/brightness"
+
+namespace {
+
+typedef std::map<std::string, std::string> IniSection;
+typedef std::map<std::string, IniSection> IniFile;
+
+std::string trim(const std::string &s)
+{
+	auto begin = s.find_first_not_of(" \t\r\n");
+	if (begin == std::string::npos)
+		return std::string();
+	auto end = s.find_last_not_of(" \t\r\n");
+	return s.substr(begin, end - begin + 1);
+}
+
+// Values may be written quoted, strip the quotes and escapes the same
+// way std::quoted would.
+std::string unquote(const std::string &s)
+{
+	if (s.size() < 2 || s.front() != '"')
+		return s;
+
+	std::string result;
+	for (size_t i = 1; i < s.size(); i++) {
+		if (s[i] == '\\' && i + 1 < s.size()) {
+			result += s[++i];
+		} else if (s[i] == '"') {
+			break;
+		} else {
+			result += s[i];
+		}
+	}
+	return result;
+}
+
+// Minimal INI parser covering what boost::property_tree::ini_parser
+// accepted for our files: [section] headers, key=value pairs and ';' or
+// '#' comment lines.
+bool parse_ini(const std::string &path, IniFile &ini)
+{
+	std::ifstream file(path);
+	if (!file.is_open())
+		return false;
+
+	IniSection *section = &ini[""];
+	std::string line;
+	unsigned lineno = 0;
+	while (std::getline(file, line)) {
+		lineno++;
+		line = trim(line);
+		if (line.empty() || line[0] == ';' || line[0] == '#')
+			continue;
+
+		if (line[0] == '[') {
+			auto end = line.find(']');
+			if (end == std::string::npos) {
+				Logger::error("HvacConfig", "{}:{}: unterminated section header", path, lineno);
+				return false;
+			}
+			section = &ini[trim(line.substr(1, end - 1))];
+			continue;
+		}
+
+		auto eq = line.find('=');
+		if (eq == std::string::npos) {
+			Logger::error("HvacConfig", "{}:{}: expected key = value", path, lineno);
+			return false;
+		}
+		(*section)[trim(line.substr(0, eq))] = unquote(trim(line.substr(eq + 1)));
+	}
+
+	return !file.bad();
+}
+
+std::string get(const IniFile &ini, const std::string &section, const std::string &key, const std::string &def)
+{
+	auto s = ini.find(section);
+	if (s == ini.end())
+		return def;
+	auto v = s->second.find(key);
+	if (v == s->second.end())
+		return def;
+	return v->second;
+}
+
+unsigned get_verbose(const IniFile &ini, const std::string &section)
+{
+	std::string verbose = get(ini, section, "verbose", "");
+	if (verbose == "true" || verbose == "1")
+		return 1;
+	if (verbose == "2")
+		return 2;
+	return 0;
+}
+
+// "host", "host:port", "[address]" or "[address]:port" to "host:port";
+// a bare IPv6 address gets the default port as well.  "unix:" socket
+// paths are taken as they are.
+bool parse_endpoint(const std::string &item, unsigned default_port, std::string &endpoint)
+{
+	if (HvacConfig::isUnixEndpoint(item)) {
+		if (item.find_first_not_of('/', strlen("unix:")) == std::string::npos)
+			return false;
+		endpoint = item;
+		return true;
+	}
+
+	std::string host = item;
+	unsigned port = default_port;
+	auto colon = item.rfind(':');
+	if (colon != std::string::npos &&
+	    (item[0] == '[' ? item[colon - 1] == ']' : item.find(':') == colon)) {
+		host = item.substr(0, colon);
+		char *end;
+		port = strtoul(item.c_str() + colon + 1, &end, 10);
+		if (*end || end == item.c_str() + colon + 1)
+			return false;
+	}
+	if (host.empty() || port == 0 || port > 65535)
+		return false;
+
+	if (host.find(':') != std::string::npos && host[0] != '[')
+		host = "[" + host + "]";
+	endpoint = host + ":" + std::to_string(port);
+	return true;
+}
+
+// Invalid settings are reported and ignored, running without them is
+// preferable to not running at all.
+HvacConfig::Sched get_sched(const IniFile &ini, const std::string &section)
+{
+	HvacConfig::Sched sched;
+
+	std::string cpus = get(ini, section, "cpu-affinity", "");
+	std::stringstream ss(cpus);
+	std::string item;
+	while (std::getline(ss, item, ',')) {
+		item = trim(item);
+		if (item.empty())
+			continue;
+		char *end;
+		unsigned first = strtoul(item.c_str(), &end, 10);
+		unsigned last = first;
+		if (*end == '-')
+			last = strtoul(end + 1, &end, 10);
+		if (end == item.c_str() || *end || last < first || last >= CPU_SETSIZE) {
+			Logger::error("HvacConfig", "Invalid cpu-affinity {} in [{}]", cpus, section);
+			sched.cpus.clear();
+			break;
+		}
+		for (unsigned cpu = first; cpu <= last; cpu++)
+			sched.cpus.push_back(cpu);
+	}
+
+	sched.priority = strtoul(get(ini, section, "realtime-priority", "0").c_str(), NULL, 10);
+	if (sched.priority &&
+	    ((int) sched.priority < sched_get_priority_min(SCHED_FIFO) ||
+	     (int) sched.priority > sched_get_priority_max(SCHED_FIFO))) {
+		Logger::error("HvacConfig", "Invalid realtime-priority {} in [{}]", sched.priority, section);
+		sched.priority = 0;
+	}
+
+	return sched;
+}
+
+bool read_file(const std::string &filename, std::string &data)
+{
+	std::ifstream file(filename, std::ios_base::binary);
+	if (!file.is_open()) {
+		data.clear();
+		return false;
+	}
+	std::stringstream ss;
+	ss << file.rdbuf();
+	data = ss.str();
+	return !file.bad();
+}
+
+// Parses each distinct path only once
+class IniCache
+{
+public:
+	const IniFile *get(const std::string &path) {
+		auto it = m_files.find(path);
+		if (it == m_files.end()) {
+			Logger::info("HvacConfig", "Using configuration {}", path);
+			IniFile ini;
+			bool ok = parse_ini(path, ini);
+			if (!ok)
+				Logger::error("HvacConfig", "Could not read {}", path);
+			it = m_files.emplace(path, std::make_pair(ok, ini)).first;
+		}
+		return it->second.first ? &it->second.second : nullptr;
+	}
+
+private:
+	std::map<std::string, std::pair<bool, IniFile>> m_files;
+};
+
+} // namespace
+
+std::shared_ptr<const HvacConfig> HvacConfig::load(const std::string &appname)
+{
+	std::string base("/etc/xdg/AGL/");
+	base += appname;
+	std::string kuksa_path = base + ".conf";
+	// Using separate configuration files for the hardware helpers, it
+	// may make sense to revisit this if a workable scheme to handle
+	// overriding values for the full demo setup can be come up with.
+	std::string can_path = base + "-can.conf";
+	std::string leds_path = base + "-leds.conf";
+	char *home = getenv("XDG_CONFIG_HOME");
+	if (home) {
+		kuksa_path = home;
+		kuksa_path += "/AGL/";
+		kuksa_path += appname;
+		kuksa_path += ".conf";
+		can_path = leds_path = kuksa_path;
+	}
+
+	return parse(appname, "", kuksa_path, can_path, leds_path);
+}
+
+std::vector<std::shared_ptr<const HvacConfig>> HvacConfig::loadVehicles(const std::string &appname,
+									  const std::string &dir)
+{
+	std::vector<std::shared_ptr<const HvacConfig>> vehicles;
+
+	DIR *d = opendir(dir.c_str());
+	if (!d) {
+		Logger::error("HvacConfig", "Could not open vehicle directory {}", dir);
+		return vehicles;
+	}
+
+	std::vector<std::string> names;
+	struct dirent *entry;
+	while ((entry = readdir(d)) != NULL) {
+		std::string name(entry->d_name);
+		if (name.size() > 5 && name.compare(name.size() - 5, 5, ".conf") == 0 && name[0] != '.')
+			names.push_back(name);
+	}
+	closedir(d);
+	std::sort(names.begin(), names.end());
+
+	for (auto it = names.cbegin(); it != names.cend(); ++it)
+		vehicles.push_back(loadVehicle(appname, dir + "/" + *it));
+
+	return vehicles;
+}
+
+std::shared_ptr<const HvacConfig> HvacConfig::loadVehicle(const std::string &appname,
+							  const std::string &path)
+{
+	std::string vehicle(path);
+	auto pos = vehicle.rfind('/');
+	if (pos != std::string::npos)
+		vehicle.erase(0, pos + 1);
+	if (vehicle.size() > 5 && vehicle.compare(vehicle.size() - 5, 5, ".conf") == 0)
+		vehicle.erase(vehicle.size() - 5);
+
+	return parse(appname, vehicle, path, path, path);
+}
+
+std::shared_ptr<const HvacConfig> HvacConfig::reload() const
+{
+	return parse(m_appname, m_vehicle, m_kuksa_path, m_can_path, m_leds_path);
+}
+
+std::shared_ptr<const HvacConfig> HvacConfig::parse(const std::string &appname,
+						    const std::string &vehicle,
+						    const std::string &kuksa_path,
+						    const std::string &can_path,
+						    const std::string &leds_path)
+{
+	std::shared_ptr<HvacConfig> config(new HvacConfig(appname));
+	config->m_vehicle = vehicle;
+	config->m_kuksa_path = kuksa_path;
+	config->m_can_path = can_path;
+	config->m_leds_path = leds_path;
+
+	IniCache cache;
+	config->m_files.push_back(kuksa_path);
+	if (can_path != kuksa_path)
+		config->m_files.push_back(can_path);
+	if (leds_path != kuksa_path && leds_path != can_path)
+		config->m_files.push_back(leds_path);
+
+	//
+	// Databroker client
+	//
+
+	Kuksa &kuksa = config->m_kuksa;
+	const IniFile *ini = cache.get(kuksa_path);
+	do {
+		if (!ini)
+			break;
+
+		kuksa.port = strtoul(get(*ini, "kuksa-client", "port", "55555").c_str(), NULL, 10);
+		if (kuksa.port == 0 || kuksa.port > 65535) {
+			Logger::error("HvacConfig", "Invalid server port");
+			break;
+		}
+
+		// A primary and its standbys, in order
+		std::string servers = get(*ini, "kuksa-client", "server", "localhost");
+		std::stringstream ss(servers);
+		std::string item;
+		bool bad = false;
+		while (std::getline(ss, item, ',')) {
+			std::string endpoint;
+			item = trim(item);
+			if (!parse_endpoint(item, kuksa.port, endpoint)) {
+				Logger::error("HvacConfig", "Invalid server {}", item);
+				bad = true;
+				break;
+			}
+			kuksa.endpoints.push_back(endpoint);
+		}
+		if (bad || kuksa.endpoints.empty()) {
+			Logger::error("HvacConfig", "Invalid server hostname");
+			break;
+		}
+
+		// The primary, for what only deals with one
+		if (isUnixEndpoint(kuksa.endpoints[0])) {
+			kuksa.hostname = kuksa.endpoints[0];
+		} else {
+			auto colon = kuksa.endpoints[0].rfind(':');
+			kuksa.hostname = kuksa.endpoints[0].substr(0, colon);
+			kuksa.port = strtoul(kuksa.endpoints[0].c_str() + colon + 1, NULL, 10);
+		}
+
+		// Only needed for TLS, i.e. brokers reached over TCP
+		bool tcp = std::any_of(kuksa.endpoints.cbegin(), kuksa.endpoints.cend(),
+				       [](const std::string &endpoint) { return !isUnixEndpoint(endpoint); });
+		kuksa.caCertFile = get(*ini, "kuksa-client", "ca-certificate", tcp ? DEFAULT_CA_CERT_FILE : "");
+		if (tcp && kuksa.caCertFile.empty()) {
+			Logger::error("HvacConfig", "Invalid CA certificate filename");
+			break;
+		}
+		if (!kuksa.caCertFile.empty())
+			read_file(kuksa.caCertFile, kuksa.caCert);
+		if (tcp && kuksa.caCert.empty()) {
+			Logger::error("HvacConfig", "Invalid CA certificate file");
+			break;
+		}
+
+		kuksa.tlsServerName = get(*ini, "kuksa-client", "tls-server-name", "");
+
+		kuksa.authTokenFile = get(*ini, "kuksa-client", "authorization", "");
+		if (kuksa.authTokenFile.empty()) {
+			Logger::error("HvacConfig", "Invalid authorization token filename");
+			break;
+		}
+		read_file(kuksa.authTokenFile, kuksa.authToken);
+		// A trailing newline is not valid in a metadata value
+		kuksa.authToken = trim(kuksa.authToken);
+		if (kuksa.authToken.empty()) {
+			Logger::error("HvacConfig", "Invalid authorization token file");
+			break;
+		}
+
+		// Optional periodic re-read of the token file in seconds, on
+		// top of watching it for changes
+		kuksa.authTokenRefresh = strtoul(get(*ini, "kuksa-client", "authorization-refresh", "0").c_str(), NULL, 10);
+
+		// Deadline of get/set calls in ms, and how many may be
+		// outstanding before further writes are coalesced
+		kuksa.rpcTimeout = strtoul(get(*ini, "kuksa-client", "rpc-timeout", "5000").c_str(), NULL, 10);
+		kuksa.maxInFlight = strtoul(get(*ini, "kuksa-client", "max-in-flight", "32").c_str(), NULL, 10);
+
+		// Time allowed on exit for the last changes to reach the
+		// hardware and the broker, in ms
+		kuksa.shutdownTimeout = strtoul(get(*ini, "kuksa-client", "shutdown-timeout", "2000").c_str(), NULL, 10);
+
+		// How long the loops or a subscribe callback may be stuck
+		// before watchdog pings stop, in ms
+		kuksa.stallThreshold = strtoul(get(*ini, "kuksa-client", "stall-threshold", "2000").c_str(), NULL, 10);
+
+		// "glib" (default) or "epoll" for the single-threaded reactor
+		kuksa.eventLoop = get(*ini, "kuksa-client", "event-loop", "glib");
+		if (kuksa.eventLoop != "glib" && kuksa.eventLoop != "epoll") {
+			Logger::error("HvacConfig", "Invalid event loop {}", kuksa.eventLoop);
+			break;
+		}
+
+		kuksa.sched = get_sched(*ini, "kuksa-client");
+		std::string lock = get(*ini, "kuksa-client", "lock-memory", "false");
+		kuksa.lockMemory = (lock == "true" || lock == "1");
+
+		// Optional recording of the subscribe stream for later replay
+		kuksa.recordFile = get(*ini, "kuksa-client", "record-subscriptions", "");
+
+		kuksa.verbose = get_verbose(*ini, "kuksa-client");
+		kuksa.valid = true;
+	} while (0);
+
+	//
+	// CAN, continue with defaults if the file is missing/broken
+	//
+
+	Can &can = config->m_can;
+	ini = cache.get(can_path);
+	can.valid = true;
+	if (ini) {
+		can.port = get(*ini, "can", "port", "can0");
+		if (can.port.empty()) {
+			Logger::error("HvacConfig", "Invalid CAN port path");
+			can.valid = false;
+		}
+		can.txTimestamping = get(*ini, "can", "tx-timestamping", "off");
+		if (can.txTimestamping != "off" &&
+		    can.txTimestamping != "software" &&
+		    can.txTimestamping != "hardware") {
+			Logger::error("HvacConfig", "Invalid tx-timestamping {}", can.txTimestamping);
+			can.txTimestamping = "off";
+		}
+		can.sched = get_sched(*ini, "can");
+		can.verbose = get_verbose(*ini, "can");
+	}
+
+	//
+	// LEDs, continue with defaults if the file is missing/broken
+	//
+
+	Leds &leds = config->m_leds;
+	leds.red = DEFAULT_LED_RED;
+	leds.green = DEFAULT_LED_GREEN;
+	leds.blue = DEFAULT_LED_BLUE;
+	ini = cache.get(leds_path);
+	leds.valid = true;
+	if (ini) {
+		leds.red = get(*ini, "leds", "red", DEFAULT_LED_RED);
+		leds.green = get(*ini, "leds", "green", DEFAULT_LED_GREEN);
+		leds.blue = get(*ini, "leds", "blue", DEFAULT_LED_BLUE);
+		if (leds.red.empty() || leds.green.empty() || leds.blue.empty()) {
+			Logger::error("HvacConfig", "Invalid LED path");
+			leds.valid = false;
+		}
+		leds.verbose = get_verbose(*ini, "leds");
+	}
+	if (leds.valid) {
+		Logger::info("HvacConfig", "Using red LED path {}", leds.red);
+		Logger::info("HvacConfig", "Using green LED path {}", leds.green);
+		Logger::info("HvacConfig", "Using blue LED path {}", leds.blue);
+	}
+
+	//
+	// Hardware output backends
+	//
+
+	Outputs &outputs = config->m_outputs;
+	ini = cache.get(kuksa_path);
+	if (ini) {
+		std::string backends = get(*ini, "outputs", "backends", "");
+		if (!backends.empty()) {
+			outputs.backends.clear();
+			std::stringstream ss(backends);
+			std::string item;
+			while (std::getline(ss, item, ',')) {
+				item = trim(item);
+				if (!item.empty())
+					outputs.backends.push_back(item);
+			}
+		}
+		std::string parallel = get(*ini, "outputs", "parallel", "false");
+		outputs.parallel = (parallel == "true" || parallel == "1");
+		outputs.simLedsDir = get(*ini, "outputs", "sim-leds-dir", outputs.simLedsDir);
+		outputs.verbose = get_verbose(*ini, "outputs");
+	}
+
+	return config;
+}
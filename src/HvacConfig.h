@@ -0,0 +1,138 @@
+/*
+ * Copyright (C) 2023 Konsulko Group
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#ifndef _HVAC_CONFIG_H
+#define _HVAC_CONFIG_H
+
+#include <string>
+#include <vector>
+#include <memory>
+
+// Immutable snapshot of the service configuration
+//
+// The service, CAN and LED configuration files are each read once (just
+// once in total when XDG_CONFIG_HOME points all three at the same file)
+// and validated up front.  Consumers share the snapshot via shared_ptr;
+// a configuration reload produces a new snapshot rather than modifying
+// the current one.
+
+class HvacConfig
+{
+public:
+	// Thread scheduling, "cpu-affinity" (e.g. "2,3" or "2-3") and
+	// "realtime-priority" (SCHED_FIFO, 0 keeps the default policy)
+	struct Sched {
+		std::vector<unsigned> cpus;
+		unsigned priority = 0;
+
+		bool enabled() const { return priority || !cpus.empty(); };
+		bool operator==(const Sched &other) const {
+			return cpus == other.cpus && priority == other.priority;
+		};
+		bool operator!=(const Sched &other) const { return !(*this == other); };
+	};
+
+	// [kuksa-client] section of <appname>.conf
+	struct Kuksa {
+		std::string hostname = "localhost";	// of the primary
+		unsigned port = 55555;
+		std::vector<std::string> endpoints;	// "host:port" or "unix:path", primary first
+		std::string caCertFile;
+		std::string caCert;
+		std::string tlsServerName;
+		std::string authTokenFile;
+		std::string authToken;
+		unsigned authTokenRefresh = 0;
+		unsigned rpcTimeout = 5000;	// ms, 0 for none
+		unsigned maxInFlight = 32;	// unary RPCs, 0 for no limit
+		unsigned shutdownTimeout = 2000;	// ms to flush state on exit
+		unsigned stallThreshold = 2000;	// ms, 0 disables stall detection
+		std::string eventLoop = "glib";
+		Sched sched;		// main loop and gRPC threads
+		bool lockMemory = false;
+		std::string recordFile;	// subscribe stream recording
+		unsigned verbose = 0;
+		bool valid = false;
+	};
+
+	// [can] section of <appname>-can.conf
+	struct Can {
+		std::string port = "can0";
+		std::string txTimestamping = "off";	// off, software or hardware
+		Sched sched;		// dedicated actuator thread if enabled
+		unsigned verbose = 0;
+		bool valid = false;
+	};
+
+	// [leds] section of <appname>-leds.conf
+	struct Leds {
+		std::string red;
+		std::string green;
+		std::string blue;
+		unsigned verbose = 0;
+		bool valid = false;
+	};
+
+	// [outputs] section of <appname>.conf
+	struct Outputs {
+		std::vector<std::string> backends = { "can", "leds" };
+		bool parallel = false;
+		std::string simLedsDir = "/tmp/agl-service-hvac-leds";
+		unsigned verbose = 0;
+	};
+
+	static std::shared_ptr<const HvacConfig> load(const std::string &appname);
+
+	// Multi-vehicle mode: one snapshot per <vehicle>.conf in dir, each
+	// file holding all of the sections
+	static std::vector<std::shared_ptr<const HvacConfig>> loadVehicles(const std::string &appname,
+									   const std::string &dir);
+
+	// Single vehicle file, named after its basename
+	static std::shared_ptr<const HvacConfig> loadVehicle(const std::string &appname,
+							     const std::string &path);
+
+	// A databroker on this machine, reached through a socket file
+	static bool isUnixEndpoint(const std::string &endpoint) { return endpoint.compare(0, 5, "unix:") == 0; };
+
+	// Re-read the files this snapshot was built from
+	std::shared_ptr<const HvacConfig> reload() const;
+
+	const std::string &appname() const { return m_appname; };
+
+	// Vehicle name in multi-vehicle mode, empty otherwise
+	const std::string &vehicle() const { return m_vehicle; };
+	const Kuksa &kuksa() const { return m_kuksa; };
+	const Can &can() const { return m_can; };
+	const Leds &leds() const { return m_leds; };
+	const Outputs &outputs() const { return m_outputs; };
+
+	// Configuration files the snapshot was built from (including ones
+	// that were missing)
+	const std::vector<std::string> &files() const { return m_files; };
+
+private:
+	explicit HvacConfig(const std::string &appname) : m_appname(appname) {};
+
+	static std::shared_ptr<const HvacConfig> parse(const std::string &appname,
+						       const std::string &vehicle,
+						       const std::string &kuksa_path,
+						       const std::string &can_path,
+						       const std::string &leds_path);
+
+	std::string m_appname;
+	std::string m_vehicle;
+	std::string m_kuksa_path;
+	std::string m_can_path;
+	std::string m_leds_path;
+	Kuksa m_kuksa;
+	Can m_can;
+	Leds m_leds;
+	Outputs m_outputs;
+	std::vector<std::string> m_files;
+};
+
+#endif // _HVAC_CONFIG_H
@@ -5,17 +5,10 @@
  */
 
 #include "HvacLedHelper.h"
-#include <iostream>
-#include <iomanip>
-#include <sstream>
-#include <boost/property_tree/ptree.hpp>
-#include <boost/property_tree/ini_parser.hpp>
-
-namespace property_tree = boost::property_tree;
-
-#define RED "/sys/class/leds/blinkm-3-9-red/brightness"
-#define GREEN "/sys/class/leds/blinkm-3-9-green/brightness"
-#define BLUE "/sys/class/leds/blinkm-3-9-blue/brightness"
+#include "Logger.h"
+#include <cstdio>
+#include <unistd.h>
+#include <fcntl.h>
 
 // RGB temperature mapping
 static struct {
@@ -41,158 +34,180 @@ static struct {
 };
 
 
-HvacLedHelper::HvacLedHelper() :
+HvacLedHelper::HvacLedHelper(std::shared_ptr<const HvacConfig> config, EventLoop *loop) :
+	m_loop(loop),
+	m_update_source(0),
 	m_temp_left(21),
 	m_temp_right(21),
-	m_config_valid(false),
-	m_verbose(0)
+	m_config(config),
+	m_led_fd_red(-1),
+	m_led_fd_green(-1),
+	m_led_fd_blue(-1)
 {
-	read_config();
+	led_open();
 }
 
-void HvacLedHelper::read_config()
+HvacLedHelper::~HvacLedHelper()
 {
-	// Using a separate configuration file now, it may make sense
-	// to revisit this if a workable scheme to handle overriding
-	// values for the full demo setup can be come up with.
-	std::string config("/etc/xdg/AGL/agl-service-hvac-leds.conf");
-	char *home = getenv("XDG_CONFIG_HOME");
-	if (home) {
-		config = home;
-		config += "/AGL/agl-service-hvac.conf";
-	}
+	if (m_update_source)
+		m_loop->remove(m_update_source);
+	led_close();
+}
 
-	std::cout << "Using configuration " << config << std::endl;
-	property_tree::ptree pt;
-	try {
-		property_tree::ini_parser::read_ini(config, pt);
-	}
-	catch (std::exception &ex) {
-		// Continue with defaults if file missing/broken
-		std::cerr << "Could not read " << config << std::endl;
-		m_config_valid = true;
-		return;
-	}
-	const property_tree::ptree &settings =
-		pt.get_child("leds", property_tree::ptree());
-
-	m_led_path_red = settings.get("red", RED);
-	std::stringstream ss;
-	ss << m_led_path_red;
-	ss >> std::quoted(m_led_path_red);
-	if (m_led_path_red.empty()) {
-		std::cerr << "Invalid red LED path" << std::endl;
+void HvacLedHelper::reload(std::shared_ptr<const HvacConfig> config)
+{
+	if (!config)
 		return;
-	}
-	// stat file here?
-	std::cout << "Using red LED path " << m_led_path_red << std::endl;
-
-	m_led_path_green = settings.get("green", GREEN);
-	std::stringstream().swap(ss);
-	ss << m_led_path_green;
-	ss >> std::quoted(m_led_path_green);
-	if (m_led_path_green.empty()) {
-		std::cerr << "Invalid green LED path" << std::endl;
+
+	if (!config->leds().valid) {
+		Logger::warning("HvacLedHelper", "Keeping previous LED configuration");
 		return;
 	}
-	// stat file here?
-	std::cout << "Using green LED path " << m_led_path_red << std::endl;
-
-	m_led_path_blue = settings.get("blue", BLUE);
-	std::stringstream().swap(ss);
-	ss << m_led_path_blue;
-	ss >> std::quoted(m_led_path_blue);
-	if (m_led_path_blue.empty()) {
-		std::cerr << "Invalid blue LED path" << std::endl;
+
+	std::shared_ptr<const HvacConfig> old = m_config;
+	m_config = config;
+	if (old &&
+	    old->leds().red == config->leds().red &&
+	    old->leds().green == config->leds().green &&
+	    old->leds().blue == config->leds().blue &&
+	    m_led_fd_red >= 0)
 		return;
-	}
-	// stat file here?
-	std::cout << "Using blue LED path " << m_led_path_red << std::endl;
-
-	m_verbose = 0;
-	std::string verbose = settings.get("verbose", "");
-	std::stringstream().swap(ss);
-	ss << verbose;
-	ss >> std::quoted(verbose);
-	if (!verbose.empty()) {
-		if (verbose == "true" || verbose == "1")
-			m_verbose = 1;
-		if (verbose == "2")
-			m_verbose = 2;
-	}
 
-	m_config_valid = true;
+	led_close();
+	led_open();
+
+	// Show the current temperatures on the new LEDs
+	led_schedule_update();
 }
 
 void HvacLedHelper::set_left_temperature(uint8_t temp)
 {
 	m_temp_left = temp;
-	led_update();
+	led_schedule_update();
 }
 
 void HvacLedHelper::set_right_temperature(uint8_t temp)
 {
 	m_temp_right = temp;
+	led_schedule_update();
+}
+
+void HvacLedHelper::set_temperatures(uint8_t temp_left, uint8_t temp_right)
+{
+	m_temp_left = temp_left;
+	m_temp_right = temp_right;
+
+	// Used when restoring state, possibly before the loop runs
 	led_update();
 }
 
+void HvacLedHelper::colour(uint8_t temp_left, uint8_t temp_right, int rgb[3])
+{
+	// Calculates average colour value taken from the temperature toggles,
+	// limiting to our 15 degree range
+	int left = temp_left - 15;
+	if (left < 0)
+		left = 0;
+	else if (left > 15)
+		left = 15;
+
+	int right = temp_right - 15;
+	if (right < 0)
+		right = 0;
+	else if (right > 15)
+		right = 15;
+
+	for (int i = 0; i < 3; i++)
+		rgb[i] = (degree_colours[left].rgb[i] + degree_colours[right].rgb[i]) / 2;
+}
+
+void HvacLedHelper::led_open()
+{
+	if (!(m_config && m_config->leds().valid))
+		return;
+
+	// Keep the brightness files open, the sysfs attributes are
+	// rewritten in place on every update.
+	const HvacConfig::Leds &leds = m_config->leds();
+	m_led_fd_red = open(leds.red.c_str(), O_WRONLY | O_CLOEXEC);
+	m_led_fd_green = open(leds.green.c_str(), O_WRONLY | O_CLOEXEC);
+	m_led_fd_blue = open(leds.blue.c_str(), O_WRONLY | O_CLOEXEC);
+	if (m_led_fd_red < 0 || m_led_fd_green < 0 || m_led_fd_blue < 0) {
+		if (m_led_fd_red < 0)
+			Logger::error("HvacLedHelper", "Could not open red LED path {}", leds.red);
+		if (m_led_fd_green < 0)
+			Logger::error("HvacLedHelper", "Could not open green LED path {}", leds.green);
+		if (m_led_fd_blue < 0)
+			Logger::error("HvacLedHelper", "Could not open blue LED path {}", leds.blue);
+		led_close();
+	}
+}
+
+void HvacLedHelper::led_close()
+{
+	if (m_led_fd_red >= 0)
+		close(m_led_fd_red);
+	if (m_led_fd_green >= 0)
+		close(m_led_fd_green);
+	if (m_led_fd_blue >= 0)
+		close(m_led_fd_blue);
+	m_led_fd_red = m_led_fd_green = m_led_fd_blue = -1;
+}
+
+void HvacLedHelper::led_schedule_update()
+{
+	if (!m_loop) {
+		led_update();
+		return;
+	}
+
+	if (m_update_source)
+		return;
+
+	m_update_source = m_loop->addTimeout(0, [this]() {
+		m_update_source = 0;
+		led_update();
+		return false;
+	});
+}
+
+bool HvacLedHelper::led_write(int fd, int value)
+{
+	char buf[8];
+	int len = snprintf(buf, sizeof(buf), "%d", value);
+	return pwrite(fd, buf, len, 0) == len;
+}
+
 void HvacLedHelper::led_update()
 {
-	if (!m_config_valid)
+	if (m_led_fd_red < 0)
 		return;
 
-	// Calculates average colour value taken from the temperature toggles,
-	// limiting to our 15 degree range
-	int temp_left = m_temp_left - 15;
-	if (temp_left < 0)
-		temp_left = 0;
-	else if (temp_left > 15)
-		temp_left = 15;
-
-	int temp_right = m_temp_right - 15;
-	if (temp_right < 0)
-		temp_right = 0;
-	else if (temp_right > 15)
-		temp_right = 15;
-
-	int red_value = (degree_colours[temp_left].rgb[0] + degree_colours[temp_right].rgb[0]) / 2;
-	int green_value = (degree_colours[temp_left].rgb[1] + degree_colours[temp_right].rgb[1]) / 2;
-	int blue_value = (degree_colours[temp_left].rgb[2] + degree_colours[temp_right].rgb[2]) / 2;
+	int rgb[3];
+	colour(m_temp_left, m_temp_right, rgb);
+	int red_value = rgb[0];
+	int green_value = rgb[1];
+	int blue_value = rgb[2];
 
 	//
 	// Push colour mapping out
 	//
 
-	std::ofstream led_red;
-	led_red.open(m_led_path_red);
-	if (led_red.is_open()) {
-		led_red << std::to_string(red_value);
-		led_red.close();
-	} else {
-		std::cerr << "Could not write red LED path " << m_led_path_red << std::endl;
-		m_config_valid = false;
+	if (!led_write(m_led_fd_red, red_value)) {
+		Logger::error("HvacLedHelper", "Could not write red LED path {}", m_config->leds().red);
+		led_close();
 		return;
 	}
 
-	std::ofstream led_green;
-	led_green.open(m_led_path_green);
-	if (led_green.is_open()) {
-		led_green << std::to_string(green_value);
-		led_green.close();
-	} else {
-		std::cerr << "Could not write green LED path " << m_led_path_green << std::endl;
-		m_config_valid = false;
+	if (!led_write(m_led_fd_green, green_value)) {
+		Logger::error("HvacLedHelper", "Could not write green LED path {}", m_config->leds().green);
+		led_close();
 		return;
 	}
 
-	std::ofstream led_blue;
-	led_blue.open(m_led_path_blue);
-	if (led_blue.is_open()) {
-		led_blue << std::to_string(blue_value);
-		led_blue.close();
-	} else {
-		std::cerr << "Could not write blue LED path " << m_led_path_blue << std::endl;
-		m_config_valid = false;
+	if (!led_write(m_led_fd_blue, blue_value)) {
+		Logger::error("HvacLedHelper", "Could not write blue LED path {}", m_config->leds().blue);
+		led_close();
 		return;
 	}
 }
@@ -9,28 +9,52 @@
 
 #include <cstdint>
 #include <string>
-#include <iostream>
-#include <fstream>
+#include <memory>
+
+#include "HvacConfig.h"
+#include "EventLoop.h"
+
+// All methods are expected to be called from the event loop thread.  With
+// a loop, updates are coalesced so that e.g. both temperatures changing
+// in one subscription update result in a single write of the LEDs.
 
 class HvacLedHelper
 {
 public:
-	HvacLedHelper();
+	explicit HvacLedHelper(std::shared_ptr<const HvacConfig> config, EventLoop *loop = NULL);
+
+	~HvacLedHelper();
 
 	void set_left_temperature(uint8_t temp);
 
 	void set_right_temperature(uint8_t temp);
 
+	void set_temperatures(uint8_t temp_left, uint8_t temp_right);
+
+	// Average RGB brightness values for the two temperatures
+	static void colour(uint8_t temp_left, uint8_t temp_right, int rgb[3]);
+
+	// Apply a new configuration, reopening the LED files if their
+	// paths changed
+	void reload(std::shared_ptr<const HvacConfig> config);
+
 private:
-	void read_config();
+	void led_open();
+
+	void led_close();
 
 	void led_update();
 
-	std::string m_led_path_red;
-	std::string m_led_path_green;
-	std::string m_led_path_blue;
-	unsigned m_verbose;
-	bool m_config_valid;
+	void led_schedule_update();
+
+	bool led_write(int fd, int value);
+
+	EventLoop *m_loop;
+	unsigned m_update_source;
+	std::shared_ptr<const HvacConfig> m_config;
+	int m_led_fd_red;
+	int m_led_fd_green;
+	int m_led_fd_blue;
 
 	uint8_t m_temp_left;
 	uint8_t m_temp_right;
@@ -0,0 +1,357 @@
+/*
+ * Copyright (C) 2023 Konsulko Group
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#include <algorithm>
+#include <atomic>
+
+#include "HvacOutput.h"
+#include "HvacCanHelper.h"
+#include "HvacLedHelper.h"
+#include "HvacSimOutput.h"
+#include "Logger.h"
+
+// How often flush() looks at a backend that is still busy
+#define FLUSH_POLL_MS 5
+
+namespace {
+
+// Hardware backends, thin wrappers around the helpers
+
+class CanOutput : public HvacOutput
+{
+public:
+	CanOutput(std::shared_ptr<const HvacConfig> config, EventLoop *loop) :
+		m_helper(config, loop),
+		m_applied(false) {}
+
+	void apply(const HvacState &state) override {
+		if (m_applied &&
+		    state.temp_left == m_last.temp_left &&
+		    state.temp_right == m_last.temp_right &&
+		    state.fan_speed == m_last.fan_speed)
+			return;
+		m_helper.set_state(state.temp_left, state.temp_right, state.fan_speed, state.received_ns);
+		m_last = state;
+		m_applied = true;
+	}
+
+	void reload(std::shared_ptr<const HvacConfig> config) override {
+		m_helper.reload(config);
+	}
+
+	bool busy() const override {
+		return m_helper.busy();
+	}
+
+	void setRecorder(FlightRecorder *recorder) override {
+		m_helper.setRecorder(recorder);
+	}
+
+private:
+	HvacCanHelper m_helper;
+	HvacState m_last;
+	bool m_applied;
+};
+
+class LedOutput : public HvacOutput
+{
+public:
+	LedOutput(std::shared_ptr<const HvacConfig> config, EventLoop *loop) :
+		m_helper(config, loop),
+		m_applied(false) {}
+
+	void apply(const HvacState &state) override {
+		if (m_applied &&
+		    state.temp_left == m_last.temp_left &&
+		    state.temp_right == m_last.temp_right)
+			return;
+		m_helper.set_temperatures(state.temp_left, state.temp_right);
+		m_last = state;
+		m_applied = true;
+	}
+
+	void reload(std::shared_ptr<const HvacConfig> config) override {
+		m_helper.reload(config);
+	}
+
+private:
+	HvacLedHelper m_helper;
+	HvacState m_last;
+	bool m_applied;
+};
+
+class LogOutput : public HvacOutput
+{
+public:
+	void apply(const HvacState &state) override {
+		Logger::info("HvacOutput",
+			     "temperature {}/{} fan {} ac {} defrost {}/{} recirculation {}",
+			     state.temp_left, state.temp_right, state.fan_speed, state.ac,
+			     state.front_defrost, state.rear_defrost, state.recirculation);
+	}
+};
+
+void register_builtin()
+{
+	static bool registered = false;
+	if (registered)
+		return;
+	registered = true;
+
+	HvacOutputRegistry::add("can", 0,
+		[](std::shared_ptr<const HvacConfig> config, EventLoop *loop) -> HvacOutput* {
+			return new CanOutput(config, loop);
+		});
+	HvacOutputRegistry::add("leds", 10,
+		[](std::shared_ptr<const HvacConfig> config, EventLoop *loop) -> HvacOutput* {
+			return new LedOutput(config, loop);
+		});
+	HvacOutputRegistry::add("log", 20,
+		[](std::shared_ptr<const HvacConfig> config, EventLoop *loop) -> HvacOutput* {
+			return new LogOutput();
+		});
+	HvacOutputRegistry::add("sim-can", 0,
+		[](std::shared_ptr<const HvacConfig> config, EventLoop *loop) -> HvacOutput* {
+			return new SimCanOutput(config, loop);
+		});
+	HvacOutputRegistry::add("sim-leds", 10,
+		[](std::shared_ptr<const HvacConfig> config, EventLoop *loop) -> HvacOutput* {
+			return new SimLedOutput(config, loop);
+		});
+}
+
+} // namespace
+
+//
+// HvacOutputRegistry
+//
+
+std::map<std::string, HvacOutputRegistry::Entry> &HvacOutputRegistry::entries()
+{
+	static std::map<std::string, Entry> entries;
+	return entries;
+}
+
+void HvacOutputRegistry::add(const std::string &name, int priority, HvacOutputFactory factory)
+{
+	entries()[name] = Entry { priority, factory };
+}
+
+bool HvacOutputRegistry::has(const std::string &name)
+{
+	register_builtin();
+	return entries().find(name) != entries().end();
+}
+
+int HvacOutputRegistry::priority(const std::string &name)
+{
+	register_builtin();
+	auto it = entries().find(name);
+	return it != entries().end() ? it->second.priority : 0;
+}
+
+HvacOutput *HvacOutputRegistry::create(const std::string &name,
+				       std::shared_ptr<const HvacConfig> config,
+				       EventLoop *loop)
+{
+	register_builtin();
+	auto it = entries().find(name);
+	if (it == entries().end())
+		return NULL;
+
+	return it->second.factory(config, loop);
+}
+
+//
+// HvacOutputs
+//
+
+HvacOutputs::HvacOutputs(std::shared_ptr<const HvacConfig> config, EventLoop *loop) :
+	m_loop(loop),
+	m_thread(NULL)
+{
+	const HvacConfig::Outputs &outputs = config->outputs();
+
+	std::vector<std::string> names;
+	for (auto it = outputs.backends.cbegin(); it != outputs.backends.cend(); ++it) {
+		if (!HvacOutputRegistry::has(*it)) {
+			Logger::error("HvacOutputs", "Unknown output backend {}", *it);
+			continue;
+		}
+		if (std::find(names.begin(), names.end(), *it) == names.end())
+			names.push_back(*it);
+	}
+	std::stable_sort(names.begin(), names.end(), [](const std::string &a, const std::string &b) {
+		return HvacOutputRegistry::priority(a) < HvacOutputRegistry::priority(b);
+	});
+
+	if (!outputs.parallel && config->can().sched.enabled())
+		m_thread = new ActuatorThread(config->can().sched);
+
+	for (auto it = names.cbegin(); it != names.cend(); ++it) {
+		Backend backend;
+		backend.name = *it;
+		backend.thread = NULL;
+		backend.mailbox = NULL;
+		EventLoop *backend_loop = m_thread ? m_thread->loop() : m_loop;
+		if (outputs.parallel) {
+			// The [can] scheduling settings are meant for the CAN writes
+			HvacConfig::Sched sched;
+			if (HvacOutputRegistry::priority(*it) == 0)
+				sched = config->can().sched;
+			backend.thread = new ActuatorThread(sched);
+			backend.mailbox = new Mailbox();
+			backend_loop = backend.thread->loop();
+		}
+		backend.loop = backend_loop;
+		backend.output = HvacOutputRegistry::create(*it, config, backend_loop);
+		if (backend.mailbox) {
+			HvacOutput *output = backend.output;
+			backend.mailbox->deliver = [output](const HvacState &state) {
+				output->apply(state);
+			};
+		}
+		m_backends.push_back(backend);
+
+		if (outputs.verbose)
+			Logger::info("HvacOutputs", "Using output backend {}{}", *it,
+				     outputs.parallel ? " (own thread)" : "");
+	}
+
+	m_mailbox.deliver = [this](const HvacState &state) {
+		for (auto it = m_backends.begin(); it != m_backends.end(); ++it)
+			it->output->apply(state);
+	};
+}
+
+HvacOutputs::~HvacOutputs()
+{
+	stop();
+
+	// The loops are idle now, so the backends can remove their sources
+	// from this thread
+	for (auto it = m_backends.begin(); it != m_backends.end(); ++it) {
+		delete it->output;
+		delete it->thread;
+		delete it->mailbox;
+	}
+	delete m_thread;
+}
+
+void HvacOutputs::watch(Watchdog *watchdog, const std::string &prefix)
+{
+	// Backends on the main loop are covered by its own probe
+	if (m_thread)
+		watchdog->addLoop(prefix + "outputs", m_thread->loop(), m_thread->handle());
+	for (auto it = m_backends.begin(); it != m_backends.end(); ++it) {
+		if (it->thread)
+			watchdog->addLoop(prefix + it->name + " output", it->thread->loop(), it->thread->handle());
+	}
+}
+
+void HvacOutputs::setRecorder(FlightRecorder *recorder)
+{
+	for (auto it = m_backends.begin(); it != m_backends.end(); ++it)
+		it->output->setRecorder(recorder);
+}
+
+void HvacOutputs::stop()
+{
+	for (auto it = m_backends.begin(); it != m_backends.end(); ++it) {
+		if (it->thread)
+			it->thread->stop();
+	}
+	if (m_thread)
+		m_thread->stop();
+}
+
+void HvacOutputs::flush(std::function<void()> done)
+{
+	if (m_backends.empty()) {
+		m_loop->post(done);
+		return;
+	}
+
+	// Checked on each backend's own loop, so nothing needs locking
+	auto remaining = std::make_shared<std::atomic<unsigned>>(m_backends.size());
+	for (auto it = m_backends.cbegin(); it != m_backends.cend(); ++it) {
+		waitIdle(&(*it), [this, remaining, done]() {
+			if (--(*remaining) == 0)
+				m_loop->post(done);
+		});
+	}
+}
+
+void HvacOutputs::apply(const HvacState &state)
+{
+	// Each backend gets its own copy, so there is nothing shared
+	// between the threads
+	if (m_thread) {
+		post(m_thread, &m_mailbox, state);
+		return;
+	}
+
+	for (auto it = m_backends.begin(); it != m_backends.end(); ++it) {
+		if (it->thread) {
+			post(it->thread, it->mailbox, state);
+		} else {
+			it->output->apply(state);
+		}
+	}
+}
+
+void HvacOutputs::post(ActuatorThread *thread, Mailbox *mailbox, const HvacState &state)
+{
+	// Newer states just replace the word until the queued delivery
+	// picks it up
+	mailbox->state.store(state);
+	if (mailbox->pending.exchange(true, std::memory_order_acq_rel))
+		return;
+
+	thread->loop()->post([mailbox]() {
+		// Cleared before loading, so a store after the load queues
+		// another delivery
+		mailbox->pending.exchange(false, std::memory_order_acq_rel);
+		mailbox->deliver(mailbox->state.load());
+	});
+}
+
+void HvacOutputs::waitIdle(const Backend *backend, std::function<void()> done)
+{
+	// Posted behind any apply still queued for the backend
+	backend->loop->post([this, backend, done]() {
+		Mailbox *mailbox = backend->mailbox ? backend->mailbox : (m_thread ? &m_mailbox : NULL);
+		bool pending = mailbox && mailbox->pending.load(std::memory_order_acquire);
+		if (!pending && !backend->output->busy()) {
+			done();
+			return;
+		}
+		backend->loop->addTimeout(FLUSH_POLL_MS, [this, backend, done]() {
+			waitIdle(backend, done);
+			return false;
+		});
+	});
+}
+
+void HvacOutputs::reload(std::shared_ptr<const HvacConfig> config)
+{
+	if (m_thread) {
+		m_thread->loop()->post([this, config]() {
+			for (auto it = m_backends.begin(); it != m_backends.end(); ++it)
+				it->output->reload(config);
+		});
+		return;
+	}
+
+	for (auto it = m_backends.begin(); it != m_backends.end(); ++it) {
+		if (it->thread) {
+			HvacOutput *output = it->output;
+			it->thread->loop()->post([output, config]() { output->reload(config); });
+		} else {
+			it->output->reload(config);
+		}
+	}
+}
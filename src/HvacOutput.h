@@ -0,0 +1,139 @@
+/*
+ * Copyright (C) 2023 Konsulko Group
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#ifndef _HVAC_OUTPUT_H
+#define _HVAC_OUTPUT_H
+
+#include <string>
+#include <vector>
+#include <map>
+#include <memory>
+#include <functional>
+#include <atomic>
+
+#include "HvacConfig.h"
+#include "HvacStateStore.h"
+#include "HvacStateWord.h"
+#include "EventLoop.h"
+#include "ActuatorThread.h"
+#include "Watchdog.h"
+#include "FlightRecorder.h"
+
+// Hardware output backend
+//
+// Backends get the complete state snapshot on every change and are
+// expected to skip writes for parts that did not change.  All calls are
+// made on the loop the backend was created with.
+
+class HvacOutput
+{
+public:
+	virtual ~HvacOutput() {};
+
+	virtual void apply(const HvacState &state) = 0;
+
+	virtual void reload(std::shared_ptr<const HvacConfig> config) {};
+
+	// True while an applied state has not been fully written out yet
+	virtual bool busy() const { return false; };
+
+	// Record hardware write outcomes, set before the first apply()
+	virtual void setRecorder(FlightRecorder *recorder) {};
+};
+
+typedef std::function<HvacOutput*(std::shared_ptr<const HvacConfig> config, EventLoop *loop)> HvacOutputFactory;
+
+// Backends by name, as used in the [outputs] "backends" list.  Lower
+// priority values are applied first when running in order.
+
+class HvacOutputRegistry
+{
+public:
+	static void add(const std::string &name, int priority, HvacOutputFactory factory);
+
+	static bool has(const std::string &name);
+
+	static int priority(const std::string &name);
+
+	static HvacOutput *create(const std::string &name,
+				  std::shared_ptr<const HvacConfig> config,
+				  EventLoop *loop);
+
+private:
+	struct Entry {
+		int priority;
+		HvacOutputFactory factory;
+	};
+
+	static std::map<std::string, Entry> &entries();
+};
+
+// The configured set of backends
+//
+// By default the backends are applied one after the other in priority
+// order (CAN first) on the actuator thread, or the main loop if there is
+// none.  With "parallel = true" every backend gets its own thread and the
+// snapshot is handed to all of them at once, so a slow backend cannot
+// hold up the others.
+//
+// Only the newest snapshot is kept for a thread that is still busy, so a
+// change never queues up behind stale ones.
+
+class HvacOutputs
+{
+public:
+	HvacOutputs(std::shared_ptr<const HvacConfig> config, EventLoop *loop);
+
+	~HvacOutputs();
+
+	void apply(const HvacState &state);
+
+	void reload(std::shared_ptr<const HvacConfig> config);
+
+	// Call done on the loop once everything applied so far has been
+	// written out by all backends
+	void flush(std::function<void()> done);
+
+	// Have the watchdog probe the backend threads
+	void watch(Watchdog *watchdog, const std::string &prefix);
+
+	// Before the first apply()
+	void setRecorder(FlightRecorder *recorder);
+
+	// Stop the backend threads; needs to happen before anything the
+	// backends use goes away
+	void stop();
+
+private:
+	// Set up once, so handing over a state does not allocate; the
+	// loop thread and the actuator thread only share atomics
+	struct Mailbox {
+		HvacStateWord state;
+		std::atomic<bool> pending = false;	// a delivery is queued
+		std::function<void(const HvacState &state)> deliver;
+	};
+
+	struct Backend {
+		std::string name;
+		HvacOutput *output;
+		ActuatorThread *thread;		// parallel mode only
+		Mailbox *mailbox;
+		EventLoop *loop;		// the backend's calls are made on
+	};
+
+	// Hand state over to the mailbox's deliver function on thread's loop
+	static void post(ActuatorThread *thread, Mailbox *mailbox, const HvacState &state);
+
+	// Call done on backend's loop once it is idle
+	void waitIdle(const Backend *backend, std::function<void()> done);
+
+	EventLoop *m_loop;
+	ActuatorThread *m_thread;		// ordered mode, if configured
+	Mailbox m_mailbox;
+	std::vector<Backend> m_backends;
+};
+
+#endif // _HVAC_OUTPUT_H
@@ -5,155 +5,369 @@
  */
 
 #include "HvacService.h"
+#include "Logger.h"
 #include <string>
-#include <sstream>
-#include <iostream>
 #include <algorithm>
+#include <climits>
 
-HvacService::HvacService(const KuksaConfig &config, GMainLoop *loop) :
+// How often Shutdown() checks whether everything has drained
+#define SHUTDOWN_POLL_MS 10
+
+// How often disconnected standby databrokers are reconnected
+#define STANDBY_CHECK_MS 1000
+
+// How often the channels are checked while waiting for a databroker
+#define CONNECT_POLL_MS 100
+
+namespace {
+
+// Searched for actuators when connecting
+const std::string HVAC_BRANCH("Vehicle.Cabin.HVAC");
+
+// The handled signals; temperatures are taken as int32 as the broker
+// has them, but only within what the hardware takes
+typedef Signal<int32_t, "Vehicle.Cabin.HVAC.Station.Row1.Driver.Temperature", 0, 255> DriverTemperature;
+typedef Signal<int32_t, "Vehicle.Cabin.HVAC.Station.Row1.Passenger.Temperature", 0, 255> PassengerTemperature;
+typedef Signal<uint8_t, "Vehicle.Cabin.HVAC.Station.Row1.Driver.FanSpeed", 0, 100> DriverFanSpeed;
+typedef Signal<uint8_t, "Vehicle.Cabin.HVAC.Station.Row1.Passenger.FanSpeed", 0, 100> PassengerFanSpeed;
+typedef BoolSignal<"Vehicle.Cabin.HVAC.IsAirConditioningActive"> AirConditioningActive;
+typedef BoolSignal<"Vehicle.Cabin.HVAC.IsFrontDefrosterActive"> FrontDefrosterActive;
+typedef BoolSignal<"Vehicle.Cabin.HVAC.IsRearDefrosterActive"> RearDefrosterActive;
+typedef BoolSignal<"Vehicle.Cabin.HVAC.IsRecirculationActive"> RecirculationActive;
+
+} // namespace
+
+std::string HvacService::instanceName(const HvacConfig &config, bool connect)
+{
+	// Offline instances keep their state apart from the service's
+	if (connect)
+		return config.vehicle();
+	return config.vehicle().empty() ? std::string("replay") : config.vehicle() + "-replay";
+}
+
+HvacService::HvacService(std::shared_ptr<const HvacConfig> config, EventLoop *loop, bool connect) :
 	m_loop(loop),
-	m_config(config),
-	m_can_helper(),
-	m_led_helper()
-{
-	// Create gRPC channel
-	std::string host = m_config.hostname();
-	host += ":";
-	std::stringstream ss;
-	ss << m_config.port();
-	host += ss.str();
-
-	std::shared_ptr<grpc::Channel> channel;
-	if (!m_config.caCert().empty()) {
-		grpc::SslCredentialsOptions options;
-		options.pem_root_certs = m_config.caCert();
-		if (!m_config.tlsServerName().empty()) {
-			grpc::ChannelArguments args;
-			auto target = m_config.tlsServerName();
-			std::cout << "Overriding TLS target name with " << target << std::endl;
-			args.SetString(GRPC_SSL_TARGET_NAME_OVERRIDE_ARG, target);
-			channel = grpc::CreateCustomChannel(host, grpc::SslCredentials(options), args);
-		} else {
-			channel = grpc::CreateChannel(host, grpc::SslCredentials(options));
-		}
-	} else {
-		channel = grpc::CreateChannel(host, grpc::InsecureChannelCredentials());
+	m_hvac_config(config),
+	m_config(*config),
+	m_broker(NULL),
+	m_flight_recorder(FlightRecorder::defaultPath(instanceName(*config, connect))),
+	m_dispatcher(loop),
+	m_outputs(config, loop),
+	m_config_watcher(NULL),
+	m_state_store(HvacStateStore::defaultPath(instanceName(*config, connect))),
+	m_state_publisher(HvacStatePublisher::segmentName(instanceName(*config, connect))),
+	m_stopping(false),
+	m_shutdown_source(0),
+	m_outputs_flushed(false),
+	m_standby_source(0),
+	m_connect_source(0)
+{
+	RegisterSignals();
+	m_outputs.setRecorder(&m_flight_recorder);
+
+	// Put the hardware back the way it was before waiting on the broker
+	RestoreState();
+
+	// Fed through Replay() only
+	if (!connect)
+		return;
+
+	// Create a gRPC channel per databroker, the primary and its standbys
+	m_endpoints = m_config.endpoints();
+	if (!m_config.tlsServerName().empty())
+		Logger::info("HvacService", "Overriding TLS target name with {}", m_config.tlsServerName());
+	for (auto it = m_endpoints.cbegin(); it != m_endpoints.cend(); ++it)
+		m_channels.push_back(CreateChannel(*it));
+
+	// Wait on the loop for one of them to be ready, so that neither the
+	// other vehicles nor the watchdog wait on an absent broker
+	std::string names;
+	for (auto it = m_endpoints.cbegin(); it != m_endpoints.cend(); ++it)
+		names += (names.empty() ? "" : ", ") + *it;
+	Logger::info("HvacService", "Waiting for Databroker gRPC channel {}", names);
+	if (!CheckConnected()) {
+		m_connect_source = m_loop->addTimeout(CONNECT_POLL_MS, [this]() {
+			return !CheckConnected();
+		});
 	}
 
-	// Wait for the channel to be ready
-	std::cout << "Waiting for Databroker gRPC channel" << std::endl;
-	while (!channel->WaitForConnected(std::chrono::system_clock::now() +
-					  std::chrono::milliseconds(500))) ;
-	std::cout << "Databroker gRPC channel ready" << std::endl;
-
-	m_broker = new KuksaClient(channel, m_config);
-	if (m_broker) {
-		// Listen to actuator target updates
-		std::map<std::string, bool> signals;
-		signals["Vehicle.Cabin.HVAC.Station.Row1.Driver.Temperature"] = true;
-		signals["Vehicle.Cabin.HVAC.Station.Row1.Driver.FanSpeed"] = true;
-		signals["Vehicle.Cabin.HVAC.Station.Row1.Passenger.Temperature"] = true;
-		signals["Vehicle.Cabin.HVAC.Station.Row1.Passenger.FanSpeed"] = true;
-		signals["Vehicle.Cabin.HVAC.IsAirConditioningActive"] = true;
-		signals["Vehicle.Cabin.HVAC.IsFrontDefrosterActive"] = true;
-		signals["Vehicle.Cabin.HVAC.IsRearDefrosterActive"] = true;
-		signals["Vehicle.Cabin.HVAC.IsRecirculationActive"] = true;
-		m_broker->subscribe(signals,
-				    [this](const std::string &path, const Datapoint &dp) {
-					    HandleSignalChange(path, dp);
-				    },
-				    [this](const SubscribeRequest *request, const Status &s) {
-					    HandleSubscribeDone(request, s);
-				    });
+	// Pick up configuration changes without a restart
+	m_config_watcher = new ConfigWatcher(m_loop, [this](const std::set<std::string> &changed) {
+		HandleConfigChange(changed);
+	});
+	WatchConfig();
+}
+
+HvacService::HvacService(std::shared_ptr<const HvacConfig> config, EventLoop *loop, KuksaClient *broker) :
+	HvacService(config, loop, false)
+{
+	m_broker = broker;
+}
+
+bool HvacService::CheckConnected()
+{
+	// Asking for the state is what gets gRPC to connect
+	std::string ready;
+	for (size_t i = 0; i < m_channels.size(); i++) {
+		if (m_channels[i]->GetState(true) == GRPC_CHANNEL_READY && ready.empty())
+			ready = m_endpoints[i];
+	}
+	if (ready.empty())
+		return false;
+
+	m_connect_source = 0;
+	Logger::info("HvacService", "Databroker gRPC channel {} ready", ready);
+	Connect();
+	return true;
+}
+
+void HvacService::Connect()
+{
+	std::vector<std::shared_ptr<grpc::ChannelInterface>> channels;
+	channels.swap(m_channels);
+	m_endpoints.clear();
+
+	// In reactor mode the client is driven from our loop as well
+	if (m_hvac_config->kuksa().eventLoop == "epoll")
+		m_broker = new KuksaClient(channels, m_config, m_loop);
+	else
+		m_broker = new KuksaClient(channels, m_config);
+
+	// Keep a copy of the raw stream for replaying elsewhere
+	if (!m_hvac_config->kuksa().recordFile.empty()) {
+		auto recorder = std::make_shared<SubscribeRecorder>(m_hvac_config->kuksa().recordFile);
+		if (recorder->valid())
+			m_broker->setRecorder(recorder);
+	}
+
+	// Follow authorization token updates, rotating the subscription
+	// ahead of expiry instead of having it fail
+	if (!m_config.authTokenFile().empty()) {
+		m_token_provider = std::make_shared<AuthTokenProvider>(m_loop,
+								       m_config.authTokenFile(),
+								       m_config.authTokenRefresh());
+		m_broker->setTokenProvider(m_token_provider);
+	}
+
+	// Watch() may well have been before the broker was there
+	if (m_subscribe_probe)
+		m_broker->setWatchdogProbe(m_subscribe_probe);
+
+	// Listen to actuator target updates, for what the broker has
+	Discover();
+
+	// gRPC only reconnects a channel when it is used, which a standby
+	// is not
+	if (channels.size() > 1) {
+		m_standby_source = m_loop->addTimeout(STANDBY_CHECK_MS, [this]() {
+			m_broker->checkEndpoints();
+			return true;
+		});
 	}
 }
 
 HvacService::~HvacService()
 {
+	if (m_shutdown_source)
+		m_loop->remove(m_shutdown_source);
+	if (m_standby_source)
+		m_loop->remove(m_standby_source);
+	if (m_connect_source)
+		m_loop->remove(m_connect_source);
+
+	m_outputs.stop();
+
+	delete m_config_watcher;
 	delete m_broker;
 }
 
-// Private
+void HvacService::Replay(const SubscribeResponse &response)
+{
+	// Through the lanes, but without waiting for the loop to get to them
+	KuksaClient::handleSubscribeResponse(&response, [this](const std::string &path, const Datapoint &dp) {
+		m_dispatcher.dispatch(path, dp);
+	});
+	m_dispatcher.flush();
+}
 
-void HvacService::HandleSignalChange(const std::string &path, const Datapoint &dp)
+void HvacService::Shutdown(std::function<void()> done)
 {
-	if (m_config.verbose() > 1)
-		std::cout << "HvacService::HandleSignalChange: Value received for " << path << std::endl;
+	if (m_stopping)
+		return;
+	m_stopping = true;
+	m_shutdown_done = done;
+	m_shutdown_start = std::chrono::steady_clock::now();
+
+	// Stop intake; the subscriptions finish with CANCELLED and are not
+	// resumed, updates still on their way in are dropped.
+	delete m_config_watcher;
+	m_config_watcher = NULL;
+	if (m_connect_source) {
+		m_loop->remove(m_connect_source);
+		m_connect_source = 0;
+	}
+	if (m_broker)
+		m_broker->cancelSubscriptions();
+
+	// Everything received so far, coalesced updates included, goes out
+	// to the hardware and the broker
+	m_dispatcher.flush();
+	m_outputs.flush([this]() {
+		m_outputs_flushed = true;
+	});
+
+	m_shutdown_source = m_loop->addTimeout(SHUTDOWN_POLL_MS, [this]() {
+		return !CheckShutdown();
+	});
+}
 
-	if (path == "Vehicle.Cabin.HVAC.Station.Row1.Driver.Temperature") {
-		if (dp.has_int32()) {
-			int temp = dp.int32();
-			if (temp >= 0 && temp < 256)
-				set_left_temperature(temp);
-		}
-	} else if (path == "Vehicle.Cabin.HVAC.Station.Row1.Passenger.Temperature") {
-		if (dp.has_int32()) {
-			int temp = dp.int32();
-			if (temp >= 0 && temp < 256)
-				set_right_temperature(temp);
-		}
-	} else if (path == "Vehicle.Cabin.HVAC.Station.Row1.Driver.FanSpeed") {
-		if (dp.has_uint32()) {
-			int speed = dp.uint32();
-			if (speed >= 0 && speed <= 100)
-				set_left_fan_speed(speed);
-		}
-	} else if (path == "Vehicle.Cabin.HVAC.Station.Row1.Passenger.FanSpeed") {
-		if (dp.has_uint32()) {
-			int speed = dp.uint32();
-			if (speed >= 0 && speed <= 100)
-				set_right_fan_speed(speed);
-		}
-	} else if (path == "Vehicle.Cabin.HVAC.IsAirConditioningActive") {
-		if (dp.has_bool_()) {
-			set_ac_active(dp.bool_());
-		}
-	} else if (path == "Vehicle.Cabin.HVAC.IsFrontDefrosterActive") {
-		if (dp.has_bool_()) {
-			set_front_defrost_active(dp.bool_());
-		}
-	} else if (path == "Vehicle.Cabin.HVAC.IsRearDefrosterActive") {
-		if (dp.has_bool_()) {
-			set_rear_defrost_active(dp.bool_());
-		}
-	} else if (path == "Vehicle.Cabin.HVAC.IsRecirculationActive") {
-		if (dp.has_bool_()) {
-			set_recirculation_active(dp.bool_());
-		}
+void HvacService::Watch(Watchdog *watchdog)
+{
+	std::string prefix;
+	if (!m_hvac_config->vehicle().empty())
+		prefix = m_hvac_config->vehicle() + " ";
+
+	m_outputs.watch(watchdog, prefix);
+	m_subscribe_probe = watchdog->add(prefix + "subscribe callback");
+	if (m_broker)
+		m_broker->setWatchdogProbe(m_subscribe_probe);
+}
+
+// Private
+
+bool HvacService::CheckShutdown()
+{
+	std::chrono::milliseconds budget(m_hvac_config->kuksa().shutdownTimeout);
+	auto elapsed = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() -
+									     m_shutdown_start);
+	bool broker_idle = !m_broker || m_broker->idle();
+	if (!(m_outputs_flushed && broker_idle) && elapsed < budget)
+		return false;
+
+	if (m_outputs_flushed && broker_idle) {
+		if (Logger::verbose())
+			Logger::info("HvacService", "Drained in {} ms", elapsed.count());
+	} else {
+		// Whatever is left is cancelled on deletion
+		Logger::warning("HvacService", "Shutdown budget of {} ms used up with {}{}{} still pending",
+				budget.count(),
+				m_outputs_flushed ? "" : "hardware updates",
+				(m_outputs_flushed || broker_idle) ? "" : " and ",
+				broker_idle ? "" : "broker calls");
 	}
-	// else ignore
+
+	m_shutdown_source = 0;
+	std::function<void()> done = m_shutdown_done;
+	m_shutdown_done = nullptr;
+	if (done)
+		done();
+	return true;
 }
 
-void HvacService::HandleSignalSetError(const std::string &path, const Error &error)
+void HvacService::DispatchSignalChange(const std::string &path, const Datapoint &dp)
 {
-	std::cerr << "Error setting " << path << ": " << error.code() << " - " << error.reason() << std::endl;
+	// The callback API delivers on gRPC's threads, the handlers are run
+	// on the loop thread in either case
+	if (Logger::verbose() > 1)
+		Logger::debug("HvacService", "Value received for {}", path);
+
+	if (m_stopping)
+		return;
+
+	m_dispatcher.dispatch(path, dp);
 }
 
-void HvacService::HandleSubscribeDone(const SubscribeRequest *request, const Status &status)
+void HvacService::RegisterSignals()
+{
+	// Every command is recorded as it comes in, before being acted on
+	FlightRecorder *recorder = &m_flight_recorder;
+	auto received = [recorder](FlightRecorder::SignalId id, int64_t value) {
+		recorder->record(id, FlightRecorder::SOURCE_BROKER, FlightRecorder::RECEIVED, value);
+	};
+
+	// Defrosting is about visibility, so it (and the A/C, which helps
+	// clearing the windows) does not wait behind the sliders.
+	m_dispatcher.add<FrontDefrosterActive>(SignalDispatcher::HIGH, [this, received](bool active) {
+		received(FlightRecorder::FRONT_DEFROST, active);
+		set_front_defrost_active(active);
+	});
+	m_dispatcher.add<RearDefrosterActive>(SignalDispatcher::HIGH, [this, received](bool active) {
+		received(FlightRecorder::REAR_DEFROST, active);
+		set_rear_defrost_active(active);
+	});
+	m_dispatcher.add<AirConditioningActive>(SignalDispatcher::HIGH, [this, received](bool active) {
+		received(FlightRecorder::AC, active);
+		set_ac_active(active);
+	});
+
+	m_dispatcher.add<DriverTemperature>(SignalDispatcher::NORMAL, [this, received](int32_t temp) {
+		received(FlightRecorder::TEMP_LEFT, temp);
+		set_left_temperature(temp);
+	});
+	m_dispatcher.add<PassengerTemperature>(SignalDispatcher::NORMAL, [this, received](int32_t temp) {
+		received(FlightRecorder::TEMP_RIGHT, temp);
+		set_right_temperature(temp);
+	});
+	m_dispatcher.add<DriverFanSpeed>(SignalDispatcher::NORMAL, [this, received](uint8_t speed) {
+		received(FlightRecorder::FAN_SPEED_LEFT, speed);
+		set_left_fan_speed(speed);
+	});
+	m_dispatcher.add<PassengerFanSpeed>(SignalDispatcher::NORMAL, [this, received](uint8_t speed) {
+		received(FlightRecorder::FAN_SPEED_RIGHT, speed);
+		set_right_fan_speed(speed);
+	});
+	m_dispatcher.add<RecirculationActive>(SignalDispatcher::NORMAL, [this, received](bool active) {
+		received(FlightRecorder::RECIRCULATION, active);
+		set_recirculation_active(active);
+	});
+}
+
+void HvacService::HandleSignalSetError(FlightRecorder::SignalId id, int64_t value, const std::string &path,
+				       const Error &error)
+{
+	m_flight_recorder.record(id, FlightRecorder::SOURCE_BROKER, FlightRecorder::SET_ERROR, value, error.code());
+	Logger::error("HvacService", "Error setting {}: {} - {}", path, error.code(), error.reason());
+}
+
+template<class S, SignalValue<S> V>
+void HvacService::PublishSignal(FlightRecorder::SignalId id, V value)
 {
-	if (m_config.verbose())
-		std::cout << "Subscribe status = " << status.error_code() <<
-			" (" << status.error_message() << ")" << std::endl;
+	m_broker->set<S>(value,
+			 [this, id, value](const std::string &path, const Error &error) {
+				 HandleSignalSetError(id, value, path, error);
+			 },
+			 [this, id, value](const std::string &path, const Status &status) {
+				 HandleSignalSetStatus(id, value, path, status);
+			 });
+}
 
-	if (status.error_code() == grpc::CANCELLED) {
-		if (m_config.verbose())
-			std::cerr << "Subscribe canceled, assuming shutdown" << std::endl;
+void HvacService::HandleSignalSetStatus(FlightRecorder::SignalId id, int64_t value, const std::string &path,
+					const Status &status)
+{
+	if (!status.ok())
+		m_flight_recorder.record(id, FlightRecorder::SOURCE_BROKER, FlightRecorder::SET_FAILED, value,
+					 status.error_code());
+
+	// Replaced by a newer value or shutting down, neither is a failure
+	if (status.ok() ||
+	    status.error_code() == grpc::ABORTED ||
+	    status.error_code() == grpc::CANCELLED)
 		return;
-	}
 
-	// Queue up a resubcribe via the GLib event loop callback
-	struct resubscribe_data *data = new (struct resubscribe_data);
-	if (!data) {
-		std::cerr << "Could not create resubcribe_data" << std::endl;
-		exit(1);
-	}
-	data->self = this;
-	// Need to copy request since the one we have been handed is from the
-	// finished subscribe and will be going away.
-	data->request = new SubscribeRequest(*request);
-	if (!data->request) {
-		std::cerr << "Could not create resubscribe SubscribeRequest" << std::endl;
-		exit(1);
+	Logger::warning("HvacService", "Setting {} failed: {} ({})",
+			path, (int) status.error_code(), status.error_message());
+}
+
+void HvacService::HandleSubscribeDone(const SubscribeRequest *request, const Status &status)
+{
+	if (Logger::verbose())
+		Logger::info("HvacService", "Subscribe status = {} ({})",
+			     status.error_code(), status.error_message());
+
+	if (status.error_code() == grpc::CANCELLED || m_stopping) {
+		if (Logger::verbose())
+			Logger::info("HvacService", "Subscribe canceled, assuming shutdown");
+		return;
 	}
 
 	// NOTE: Waiting 100 milliseconds for now; it is possible that some
@@ -161,143 +375,280 @@ void HvacService::HandleSubscribeDone(const SubscribeRequest *request, const Sta
 	//       subscribes are active, or switching to some other resubscribe
 	//       scheme altogether (e.g. post subscribes to a thread that waits
 	//       for the channel to become connected again).
-	g_timeout_add_full(G_PRIORITY_DEFAULT,
-			   100,
-			   resubscribe_cb,
-			   data,
-			   NULL);
+	m_loop->post([this]() {
+		m_loop->addTimeout(100, [this]() {
+			Resubscribe();
+			return false;
+		});
+	});
+}
+
+void HvacService::Resubscribe()
+{
+	if (!m_broker || m_stopping)
+		return;
+
+	// The metadata went with the connection, the broker may have been
+	// restarted with a different set of signals
+	Discover();
+}
+
+void HvacService::Discover()
+{
+	m_broker->loadMetadata({ HVAC_BRANCH }, [this](const Status &status) {
+		m_loop->post([this, status]() {
+			Subscribe(status);
+		});
+	});
 }
 
-void HvacService::Resubscribe(const SubscribeRequest *request)
+void HvacService::Subscribe(const Status &metadata_status)
 {
-	if (!(m_broker && request))
+	if (!m_broker || m_stopping)
 		return;
 
-	m_broker->subscribe(request,
+	std::map<std::string, bool> signals = m_dispatcher.signals();
+	std::vector<std::string> actuators = m_broker->discover(HVAC_BRANCH, EntryType::ENTRY_TYPE_ACTUATOR);
+	if (actuators.empty()) {
+		// Older brokers do not take a branch, stick to what is handled
+		Logger::warning("HvacService", "No actuators found under {} ({}), subscribing to all handled signals",
+				HVAC_BRANCH,
+				metadata_status.ok() ? std::string("empty") : metadata_status.error_message());
+	} else {
+		// Subscribing to a signal the broker does not have would
+		// fail the whole subscription
+		std::set<std::string> found(actuators.begin(), actuators.end());
+		for (auto it = signals.begin(); it != signals.end();) {
+			if (found.count(it->first) || !it->second) {
+				++it;
+				continue;
+			}
+			Logger::warning("HvacService", "Broker has no actuator {}, not handling it", it->first);
+			it = signals.erase(it);
+		}
+		if (Logger::verbose()) {
+			for (auto it = actuators.cbegin(); it != actuators.cend(); ++it) {
+				if (!signals.count(*it))
+					Logger::info("HvacService", "Ignoring unhandled actuator {}", *it);
+			}
+		}
+	}
+	if (signals.empty()) {
+		Logger::error("HvacService", "None of the handled signals is available");
+		return;
+	}
+
+	m_broker->subscribe(signals,
 			    [this](const std::string &path, const Datapoint &dp) {
-				    HandleSignalChange(path, dp);
+				    DispatchSignalChange(path, dp);
 			    },
 			    [this](const SubscribeRequest *request, const Status &s) {
 				    HandleSubscribeDone(request, s);
 			    });
 }
 
-// NOTE: The following should perhaps be scheduling work via the GLib
-//       main loop to avoid potentially blocking threads from the gRPC
-//       pool.
+std::shared_ptr<grpc::ChannelInterface> HvacService::CreateChannel(const std::string &target)
+{
+	// Standbys are to stay connected while not in use
+	grpc::ChannelArguments args;
+	args.SetInt(GRPC_ARG_CLIENT_IDLE_TIMEOUT_MS, INT_MAX);
+
+	// A broker on the same machine is trusted by who may create its
+	// socket file, so there is no TLS; the authorization token is still
+	// sent, which local credentials allow
+	if (HvacConfig::isUnixEndpoint(target))
+		return grpc::CreateCustomChannel(target, grpc::experimental::LocalCredentials(UDS), args);
+
+	if (m_config.caCert().empty())
+		return grpc::CreateCustomChannel(target, grpc::InsecureChannelCredentials(), args);
+
+	grpc::SslCredentialsOptions options;
+	options.pem_root_certs = m_config.caCert();
+	if (!m_config.tlsServerName().empty())
+		args.SetString(GRPC_SSL_TARGET_NAME_OVERRIDE_ARG, m_config.tlsServerName());
+	return grpc::CreateCustomChannel(target, grpc::SslCredentials(options), args);
+}
+
+void HvacService::WatchConfig()
+{
+	if (!m_config_watcher)
+		return;
+
+	m_config_watcher->clear();
+	const std::vector<std::string> &files = m_hvac_config->files();
+	for (auto it = files.cbegin(); it != files.cend(); ++it)
+		m_config_watcher->add(*it);
+}
+
+void HvacService::HandleConfigChange(const std::set<std::string> &changed)
+{
+	if (Logger::verbose()) {
+		for (auto it = changed.cbegin(); it != changed.cend(); ++it)
+			Logger::info("HvacService", "Configuration file {} changed", *it);
+	}
+
+	// Only apply what actually changed, the subscription stream and
+	// the hardware state are left alone.
+	std::shared_ptr<const HvacConfig> hvac_config = m_hvac_config->reload();
+	KuksaConfig config(*hvac_config);
+	if (config.valid()) {
+		if (config.endpoints() != m_config.endpoints() ||
+		    config.caCert() != m_config.caCert() ||
+		    config.tlsServerName() != m_config.tlsServerName() ||
+		    config.rpcTimeout() != m_config.rpcTimeout() ||
+		    config.maxInFlight() != m_config.maxInFlight())
+			Logger::warning("HvacService", "Databroker connection settings changed, restart required to apply");
+
+		// Token content changes are picked up by the provider itself
+		if (m_token_provider && config.authTokenFile() != m_config.authTokenFile())
+			m_token_provider->setPath(config.authTokenFile());
+
+		if (hvac_config->kuksa().sched != m_hvac_config->kuksa().sched ||
+		    hvac_config->kuksa().lockMemory != m_hvac_config->kuksa().lockMemory ||
+		    hvac_config->kuksa().eventLoop != m_hvac_config->kuksa().eventLoop)
+			Logger::warning("HvacService", "Event loop or scheduling settings changed, restart required to apply");
+
+		if (config.verbose() != m_config.verbose())
+			Logger::setVerbose(config.verbose());
+
+		m_config = config;
+	} else {
+		Logger::warning("HvacService", "Ignoring invalid databroker configuration");
+	}
+
+	if (hvac_config->can().sched != m_hvac_config->can().sched ||
+	    hvac_config->outputs().backends != m_hvac_config->outputs().backends ||
+	    hvac_config->outputs().parallel != m_hvac_config->outputs().parallel)
+		Logger::warning("HvacService", "Output backend settings changed, restart required to apply");
+
+	m_outputs.reload(hvac_config);
+
+	m_hvac_config = hvac_config;
+	WatchConfig();
+}
+
+void HvacService::RestoreState()
+{
+	HvacState state;
+	if (!m_state_store.load(state)) {
+		// Record the defaults so there is a valid state to restore,
+		// the hardware is left alone until told otherwise.
+		m_state_store.store(state);
+		m_state_publisher.publish(state);
+		return;
+	}
+
+	m_state.store(state);
+	Logger::info("HvacService", "Restored state: temperature {}/{}, fan {}",
+		     state.temp_left, state.temp_right, state.fan_speed);
+	unsigned flags = state.ac | state.front_defrost << 1 | state.rear_defrost << 2 | state.recirculation << 3;
+	m_flight_recorder.record(FlightRecorder::STATE, FlightRecorder::SOURCE_STARTUP, FlightRecorder::RESTORED,
+				 FlightRecorder::packState(state.temp_left, state.temp_right, state.fan_speed, flags));
+	m_state_publisher.publish(state);
+	m_outputs.apply(state);
+}
+
+HvacState HvacService::StateChanged(std::function<void(HvacState &state)> transition)
+{
+	uint64_t received_ns = m_dispatcher.received();
+	HvacState previous;
+	HvacState state = m_state.update([&transition, received_ns](HvacState &state) {
+		transition(state);
+		state.received_ns = received_ns;
+	}, &previous);
+
+	// Hand on exactly what this transition committed
+	m_state_store.store(state);
+	m_state_publisher.publish(state);
+	m_outputs.apply(state);
+	return previous;
+}
+
+// NOTE: The following are only called from the event loop thread, see
+//       DispatchSignalChange.
 
 void HvacService::set_left_temperature(uint8_t temp)
 {
-	m_can_helper.set_left_temperature(temp);
-	m_led_helper.set_left_temperature(temp);
+	StateChanged([temp](HvacState &state) { state.temp_left = temp; });
+	if (!m_broker)
+		return;
 
 	// Push out new value
-	m_broker->set("Vehicle.Cabin.HVAC.Station.Row1.Driver.Temperature",
-		      (int) temp,
-		      [this](const std::string &path, const Error &error) {
-			      HandleSignalSetError(path, error);
-		      });
+	PublishSignal<DriverTemperature>(FlightRecorder::TEMP_LEFT, temp);
 }
 
 void HvacService::set_right_temperature(uint8_t temp)
 {
-	m_can_helper.set_right_temperature(temp);
-	m_led_helper.set_right_temperature(temp);
+	StateChanged([temp](HvacState &state) { state.temp_right = temp; });
+	if (!m_broker)
+		return;
 
 	// Push out new value
-	m_broker->set("Vehicle.Cabin.HVAC.Station.Row1.Passenger.Temperature",
-		      (int) temp,
-		      [this](const std::string &path, const Error &error) {
-			      HandleSignalSetError(path, error);
-		      });
+	PublishSignal<PassengerTemperature>(FlightRecorder::TEMP_RIGHT, temp);
 }
 
 void HvacService::set_left_fan_speed(uint8_t speed)
 {
 	set_fan_speed(speed);
+	if (!m_broker)
+		return;
 
 	// Push out new value
-	m_broker->set("Vehicle.Cabin.HVAC.Station.Row1.Driver.FanSpeed",
-		      speed,
-		      [this](const std::string &path, const Error &error) {
-			      HandleSignalSetError(path, error);
-		      });
+	PublishSignal<DriverFanSpeed>(FlightRecorder::FAN_SPEED_LEFT, speed);
 }
 
 void HvacService::set_right_fan_speed(uint8_t speed)
 {
 	set_fan_speed(speed);
+	if (!m_broker)
+		return;
 
 	// Push out new value
-	m_broker->set("Vehicle.Cabin.HVAC.Station.Row1.Passenger.FanSpeed",
-		      speed,
-		      [this](const std::string &path, const Error &error) {
-			      HandleSignalSetError(path, error);
-		      });
+	PublishSignal<PassengerFanSpeed>(FlightRecorder::FAN_SPEED_RIGHT, speed);
 }
 
 void HvacService::set_fan_speed(uint8_t speed)
 {
-	m_can_helper.set_fan_speed(speed);
+	StateChanged([speed](HvacState &state) { state.fan_speed = speed; });
 }
 
 void HvacService::set_ac_active(bool active)
 {
-	const std::lock_guard<std::mutex> lock(m_hvac_state_mutex);
-	if (m_IsAirConditioningActive != active) {
-		m_IsAirConditioningActive = active;
+	HvacState previous = StateChanged([active](HvacState &state) { state.ac = active; });
+	if (!m_broker || previous.ac == active)
+		return;
 
-		// Push out new value
-		m_broker->set("Vehicle.Cabin.HVAC.IsAirConditioningActive",
-			      active,
-			      [this](const std::string &path, const Error &error) {
-				      HandleSignalSetError(path, error);
-			      });
-	}
+	// Push out new value
+	PublishSignal<AirConditioningActive>(FlightRecorder::AC, active);
 }
 
 void HvacService::set_front_defrost_active(bool active)
 {
-	const std::lock_guard<std::mutex> lock(m_hvac_state_mutex);
-	if (m_IsFrontDefrosterActive != active) {
-		m_IsFrontDefrosterActive = active;
+	HvacState previous = StateChanged([active](HvacState &state) { state.front_defrost = active; });
+	if (!m_broker || previous.front_defrost == active)
+		return;
 
-		// Push out new value
-		m_broker->set("Vehicle.Cabin.HVAC.IsFrontDefrosterActive",
-			      active,
-			      [this](const std::string &path, const Error &error) {
-				      HandleSignalSetError(path, error);
-			      });
-	}
+	// Push out new value
+	PublishSignal<FrontDefrosterActive>(FlightRecorder::FRONT_DEFROST, active);
 }
 
 void HvacService::set_rear_defrost_active(bool active)
 {
-	const std::lock_guard<std::mutex> lock(m_hvac_state_mutex);
-	if (m_IsRearDefrosterActive != active) {
-		m_IsRearDefrosterActive = active;
+	HvacState previous = StateChanged([active](HvacState &state) { state.rear_defrost = active; });
+	if (!m_broker || previous.rear_defrost == active)
+		return;
 
-		// Push out new value
-		m_broker->set("Vehicle.Cabin.HVAC.IsRearDefrosterActive",
-			      active,
-			      [this](const std::string &path, const Error &error) {
-				      HandleSignalSetError(path, error);
-			      });
-	}
+	// Push out new value
+	PublishSignal<RearDefrosterActive>(FlightRecorder::REAR_DEFROST, active);
 }
 
 void HvacService::set_recirculation_active(bool active)
 {
-	const std::lock_guard<std::mutex> lock(m_hvac_state_mutex);
-	if (m_IsRecirculationActive != active) {
-		m_IsRecirculationActive = active;
+	HvacState previous = StateChanged([active](HvacState &state) { state.recirculation = active; });
+	if (!m_broker || previous.recirculation == active)
+		return;
 
-		// Push out new value
-		m_broker->set("Vehicle.Cabin.HVAC.IsRecirculationActive",
-			      active,
-			      [this](const std::string &path, const Error &error) {
-				      HandleSignalSetError(path, error);
-			      });
-	}
+	// Push out new value
+	PublishSignal<RecirculationActive>(FlightRecorder::RECIRCULATION, active);
 }
 
@@ -7,56 +7,147 @@
 #ifndef _HVAC_SERVICE_H
 #define _HVAC_SERVICE_H
 
-#include <mutex>
-#include <glib.h>
-
+#include <set>
+#include <memory>
+#include <functional>
+#include <atomic>
+#include <chrono>
+
+#include "EventLoop.h"
+#include "HvacConfig.h"
 #include "KuksaConfig.h"
 #include "KuksaClient.h"
-#include "HvacCanHelper.h"
-#include "HvacLedHelper.h"
+#include "ConfigWatcher.h"
+#include "SignalDispatcher.h"
+#include "HvacOutput.h"
+#include "HvacStateStore.h"
+#include "HvacStateWord.h"
+#include "HvacStatePublisher.h"
+#include "Watchdog.h"
+#include "FlightRecorder.h"
+
+// Signal handling and all state updates run on the event loop thread, so
+// none of the state below needs locking.  Hardware updates run there as
+// well unless the outputs are configured to use their own thread(s).
 
 class HvacService
 {
 public:
-	HvacService(const KuksaConfig &config, GMainLoop *loop = NULL);
+	// Returns without waiting for the broker; the connection is made
+	// from the loop once one of its channels is ready.  Without
+	// connect, none is made and signal changes only come in via Replay()
+	HvacService(std::shared_ptr<const HvacConfig> config, EventLoop *loop, bool connect = true);
+
+	// Offline as above, but changes are written back through broker
+	// (which the service then owns); for exercising the write path
+	// without subscribing
+	HvacService(std::shared_ptr<const HvacConfig> config, EventLoop *loop, KuksaClient *broker);
 
 	~HvacService();
 
-	// Callback for KuksaClient subscribe API reconnect
+	// Names the state file, flight recorder and state segment of an
+	// instance after
+	static std::string instanceName(const HvacConfig &config, bool connect);
 
-	static gboolean resubscribe_cb(gpointer data) {
-		struct resubscribe_data *d = (struct resubscribe_data*) data;
-		if (d && d->self) {
-			((HvacService*) d->self)->Resubscribe(d->request);
-		}
-		return FALSE;
-	}
+	// Handle a recorded subscribe response as if just received, on
+	// the event loop thread
+	void Replay(const SubscribeResponse &response);
 
-private:
-	struct resubscribe_data {
-		HvacService *self;
-		const SubscribeRequest *request;
-	};
+	// Log the per-lane dispatch latencies since the last report
+	void ReportDispatchStats() { m_dispatcher.report(); };
+
+	// Orderly exit, on the event loop thread: stop taking updates, push
+	// what was received to the hardware and the broker, and wait for
+	// all streams to be done.  done is called on the loop once that is
+	// complete or the shutdown-timeout budget is used up; the service
+	// can then be deleted without any callbacks left pointing at it.
+	void Shutdown(std::function<void()> done);
 
-	GMainLoop *m_loop;
+	// Add probes for the output threads and subscribe callbacks
+	void Watch(Watchdog *watchdog);
+
+	// Actuator state as last applied, from any thread without locking
+	HvacState State(uint32_t *version = NULL) const { return m_state.load(version); };
+
+private:
+	EventLoop *m_loop;
+	std::shared_ptr<const HvacConfig> m_hvac_config;
 	KuksaConfig m_config;
 	KuksaClient *m_broker;
-	HvacCanHelper m_can_helper;
-	HvacLedHelper m_led_helper;
+	std::shared_ptr<AuthTokenProvider> m_token_provider;
+
+	// Command and outcome history, used by the outputs as well
+	FlightRecorder m_flight_recorder;
+
+	SignalDispatcher m_dispatcher;
+	HvacOutputs m_outputs;
+	ConfigWatcher *m_config_watcher;
+
+	// Actuator state as last applied, kept for warm restarts
+	HvacStateStore m_state_store;
+	HvacStateWord m_state;
+
+	// Same state for local consumers
+	HvacStatePublisher m_state_publisher;
+
+	// Shutdown in progress
+	std::atomic<bool> m_stopping;
+	std::function<void()> m_shutdown_done;
+	std::chrono::steady_clock::time_point m_shutdown_start;
+	unsigned m_shutdown_source;
+	bool m_outputs_flushed;
+
+	// Reconnects standby databrokers
+	unsigned m_standby_source;
 
-	std::mutex m_hvac_state_mutex;
-	bool m_IsAirConditioningActive = false;
-	bool m_IsFrontDefrosterActive = false;
-	bool m_IsRearDefrosterActive = false;
-	bool m_IsRecirculationActive = false;
+	// Waiting for a databroker channel to be ready
+	unsigned m_connect_source;
+	std::vector<std::string> m_endpoints;
+	std::vector<std::shared_ptr<grpc::ChannelInterface>> m_channels;
 
-	void HandleSignalChange(const std::string &path, const Datapoint &dp);
+	// Handed to the client once there is one
+	std::shared_ptr<WatchdogProbe> m_subscribe_probe;
 
-	void HandleSignalSetError(const std::string &path, const Error &error);
+	void DispatchSignalChange(const std::string &path, const Datapoint &dp);
+
+	void RegisterSignals();
+
+	void HandleSignalSetError(FlightRecorder::SignalId id, int64_t value, const std::string &path,
+				  const Error &error);
+
+	void HandleSignalSetStatus(FlightRecorder::SignalId id, int64_t value, const std::string &path,
+				   const Status &status);
+
+	// Write back the current value of a signal
+	template<class S, SignalValue<S> V> void PublishSignal(FlightRecorder::SignalId id, V value);
+
+	std::shared_ptr<grpc::ChannelInterface> CreateChannel(const std::string &target);
+
+	// Creates the client once one of m_channels is ready
+	bool CheckConnected();
+	void Connect();
 
 	void HandleSubscribeDone(const SubscribeRequest *request, const Status &status);
 
-	void Resubscribe(const SubscribeRequest *request);
+	void Resubscribe();
+
+	// Fetch the metadata of the HVAC branch, then Subscribe()
+	void Discover();
+
+	// To the handled signals the broker has
+	void Subscribe(const Status &metadata_status);
+
+	bool CheckShutdown();
+
+	void RestoreState();
+
+	// Apply transition to the state and hand the result on, returns the
+	// state it replaced
+	HvacState StateChanged(std::function<void(HvacState &state)> transition);
+
+	void WatchConfig();
+
+	void HandleConfigChange(const std::set<std::string> &changed);
 
 	void set_left_temperature(uint8_t temp);
 
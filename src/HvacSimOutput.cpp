@@ -0,0 +1,123 @@
+/*
+ * Copyright (C) 2023 Konsulko Group
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#include <cstdio>
+#include <cerrno>
+#include <cstring>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <linux/can.h>
+
+#include "HvacSimOutput.h"
+#include "HvacCanHelper.h"
+#include "HvacLedHelper.h"
+#include "Logger.h"
+
+//
+// SimCanOutput
+//
+
+SimCanOutput::SimCanOutput(std::shared_ptr<const HvacConfig> config, EventLoop *loop) :
+	m_loop(loop),
+	m_verbose(config->outputs().verbose),
+	m_source(0),
+	m_sent(0),
+	m_received(0),
+	m_dropped(0)
+{
+	m_fds[0] = m_fds[1] = -1;
+	if (socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_NONBLOCK | SOCK_CLOEXEC, 0, m_fds) < 0) {
+		Logger::error("SimCanOutput", "Could not create socketpair: {}", strerror(errno));
+		return;
+	}
+
+	if (m_loop) {
+		m_source = m_loop->addFd(m_fds[1], EventLoop::IN, [this](uint32_t events) {
+			drain();
+			return true;
+		});
+	}
+}
+
+SimCanOutput::~SimCanOutput()
+{
+	if (m_source)
+		m_loop->remove(m_source);
+	if (m_fds[0] >= 0)
+		close(m_fds[0]);
+	if (m_fds[1] >= 0)
+		close(m_fds[1]);
+
+	Logger::info("SimCanOutput", "{} frames sent, {} received, {} dropped",
+		     m_sent, m_received, m_dropped);
+}
+
+void SimCanOutput::apply(const HvacState &state)
+{
+	if (m_fds[0] < 0)
+		return;
+
+	struct can_frame frame;
+	HvacCanHelper::make_frame(state.temp_left, state.temp_right, state.fan_speed, frame);
+	if (send(m_fds[0], &frame, sizeof(frame), MSG_DONTWAIT) < 0) {
+		m_dropped++;
+		return;
+	}
+	m_sent++;
+}
+
+void SimCanOutput::drain()
+{
+	struct can_frame frame;
+	while (recv(m_fds[1], &frame, sizeof(frame), MSG_DONTWAIT) == sizeof(frame)) {
+		m_received++;
+		if (m_verbose > 1)
+			Logger::debug("SimCanOutput", "frame {}: {} {} {} {} {}", frame.can_id,
+				      frame.data[0], frame.data[1], frame.data[2], frame.data[3], frame.data[4]);
+	}
+}
+
+//
+// SimLedOutput
+//
+
+SimLedOutput::SimLedOutput(std::shared_ptr<const HvacConfig> config, EventLoop *loop) :
+	m_dir(config->outputs().simLedsDir)
+{
+	static const char *names[3] = { "red", "green", "blue" };
+
+	mkdir(m_dir.c_str(), 0755);
+	for (int i = 0; i < 3; i++) {
+		std::string path = m_dir + "/" + names[i];
+		m_fds[i] = open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+		if (m_fds[i] < 0)
+			Logger::error("SimLedOutput", "Could not open {}: {}", path, strerror(errno));
+	}
+}
+
+SimLedOutput::~SimLedOutput()
+{
+	for (int i = 0; i < 3; i++) {
+		if (m_fds[i] >= 0)
+			close(m_fds[i]);
+	}
+}
+
+void SimLedOutput::apply(const HvacState &state)
+{
+	int rgb[3];
+	HvacLedHelper::colour(state.temp_left, state.temp_right, rgb);
+	for (int i = 0; i < 3; i++) {
+		if (m_fds[i] < 0)
+			continue;
+		char buf[8];
+		int len = snprintf(buf, sizeof(buf), "%d\n", rgb[i]);
+		if (pwrite(m_fds[i], buf, len, 0) != len || ftruncate(m_fds[i], len) < 0)
+			Logger::error("SimLedOutput", "Could not write LED file in {}", m_dir);
+	}
+}
@@ -0,0 +1,61 @@
+/*
+ * Copyright (C) 2023 Konsulko Group
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#ifndef _HVAC_SIM_OUTPUT_H
+#define _HVAC_SIM_OUTPUT_H
+
+#include <cstdint>
+#include <string>
+
+#include "HvacOutput.h"
+
+// Simulated backends for load testing without hardware
+//
+// Both produce exactly what the real backends would, but write every
+// snapshot without skipping unchanged ones.
+
+// "sim-can": frames go out over a socketpair, the other end is drained
+// (and the frames counted) on the loop.
+
+class SimCanOutput : public HvacOutput
+{
+public:
+	SimCanOutput(std::shared_ptr<const HvacConfig> config, EventLoop *loop);
+
+	~SimCanOutput();
+
+	void apply(const HvacState &state) override;
+
+private:
+	void drain();
+
+	EventLoop *m_loop;
+	unsigned m_verbose;
+	int m_fds[2];
+	unsigned m_source;
+	uint64_t m_sent;
+	uint64_t m_received;
+	uint64_t m_dropped;
+};
+
+// "sim-leds": brightness values are written to red, green and blue files
+// in [outputs] sim-leds-dir, ideally on a tmpfs.
+
+class SimLedOutput : public HvacOutput
+{
+public:
+	SimLedOutput(std::shared_ptr<const HvacConfig> config, EventLoop *loop);
+
+	~SimLedOutput();
+
+	void apply(const HvacState &state) override;
+
+private:
+	std::string m_dir;
+	int m_fds[3];
+};
+
+#endif // _HVAC_SIM_OUTPUT_H
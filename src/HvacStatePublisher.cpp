@@ -0,0 +1,94 @@
+/*
+ * Copyright (C) 2023 Konsulko Group
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#include <cstring>
+#include <sys/stat.h>
+
+#include "HvacStatePublisher.h"
+#include "Logger.h"
+
+HvacStatePublisher::HvacStatePublisher(const std::string &name) :
+	m_name(name),
+	m_layout(NULL)
+{
+	int fd = shm_open(m_name.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+	if (fd < 0) {
+		Logger::warning("HvacStatePublisher", "Could not open {}: {}", m_name, strerror(errno));
+		return;
+	}
+
+	// Readable by everyone, only we write; set explicitly as the umask
+	// may have taken bits off, and it is not ours to change with other
+	// threads creating files
+	if (fchmod(fd, 0644) < 0)
+		Logger::warning("HvacStatePublisher", "Could not make {} readable: {}", m_name, strerror(errno));
+
+	if (ftruncate(fd, sizeof(HvacShmLayout)) < 0) {
+		Logger::warning("HvacStatePublisher", "Could not size {}: {}", m_name, strerror(errno));
+		close(fd);
+		return;
+	}
+
+	void *p = mmap(NULL, sizeof(HvacShmLayout), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+	if (p == MAP_FAILED) {
+		Logger::warning("HvacStatePublisher", "Could not map {}: {}", m_name, strerror(errno));
+		return;
+	}
+	m_layout = (HvacShmLayout*) p;
+
+	// Left over from a previous run otherwise, keep counting from there
+	// so waiting readers see a change.
+	uint32_t seq = m_layout->seq.load(std::memory_order_relaxed);
+	if (m_layout->magic != HVAC_SHM_MAGIC || m_layout->version != HVAC_SHM_VERSION) {
+		m_layout->magic = HVAC_SHM_MAGIC;
+		m_layout->version = HVAC_SHM_VERSION;
+		seq = 0;
+	}
+	m_layout->seq.store(seq & ~1u, std::memory_order_release);
+}
+
+std::string HvacStatePublisher::segmentName(const std::string &vehicle)
+{
+	std::string name(HVAC_SHM_NAME);
+	if (!vehicle.empty())
+		name += "-" + vehicle;
+
+	return name;
+}
+
+HvacStatePublisher::~HvacStatePublisher()
+{
+	if (m_layout)
+		munmap(m_layout, sizeof(HvacShmLayout));
+}
+
+void HvacStatePublisher::publish(const HvacState &state)
+{
+	if (!m_layout)
+		return;
+
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	uint32_t seq = m_layout->seq.load(std::memory_order_relaxed);
+	m_layout->seq.store(seq + 1, std::memory_order_relaxed);
+	std::atomic_thread_fence(std::memory_order_release);
+
+	m_layout->timestamp.store((uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec, std::memory_order_relaxed);
+	m_layout->temp_left.store(state.temp_left, std::memory_order_relaxed);
+	m_layout->temp_right.store(state.temp_right, std::memory_order_relaxed);
+	m_layout->fan_speed.store(state.fan_speed, std::memory_order_relaxed);
+	m_layout->ac.store(state.ac, std::memory_order_relaxed);
+	m_layout->front_defrost.store(state.front_defrost, std::memory_order_relaxed);
+	m_layout->rear_defrost.store(state.rear_defrost, std::memory_order_relaxed);
+	m_layout->recirculation.store(state.recirculation, std::memory_order_relaxed);
+
+	m_layout->seq.store(seq + 2, std::memory_order_release);
+
+	// Wake readers blocked in HvacShmReader::wait()
+	syscall(SYS_futex, &m_layout->seq, FUTEX_WAKE, INT32_MAX, NULL, NULL, 0);
+}
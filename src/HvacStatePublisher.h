@@ -0,0 +1,38 @@
+/*
+ * Copyright (C) 2023 Konsulko Group
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#ifndef _HVAC_STATE_PUBLISHER_H
+#define _HVAC_STATE_PUBLISHER_H
+
+#include <string>
+
+#include "HvacStateStore.h"
+#include "HvacStateShm.h"
+
+// Writer side of the shared-memory state segment, see HvacStateShm.h
+//
+// The segment is left in place on exit so readers' mappings stay usable
+// across a service restart.
+
+class HvacStatePublisher
+{
+public:
+	explicit HvacStatePublisher(const std::string &name);
+
+	~HvacStatePublisher();
+
+	bool valid() { return m_layout != NULL; };
+
+	void publish(const HvacState &state);
+
+	static std::string segmentName(const std::string &vehicle = "");
+
+private:
+	std::string m_name;
+	HvacShmLayout *m_layout;
+};
+
+#endif // _HVAC_STATE_PUBLISHER_H
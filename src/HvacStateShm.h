@@ -0,0 +1,156 @@
+/*
+ * Copyright (C) 2023 Konsulko Group
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#ifndef _HVAC_STATE_SHM_H
+#define _HVAC_STATE_SHM_H
+
+// HVAC state as published by agl-service-hvac in POSIX shared memory
+//
+// Header-only reader for local consumers.  After open(), read() is just a
+// few loads from the shared mapping: no syscalls, no locks, and it never
+// holds up the service.  The service updates the segment under a sequence
+// counter (odd while an update is in progress), read() retries if it
+// raced an update.  wait() blocks on the sequence counter with a futex
+// for change notification.
+//
+//	HvacShmReader reader;
+//	HvacShmSnapshot state;
+//	if (reader.open() && reader.read(state))
+//		printf("%u\n", state.temp_left);
+
+#include <atomic>
+#include <cstdint>
+#include <ctime>
+#include <cerrno>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+
+// In multi-vehicle mode there is one segment per vehicle, named
+// HVAC_SHM_NAME "-<vehicle>"
+#define HVAC_SHM_NAME    "/agl-service-hvac-state"
+#define HVAC_SHM_MAGIC   0x53435648	// "HVCS"
+#define HVAC_SHM_VERSION 1
+
+// Segment layout, bump HVAC_SHM_VERSION on any change
+struct HvacShmLayout {
+	uint32_t magic;
+	uint32_t version;
+	std::atomic<uint32_t> seq;	// futex word
+	uint32_t reserved;
+	std::atomic<uint64_t> timestamp;	// CLOCK_MONOTONIC ns of last update
+	std::atomic<uint8_t> temp_left;
+	std::atomic<uint8_t> temp_right;
+	std::atomic<uint8_t> fan_speed;	// VSS 0-100
+	std::atomic<uint8_t> ac;
+	std::atomic<uint8_t> front_defrost;
+	std::atomic<uint8_t> rear_defrost;
+	std::atomic<uint8_t> recirculation;
+};
+
+static_assert(std::atomic<uint32_t>::is_always_lock_free &&
+	      std::atomic<uint64_t>::is_always_lock_free &&
+	      std::atomic<uint8_t>::is_always_lock_free,
+	      "shared memory atomics need to be lock-free");
+
+struct HvacShmSnapshot {
+	uint32_t seq;
+	uint64_t timestamp;
+	uint8_t temp_left;
+	uint8_t temp_right;
+	uint8_t fan_speed;
+	bool ac;
+	bool front_defrost;
+	bool rear_defrost;
+	bool recirculation;
+};
+
+class HvacShmReader
+{
+public:
+	HvacShmReader() : m_layout(NULL) {};
+
+	~HvacShmReader() { close(); };
+
+	bool open(const char *name = HVAC_SHM_NAME) {
+		close();
+		int fd = shm_open(name, O_RDONLY | O_CLOEXEC, 0);
+		if (fd < 0)
+			return false;
+		void *p = mmap(NULL, sizeof(HvacShmLayout), PROT_READ, MAP_SHARED, fd, 0);
+		::close(fd);
+		if (p == MAP_FAILED)
+			return false;
+		m_layout = (const HvacShmLayout*) p;
+		return true;
+	};
+
+	void close() {
+		if (m_layout)
+			munmap((void*) m_layout, sizeof(HvacShmLayout));
+		m_layout = NULL;
+	};
+
+	// Returns false if the segment is not open or nothing has been
+	// published yet
+	bool read(HvacShmSnapshot &snapshot) const {
+		if (!(m_layout &&
+		      m_layout->magic == HVAC_SHM_MAGIC &&
+		      m_layout->version == HVAC_SHM_VERSION))
+			return false;
+
+		for (;;) {
+			uint32_t seq = m_layout->seq.load(std::memory_order_acquire);
+			if (seq == 0)
+				return false;
+			if (seq & 1)
+				continue;
+
+			snapshot.seq = seq;
+			snapshot.timestamp = m_layout->timestamp.load(std::memory_order_relaxed);
+			snapshot.temp_left = m_layout->temp_left.load(std::memory_order_relaxed);
+			snapshot.temp_right = m_layout->temp_right.load(std::memory_order_relaxed);
+			snapshot.fan_speed = m_layout->fan_speed.load(std::memory_order_relaxed);
+			snapshot.ac = m_layout->ac.load(std::memory_order_relaxed);
+			snapshot.front_defrost = m_layout->front_defrost.load(std::memory_order_relaxed);
+			snapshot.rear_defrost = m_layout->rear_defrost.load(std::memory_order_relaxed);
+			snapshot.recirculation = m_layout->recirculation.load(std::memory_order_relaxed);
+
+			std::atomic_thread_fence(std::memory_order_acquire);
+			if (m_layout->seq.load(std::memory_order_relaxed) == seq)
+				return true;
+		}
+	};
+
+	// Wait until the state differs from the one read with sequence
+	// number seq; returns false on timeout (timeout_ms < 0 waits
+	// forever).
+	bool wait(uint32_t seq, int timeout_ms = -1) const {
+		if (!m_layout)
+			return false;
+
+		struct timespec ts;
+		ts.tv_sec = timeout_ms / 1000;
+		ts.tv_nsec = (timeout_ms % 1000) * 1000000L;
+		for (;;) {
+			uint32_t current = m_layout->seq.load(std::memory_order_acquire);
+			if (current != seq && !(current & 1))
+				return true;
+			// Not FUTEX_PRIVATE_FLAG, the word is shared between processes
+			long rc = syscall(SYS_futex, &m_layout->seq, FUTEX_WAIT, current,
+					  timeout_ms < 0 ? NULL : &ts, NULL, 0);
+			if (rc < 0 && errno == ETIMEDOUT)
+				return false;
+		}
+	};
+
+private:
+	const HvacShmLayout *m_layout;
+};
+
+#endif // _HVAC_STATE_SHM_H
@@ -0,0 +1,165 @@
+/*
+ * Copyright (C) 2023 Konsulko Group
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#include <atomic>
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "HvacStateStore.h"
+#include "Logger.h"
+
+#define STATE_MAGIC   0x43415648	// "HVAC"
+#define STATE_VERSION 1
+
+// On-disk layout, bump STATE_VERSION on any change
+struct HvacStateStore::Record {
+	uint32_t magic;
+	uint32_t version;
+	std::atomic<uint32_t> seq;
+	uint32_t checksum;
+	struct {
+		uint8_t temp_left;
+		uint8_t temp_right;
+		uint8_t fan_speed;
+		uint8_t ac;
+		uint8_t front_defrost;
+		uint8_t rear_defrost;
+		uint8_t recirculation;
+		uint8_t reserved;
+	} data;
+};
+
+namespace {
+
+// FNV-1a
+uint32_t checksum(const void *data, size_t len)
+{
+	const uint8_t *p = (const uint8_t*) data;
+	uint32_t hash = 2166136261u;
+	for (size_t i = 0; i < len; i++) {
+		hash ^= p[i];
+		hash *= 16777619u;
+	}
+	return hash;
+}
+
+} // namespace
+
+HvacStateStore::HvacStateStore(const std::string &path) :
+	m_path(path),
+	m_record(NULL)
+{
+	auto pos = m_path.rfind('/');
+	if (pos != std::string::npos && pos > 0)
+		mkdir(m_path.substr(0, pos).c_str(), 0755);
+
+	int fd = open(m_path.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+	if (fd < 0) {
+		Logger::warning("HvacStateStore", "Could not open {}: {}", m_path, strerror(errno));
+		return;
+	}
+
+	// A new file reads back as zeroes, i.e. no valid record
+	if (ftruncate(fd, sizeof(Record)) < 0) {
+		Logger::warning("HvacStateStore", "Could not size {}: {}", m_path, strerror(errno));
+		close(fd);
+		return;
+	}
+
+	void *p = mmap(NULL, sizeof(Record), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+	if (p == MAP_FAILED) {
+		Logger::warning("HvacStateStore", "Could not map {}: {}", m_path, strerror(errno));
+		return;
+	}
+	m_record = (Record*) p;
+}
+
+HvacStateStore::~HvacStateStore()
+{
+	if (m_record)
+		munmap(m_record, sizeof(Record));
+}
+
+bool HvacStateStore::load(HvacState &state)
+{
+	if (!m_record)
+		return false;
+
+	if (m_record->magic != STATE_MAGIC || m_record->version != STATE_VERSION)
+		return false;
+
+	uint32_t seq = m_record->seq.load(std::memory_order_acquire);
+	if (seq & 1) {
+		Logger::warning("HvacStateStore", "Discarding interrupted state update");
+		return false;
+	}
+
+	auto data = m_record->data;
+	uint32_t sum = m_record->checksum;
+	std::atomic_thread_fence(std::memory_order_acquire);
+	if (m_record->seq.load(std::memory_order_relaxed) != seq ||
+	    sum != checksum(&data, sizeof(data))) {
+		Logger::warning("HvacStateStore", "Discarding corrupt state in {}", m_path);
+		return false;
+	}
+
+	state.temp_left = data.temp_left;
+	state.temp_right = data.temp_right;
+	state.fan_speed = data.fan_speed;
+	state.ac = data.ac;
+	state.front_defrost = data.front_defrost;
+	state.rear_defrost = data.rear_defrost;
+	state.recirculation = data.recirculation;
+
+	return true;
+}
+
+void HvacStateStore::store(const HvacState &state)
+{
+	if (!m_record)
+		return;
+
+	uint32_t seq = m_record->seq.load(std::memory_order_relaxed);
+	if (seq & 1)
+		seq++;
+	m_record->seq.store(seq + 1, std::memory_order_relaxed);
+	std::atomic_thread_fence(std::memory_order_release);
+
+	m_record->magic = STATE_MAGIC;
+	m_record->version = STATE_VERSION;
+	m_record->data.temp_left = state.temp_left;
+	m_record->data.temp_right = state.temp_right;
+	m_record->data.fan_speed = state.fan_speed;
+	m_record->data.ac = state.ac;
+	m_record->data.front_defrost = state.front_defrost;
+	m_record->data.rear_defrost = state.rear_defrost;
+	m_record->data.recirculation = state.recirculation;
+	m_record->data.reserved = 0;
+	m_record->checksum = checksum(&m_record->data, sizeof(m_record->data));
+
+	m_record->seq.store(seq + 2, std::memory_order_release);
+}
+
+std::string HvacStateStore::defaultPath(const std::string &vehicle)
+{
+	// May be a colon separated list, use the first entry
+	const char *dir = getenv("STATE_DIRECTORY");
+	std::string path(dir && *dir ? dir : "/var/lib/agl-service-hvac");
+	auto pos = path.find(':');
+	if (pos != std::string::npos)
+		path.erase(pos);
+
+	if (!vehicle.empty())
+		return path + "/" + vehicle + ".state";
+
+	return path + "/state";
+}
@@ -0,0 +1,63 @@
+/*
+ * Copyright (C) 2023 Konsulko Group
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#ifndef _HVAC_STATE_STORE_H
+#define _HVAC_STATE_STORE_H
+
+#include <cstdint>
+#include <string>
+
+// Last applied actuator state
+struct HvacState {
+	uint8_t temp_left = 21;
+	uint8_t temp_right = 21;
+	uint8_t fan_speed = 0;		// VSS 0-100
+	bool ac = false;
+	bool front_defrost = false;
+	bool rear_defrost = false;
+	bool recirculation = false;
+
+	// When the update leading to this state came in (CLOCK_MONOTONIC
+	// ns), 0 if not caused by one; not saved
+	uint64_t received_ns = 0;
+};
+
+// Persistent copy of the HVAC state for warm restarts
+//
+// The state lives in a small mmap'd file, so an update is a handful of
+// stores into the page cache and survives the process crashing.  Updates
+// are bracketed by a sequence counter (odd while a write is in progress)
+// and carry a checksum, so a record torn by a crash mid-update is
+// detected on load and ignored.
+
+class HvacStateStore
+{
+public:
+	explicit HvacStateStore(const std::string &path);
+
+	~HvacStateStore();
+
+	bool valid() { return m_record != NULL; };
+
+	// Returns false, leaving state untouched, if there is no intact
+	// saved state
+	bool load(HvacState &state);
+
+	void store(const HvacState &state);
+
+	// $STATE_DIRECTORY/state if run with systemd's StateDirectory=,
+	// /var/lib/agl-service-hvac/state otherwise; <vehicle>.state in
+	// multi-vehicle mode
+	static std::string defaultPath(const std::string &vehicle = "");
+
+private:
+	struct Record;
+
+	std::string m_path;
+	Record *m_record;
+};
+
+#endif // _HVAC_STATE_STORE_H
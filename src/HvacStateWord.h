@@ -0,0 +1,102 @@
+/*
+ * Copyright (C) 2023 Konsulko Group
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#ifndef _HVAC_STATE_WORD_H
+#define _HVAC_STATE_WORD_H
+
+#include <atomic>
+#include <cstdint>
+
+#include "HvacStateStore.h"
+
+// Complete actuator state packed into one atomic word, on a cache line of
+// its own
+//
+//	bits  0-7	temp_left
+//	bits  8-15	temp_right
+//	bits 16-23	fan_speed
+//	bits 24-27	ac, front_defrost, rear_defrost, recirculation
+//	bits 32-63	version, incremented by every transition
+//
+// Transitions are compare-and-swap loops, so there may be writers on
+// several threads, and load() is a single atomic load: any thread gets a
+// consistent snapshot without locks.  received_ns is only used for
+// latency statistics and kept next to the word rather than in it; with
+// several writers it may come from a neighbouring transition.
+
+class alignas(64) HvacStateWord
+{
+public:
+	HvacStateWord() : m_word(pack(HvacState(), 0)), m_received_ns(0) {};
+
+	// Current state, and its version if wanted
+	HvacState load(uint32_t *version = NULL) const {
+		uint64_t word = m_word.load(std::memory_order_acquire);
+		HvacState state = unpack(word);
+		state.received_ns = m_received_ns.load(std::memory_order_relaxed);
+		if (version)
+			*version = (uint32_t) (word >> 32);
+		return state;
+	};
+
+	// Apply transition (a function modifying an HvacState) to the
+	// current state, returns the state committed by it, and if wanted
+	// the state it replaced and its version
+	template<class F>
+	HvacState update(F transition, HvacState *previous = NULL, uint32_t *version = NULL) {
+		uint64_t word = m_word.load(std::memory_order_relaxed);
+		HvacState state;
+		uint64_t next;
+		do {
+			state = unpack(word);
+			state.received_ns = 0;
+			transition(state);
+			next = pack(state, (uint32_t) (word >> 32) + 1);
+		} while (!m_word.compare_exchange_weak(word, next,
+						       std::memory_order_release,
+						       std::memory_order_relaxed));
+		if (state.received_ns)
+			m_received_ns.store(state.received_ns, std::memory_order_relaxed);
+		if (previous)
+			*previous = unpack(word);
+		if (version)
+			*version = (uint32_t) (next >> 32);
+		return state;
+	};
+
+	HvacState store(const HvacState &state, HvacState *previous = NULL, uint32_t *version = NULL) {
+		return update([&state](HvacState &s) { s = state; }, previous, version);
+	};
+
+	static uint64_t pack(const HvacState &state, uint32_t version) {
+		unsigned flags = state.ac | state.front_defrost << 1 | state.rear_defrost << 2 | state.recirculation << 3;
+		return (uint64_t) state.temp_left |
+			(uint64_t) state.temp_right << 8 |
+			(uint64_t) state.fan_speed << 16 |
+			(uint64_t) flags << 24 |
+			(uint64_t) version << 32;
+	};
+
+	static HvacState unpack(uint64_t word) {
+		HvacState state;
+		state.temp_left = word & 0xff;
+		state.temp_right = (word >> 8) & 0xff;
+		state.fan_speed = (word >> 16) & 0xff;
+		state.ac = (word >> 24) & 1;
+		state.front_defrost = (word >> 25) & 1;
+		state.rear_defrost = (word >> 26) & 1;
+		state.recirculation = (word >> 27) & 1;
+		return state;
+	};
+
+private:
+	std::atomic<uint64_t> m_word;
+	std::atomic<uint64_t> m_received_ns;
+};
+
+static_assert(std::atomic<uint64_t>::is_always_lock_free, "the state word needs to be lock-free");
+
+#endif // _HVAC_STATE_WORD_H
@@ -7,147 +7,597 @@
 #include <string>
 #include <regex>
 #include <iterator>
+#include <algorithm>
+#include <optional>
 #include <mutex>
+#include <vector>
+#include <atomic>
+#include <thread>
+#include <chrono>
+#include <cerrno>
+#include <cstdlib>
+
+#include <google/protobuf/arena.h>
 
 #include "KuksaClient.h"
+#include "Logger.h"
 
 using grpc::Channel;
 using grpc::ClientContext;
 using grpc::ClientReader;
 using grpc::Status;
 
-KuksaClient::KuksaClient(const std::shared_ptr< ::grpc::ChannelInterface>& channel, const KuksaConfig &config) :
-	m_config(config)
+// How long destruction waits for gRPC's threads to finish cancelled calls
+#define SHUTDOWN_WAIT_MS 2000
+
+// Write calls kept for reuse, and the arena space their requests (and
+// the subscribe responses) are built in
+#define SET_CALL_POOL		32
+#define SET_ARENA_SIZE		1024
+#define SUBSCRIBE_ARENA_SIZE	8192
+
+namespace {
+
+google::protobuf::ArenaOptions arena_options(char *block, size_t size)
 {
-	m_stub = VAL::NewStub(channel);
+	google::protobuf::ArenaOptions options;
+	options.initial_block = block;
+	options.initial_block_size = size;
+	return options;
 }
 
-void KuksaClient::get(const std::string &path, GetResponseCallback cb, const bool actuator)
+// Handed to every coalesced write, built once as the message does not
+// fit a short string
+const Status superseded_status(grpc::ABORTED, "Superseded by a newer value");
+
+} // namespace
+
+// CompletionQueue shared by the clients on one event loop
+//
+// Completions arriving once the queue is shut down are freed without
+// being dispatched, the loop is not expected to run again by then.
+
+class KuksaClient::AsyncQueue
 {
-	ClientContext *context = new ClientContext();
-	if (!context) {
-		handleCriticalFailure("Could not create ClientContext");
-		return;
+public:
+	explicit AsyncQueue(EventLoop *loop) :
+		loop_(loop),
+		shutdown_(false) {
+		thread_ = std::thread(&AsyncQueue::pump, this);
 	}
-	std::string token = m_config.authToken();
-	if (!token.empty()) {
-		token.insert(0, std::string("Bearer "));
-		context->AddMetadata(std::string("authorization"), token);
+
+	~AsyncQueue() {
+		shutdown_.store(true);
+		cq_.Shutdown();
+		if (thread_.joinable())
+			thread_.join();
 	}
 
-	GetRequest request;
-	auto entry = request.add_entries();
-	entry->set_path(path);
-	entry->add_fields(Field::FIELD_PATH);	
-	if (actuator)
-		entry->add_fields(Field::FIELD_ACTUATOR_TARGET);
-	else
-		entry->add_fields(Field::FIELD_VALUE);
+	grpc::CompletionQueue *cq() { return &cq_; };
 
-	GetResponse *response = new GetResponse();
-	if (!response) {
-		handleCriticalFailure("Could not create GetResponse");
-		return;
+	static std::shared_ptr<AsyncQueue> get(EventLoop *loop) {
+		static std::mutex mutex;
+		static std::map<EventLoop*, std::weak_ptr<AsyncQueue>> queues;
+
+		const std::lock_guard<std::mutex> lock(mutex);
+		std::shared_ptr<AsyncQueue> queue = queues[loop].lock();
+		if (!queue) {
+			queue = std::make_shared<AsyncQueue>(loop);
+			queues[loop] = queue;
+		}
+		return queue;
 	}
 
-	// NOTE: Using ClientUnaryReactor instead of the shortcut method
-	//       would allow getting detailed errors.
-	m_stub->async()->Get(context, &request, response,
-			     [this, cb, context, response](Status s) {
-				     if (s.ok())
-					     handleGetResponse(response, cb);
-				     delete response;
-				     delete context;
-			     });
-}
+private:
+	void pump();
 
-// Since a set request needs a Datapoint with the appropriate type value,
-// checking the signal metadata to get the type would be a requirement for
-// a generic set call that takes a string as argument.  For now, assume
-// that set with a string is specifically for a signal of string type.
+	EventLoop *loop_;
+	grpc::CompletionQueue cq_;
+	std::thread thread_;
+	std::atomic<bool> shutdown_;
+};
 
-void KuksaClient::set(const std::string &path, const std::string &value, SetResponseCallback cb, const bool actuator)
+// Completion queue tag, proceed() is invoked on the event loop thread
+
+class KuksaClient::AsyncCall
 {
-	Datapoint dp;
-	dp.set_string(value);
-	set(path, dp, cb, actuator);
-}
+public:
+	virtual ~AsyncCall() {};
 
-void KuksaClient::set(const std::string &path, const bool value, SetResponseCallback cb, const bool actuator)
+	virtual void proceed(bool ok) = 0;
+
+	void *tag() { return (void*) this; };
+};
+
+template<class Response>
+class KuksaClient::AsyncUnaryCall : public KuksaClient::AsyncCall
 {
-	Datapoint dp;
-	dp.set_bool_(value);
-	set(path, dp, cb, actuator);
-}
+public:
+	explicit AsyncUnaryCall(DoneFunc done) : done_(done) {}
+
+	void proceed(bool ok) override {
+		if (done_)
+			done_(status_);
+		delete this;
+	}
+
+	Status status_;
+	std::unique_ptr<grpc::ClientAsyncResponseReader<Response>> rpc_;
+
+private:
+	DoneFunc done_;
+};
 
-void KuksaClient::set(const std::string &path, const int8_t value, SetResponseCallback cb, const bool actuator)
+// Callback API unary call, unlike the shortcut methods OnDone also gets
+// the trailing status details
+
+class KuksaClient::UnaryReactor : public grpc::ClientUnaryReactor
 {
-	Datapoint dp;
-	dp.set_int32(value);
-	set(path, dp, cb, actuator);
-}
+public:
+	explicit UnaryReactor(DoneFunc done) : done_(done) {}
+
+	void OnDone(const Status &s) override {
+		if (done_)
+			done_(s);
+
+		// gRPC engine is done with us, safe to self-delete
+		delete this;
+	}
+
+private:
+	DoneFunc done_;
+};
 
-void KuksaClient::set(const std::string &path, const int16_t value, SetResponseCallback cb, const bool actuator)
+// Write call reused from one write to the next, so that in steady state
+// starting one only allocates within gRPC: the request is built in an
+// arena on top of a preallocated block, context and reactor are
+// constructed in place.  Completes via finishSet().
+
+class KuksaClient::SetCall : public KuksaClient::AsyncCall
 {
-	Datapoint dp;
-	dp.set_int32(value);
-	set(path, dp, cb, actuator);
-}
+public:
+	class Reactor : public grpc::ClientUnaryReactor
+	{
+	public:
+		explicit Reactor(SetCall *call) : call_(call) {}
+
+		void OnDone(const Status &s) override {
+			call_->status_ = s;
+			call_->client_->finishSet(call_);
+		}
+
+	private:
+		SetCall *call_;
+	};
+
+	explicit SetCall(KuksaClient *client) :
+		client_(client),
+		endpoint_(0),
+		replays_(0),
+		arena_(arena_options(block_, sizeof(block_))),
+		request_(NULL) {}
+
+	// Drops the previous request
+	SetRequest *newRequest() {
+		request_ = NULL;
+		arena_.Reset();
+		request_ = google::protobuf::Arena::CreateMessage<SetRequest>(&arena_);
+		return request_;
+	}
+
+	void proceed(bool ok) override {
+		client_->finishSet(this);
+	}
+
+	KuksaClient *client_;
+	std::string path_;
+	SetResponseCallback cb_;
+	CallStatusCallback status_cb_;
+	size_t endpoint_;		// sent to
+	unsigned replays_;		// sent again after a failover
 
-void KuksaClient::set(const std::string &path, const int32_t value, SetResponseCallback cb, const bool actuator)
+	alignas(8) char block_[SET_ARENA_SIZE];
+	google::protobuf::Arena arena_;
+	SetRequest *request_;
+	SetResponse response_;
+	std::optional<ClientContext> context_;
+	Status status_;
+
+	std::unique_ptr<grpc::ClientAsyncResponseReader<SetResponse>> rpc_;	// reactor mode
+	std::optional<Reactor> reactor_;					// callback mode
+};
+
+// Suspends the awaiting coroutine for the duration of a unary call
+
+template<class Response>
+class KuksaClient::UnaryAwaiter
 {
-	Datapoint dp;
-	dp.set_int32(value);
-	set(path, dp, cb, actuator);
-}
+public:
+	typedef std::function<void(ClientContext *context, Response *response, DoneFunc done)> StartFunc;
+
+	UnaryAwaiter(const KuksaCallOptions &options, Response *response, StartFunc start) :
+		options_(options),
+		response_(response),
+		start_(start),
+		cancel_id_(0),
+		done_(false) {}
+
+	bool await_ready() { return false; }
+
+	bool await_suspend(std::coroutine_handle<> handle) {
+		handle_ = handle;
+		if (options_.timeout.count() > 0)
+			context_.set_deadline(std::chrono::system_clock::now() + options_.timeout);
+		if (options_.cancel) {
+			cancel_id_ = options_.cancel->attach([this]() { context_.TryCancel(); });
+			if (!cancel_id_) {
+				status_ = Status(grpc::CANCELLED, "Cancelled");
+				return false;
+			}
+		}
+
+		start_(&context_, response_, [this](const Status &s) {
+			status_ = s;
+			if (cancel_id_)
+				options_.cancel->detach(cancel_id_);
+
+			// Whichever of us comes second resumes
+			if (done_.exchange(true))
+				handle_.resume();
+		});
+		return !done_.exchange(true);
+	}
+
+	Status await_resume() { return status_; }
+
+private:
+	KuksaCallOptions options_;
+	Response *response_;
+	StartFunc start_;
+	ClientContext context_;
+	Status status_;
+	std::coroutine_handle<> handle_;
+	uint64_t cancel_id_;
+	std::atomic<bool> done_;
+};
 
-void KuksaClient::set(const std::string &path, const int64_t value, SetResponseCallback cb, const bool actuator)
+// Subscribe stream, common to the callback and CompletionQueue readers
+//
+// The rotation bookkeeping (id_, predecessor_, successor_, superseded_)
+// is protected by the owning client's m_readers_mutex.
+
+class KuksaClient::SubscribeReader
 {
-	Datapoint dp;
-	dp.set_int64(value);
-	set(path, dp, cb, actuator);
-}
+public:
+	SubscribeReader(KuksaClient *client,
+			const SubscribeRequest *request,
+			SubscribeResponseCallback cb,
+			SubscribeDoneCallback done_cb):
+		client_(client),
+		request_(request),
+		cb_(cb),
+		done_cb_(done_cb),
+		id_(0),
+		handle_(0),
+		predecessor_(0),
+		successor_(0),
+		superseded_(false),
+		endpoint_(0),
+		moves_(0),
+		first_read_(true),
+		arena_(arena_options(block_, sizeof(block_))),
+		response_(NULL) {
+		client_->addAuthHeader(&context_);
+	}
+
+	virtual ~SubscribeReader() {
+		delete request_;
+	}
+
+	virtual void start(VAL::Stub *stub) = 0;
+
+	void cancel() {
+		context_.TryCancel();
+	}
+
+	KuksaClient *client_;
+	const SubscribeRequest *request_;
+	SubscribeResponseCallback cb_;
+	SubscribeDoneCallback done_cb_;
+
+	uint64_t id_;
+	uint64_t handle_;		// id of the first reader of a rotation chain
+	uint64_t predecessor_;
+	uint64_t successor_;
+	bool superseded_;
+
+	size_t endpoint_;		// started on
+	unsigned moves_;		// failovers since data last came in
+
+protected:
+	void handleRead() {
+		std::shared_ptr<WatchdogProbe> probe = std::atomic_load(&client_->m_probe);
+		if (probe)
+			probe->begin();
+		if (first_read_) {
+			// Data is flowing, if this is a replacement stream
+			// the one it replaces can go now.
+			first_read_ = false;
+			moves_ = 0;
+			client_->completeRotation(this);
+		}
+		if (client_->m_recorder)
+			client_->m_recorder->record(*response_);
+		client_->handleSubscribeResponse(response_, cb_);
+		if (probe)
+			probe->end();
+	}
 
-void KuksaClient::set(const std::string &path, const uint8_t value, SetResponseCallback cb, const bool actuator)
+	void handleDone() {
+		if (Logger::verbose() > 1)
+			Logger::debug("KuksaClient", "Subscribe reader done");
+		if (client_->finishReader(this, status_))
+			client_->handleSubscribeDone(request_, status_, done_cb_);
+	}
+
+	// Each response is read into a fresh arena, so parsing it reuses
+	// the same memory instead of reallocating every entry
+	SubscribeResponse *nextResponse() {
+		response_ = NULL;
+		arena_.Reset();
+		response_ = google::protobuf::Arena::CreateMessage<SubscribeResponse>(&arena_);
+		return response_;
+	}
+
+	bool first_read_;
+	ClientContext context_;
+	alignas(8) char block_[SUBSCRIBE_ARENA_SIZE];
+	google::protobuf::Arena arena_;
+	SubscribeResponse *response_;
+	Status status_;
+};
+
+class KuksaClient::CallbackSubscribeReader : public KuksaClient::SubscribeReader,
+					     public grpc::ClientReadReactor<SubscribeResponse>
+{
+public:
+	CallbackSubscribeReader(KuksaClient *client,
+				const SubscribeRequest *request,
+				SubscribeResponseCallback cb,
+				SubscribeDoneCallback done_cb):
+		SubscribeReader(client, request, cb, done_cb) {}
+
+	void start(VAL::Stub *stub) override {
+		stub->async()->Subscribe(&context_, request_, this);
+		StartRead(nextResponse());
+		StartCall();
+	}
+
+	void OnReadDone(bool ok) override {
+		std::unique_lock<std::mutex> lock(mutex_);
+		if (ok) {
+			handleRead();
+			StartRead(nextResponse());
+		}
+	}
+
+	void OnDone(const Status& s) override {
+		status_ = s;
+		handleDone();
+
+		// gRPC engine is done with us, safe to self-delete
+		delete this;
+	}
+
+private:
+	std::mutex mutex_;
+};
+
+class KuksaClient::AsyncSubscribeReader : public KuksaClient::SubscribeReader,
+					  public KuksaClient::AsyncCall
+{
+public:
+	AsyncSubscribeReader(KuksaClient *client,
+			     const SubscribeRequest *request,
+			     SubscribeResponseCallback cb,
+			     SubscribeDoneCallback done_cb):
+		SubscribeReader(client, request, cb, done_cb),
+		state_(STARTING) {}
+
+	void start(VAL::Stub *stub) override {
+		rpc_ = stub->PrepareAsyncSubscribe(&context_, *request_, client_->m_cq);
+		state_ = STARTING;
+		rpc_->StartCall(tag());
+	}
+
+	void proceed(bool ok) override {
+		switch (state_) {
+		case STARTING:
+		case READING:
+			if (ok) {
+				if (state_ == READING)
+					handleRead();
+				state_ = READING;
+				rpc_->Read(nextResponse(), tag());
+			} else {
+				state_ = FINISHING;
+				rpc_->Finish(&status_, tag());
+			}
+			break;
+		case FINISHING:
+			handleDone();
+			delete this;
+			break;
+		}
+	}
+
+private:
+	enum { STARTING, READING, FINISHING } state_;
+	std::unique_ptr<grpc::ClientAsyncReader<SubscribeResponse>> rpc_;
+};
+
+KuksaClient::KuksaClient(const std::shared_ptr< ::grpc::ChannelInterface>& channel,
+			 const KuksaConfig &config,
+			 EventLoop *loop) :
+	KuksaClient(std::vector<std::shared_ptr< ::grpc::ChannelInterface>>(1, channel), config, loop)
 {
-	Datapoint dp;
-	dp.set_uint32(value);
-	set(path, dp, cb, actuator);
 }
 
-void KuksaClient::set(const std::string &path, const uint16_t value, SetResponseCallback cb, const bool actuator)
+KuksaClient::KuksaClient(const std::vector<std::shared_ptr< ::grpc::ChannelInterface>> &channels,
+			 const KuksaConfig &config,
+			 EventLoop *loop) :
+	m_config(config),
+	m_channels(channels),
+	m_active(0),
+	m_cq(NULL),
+	m_in_flight(0),
+	m_pending_head(0),
+	m_shutdown(false),
+	m_next_reader_id(0),
+	m_subscriptions_cancelled(false)
 {
-	Datapoint dp;
-	dp.set_uint32(value);
-	set(path, dp, cb, actuator);
+	if (m_channels.empty())
+		handleCriticalFailure("No databroker channel");
+
+	std::vector<std::string> names = m_config.endpoints();
+	for (size_t i = 0; i < m_channels.size(); i++) {
+		m_endpoints.push_back(i < names.size() ? names[i] : std::to_string(i));
+		m_stubs.push_back(VAL::NewStub(m_channels[i]));
+	}
+
+	// Start on the first one up, and have the others connect
+	for (size_t i = 0; i < m_channels.size(); i++) {
+		if (m_channels[i]->GetState(true) == GRPC_CHANNEL_READY) {
+			m_active = i;
+			break;
+		}
+	}
+	if (m_channels.size() > 1)
+		Logger::info("KuksaClient", "Using databroker {}, {} standby(s)", endpoint(), m_channels.size() - 1);
+
+	setAuthToken(m_config.authToken());
+
+	// Sized for the usual number of outstanding calls up front
+	unsigned calls = m_config.maxInFlight() ? m_config.maxInFlight() : SET_CALL_POOL;
+	m_calls.reserve(calls);
+	m_free_set_calls.reserve(SET_CALL_POOL);
+
+	if (loop) {
+		m_queue = AsyncQueue::get(loop);
+		m_cq = m_queue->cq();
+	}
 }
 
-void KuksaClient::set(const std::string &path, const uint32_t value, SetResponseCallback cb, const bool actuator)
+KuksaClient::~KuksaClient()
 {
-	Datapoint dp;
-	dp.set_uint32(value);
-	set(path, dp, cb, actuator);
+	std::vector<std::pair<std::string, PendingSet>> dropped;
+	{
+		const std::lock_guard<std::recursive_mutex> lock(m_calls_mutex);
+		m_shutdown = true;
+
+		// Copied, a cancelled call may complete (and go away) inline
+		std::vector<ClientContext*> calls(m_calls.begin(), m_calls.end());
+		for (auto it = calls.begin(); it != calls.end(); ++it) {
+			if (std::find(m_calls.begin(), m_calls.end(), *it) != m_calls.end())
+				(*it)->TryCancel();
+		}
+
+		for (size_t i = m_pending_head; i < m_pending_order.size(); i++)
+			dropped.push_back(std::make_pair(m_pending_order[i]->first, m_pending_order[i]->second));
+		m_pending_order.clear();
+		m_pending_head = 0;
+		m_pending_sets.clear();
+	}
+	for (auto it = dropped.begin(); it != dropped.end(); ++it) {
+		if (it->second.status_cb)
+			it->second.status_cb(it->first, Status(grpc::CANCELLED, "Client shutting down"));
+	}
+
+	cancelSubscriptions();
+
+	// In reactor mode the cancelled calls complete via the queue, which
+	// drops them once its last client is gone (the loop is not expected
+	// to run again).  gRPC's threads on the other hand deliver right
+	// away, so wait for them to be done with us.
+	if (!m_cq) {
+		auto deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(SHUTDOWN_WAIT_MS);
+		while (!idle() && std::chrono::steady_clock::now() < deadline)
+			std::this_thread::sleep_for(std::chrono::milliseconds(5));
+		if (!idle())
+			Logger::warning("KuksaClient", "Calls still outstanding after {} ms", SHUTDOWN_WAIT_MS);
+	}
+
+	const std::lock_guard<std::recursive_mutex> lock(m_calls_mutex);
+	for (auto it = m_free_set_calls.begin(); it != m_free_set_calls.end(); ++it)
+		delete *it;
+	m_free_set_calls.clear();
 }
 
-void KuksaClient::set(const std::string &path, const uint64_t value, SetResponseCallback cb, const bool actuator)
+void KuksaClient::setAuthToken(const std::string &token)
 {
-	Datapoint dp;
-	dp.set_uint64(value);
-	set(path, dp, cb, actuator);
+	std::string header;
+	if (!token.empty()) {
+		header = "Bearer ";
+		header += token;
+	}
+	auto old = std::atomic_exchange(&m_auth_header, std::shared_ptr<const std::string>(new std::string(header)));
+
+	// Active streams were authorized with the old token
+	if (old && *old != header)
+		rotateSubscriptions();
 }
 
-void KuksaClient::set(const std::string &path, const float value, SetResponseCallback cb, const bool actuator)
+void KuksaClient::get(const std::string &path, GetResponseCallback cb, const bool actuator,
+		      CallStatusCallback status_cb)
 {
-	Datapoint dp;
-	dp.set_float_(value);
-	set(path, dp, cb, actuator);
+	GetRequest request;
+	auto entry = request.add_entries();
+	entry->set_path(path);
+	entry->add_fields(Field::FIELD_PATH);	
+	if (actuator)
+		entry->add_fields(Field::FIELD_ACTUATOR_TARGET);
+	else
+		entry->add_fields(Field::FIELD_VALUE);
+
+	ClientContext *context = new ClientContext();
+	if (!context) {
+		handleCriticalFailure("Could not create ClientContext");
+		return;
+	}
+
+	GetResponse *response = new GetResponse();
+	if (!response) {
+		handleCriticalFailure("Could not create GetResponse");
+		delete context;
+		return;
+	}
+
+	callGet(context, request, response, [this, path, cb, status_cb, context, response](const Status &s) {
+		if (s.ok())
+			handleGetResponse(response, cb);
+		if (status_cb)
+			status_cb(path, s);
+		delete response;
+		delete context;
+	});
 }
 
-void KuksaClient::set(const std::string &path, const double value, SetResponseCallback cb, const bool actuator)
+void KuksaClient::set(const std::string &path, const std::string &value, SetResponseCallback cb, const bool actuator,
+		      CallStatusCallback status_cb)
 {
+	// Only ever a cache lookup, a write never waits for the broker to
+	// describe the signal
 	Datapoint dp;
-	dp.set_double_(value);
-	set(path, dp, cb, actuator);
+	KuksaSignalMetadata md;
+	if (!metadata(path, md)) {
+		dp.set_string(value);
+	} else if (!toDatapoint(md.data_type, value, dp)) {
+		if (status_cb)
+			status_cb(path, Status(grpc::INVALID_ARGUMENT,
+					       "Value \"" + value + "\" does not fit " + DataType_Name(md.data_type)));
+		return;
+	}
+	set(path, dp, cb, actuator, status_cb);
 }
 
 void KuksaClient::subscribe(const std::string &path,
@@ -199,114 +649,823 @@ void KuksaClient::subscribe(const SubscribeRequest *request,
 			    SubscribeResponseCallback cb,
 			    SubscribeDoneCallback done_cb)
 {
-	if (!(request && cb))
+	startSubscribe(request, cb, done_cb);
+}
+
+void KuksaClient::setTokenProvider(std::shared_ptr<AuthTokenProvider> provider)
+{
+	m_token_provider = provider;
+	if (!m_token_provider)
 		return;
 
-	class Reader : public grpc::ClientReadReactor<SubscribeResponse> {
-	public:
-		Reader(VAL::Stub *stub,
-		       KuksaClient *client,
-		       KuksaConfig &config,
-		       const SubscribeRequest *request,
-		       SubscribeResponseCallback cb,
-		       SubscribeDoneCallback done_cb):
-			client_(client),
-			config_(config),
-			request_(request),
-			cb_(cb),
-			done_cb_(done_cb) {
-			std::string token = config_.authToken();
-			if (!token.empty()) {
-				token.insert(0, std::string("Bearer "));
-				context_.AddMetadata(std::string("authorization"), token);
+	setAuthToken(m_token_provider->token());
+	m_token_provider->setCallback([this](const std::string &token) {
+		setAuthToken(token);
+	});
+}
+
+void KuksaClient::loadMetadata(const std::vector<std::string> &paths, MetadataDoneCallback done)
+{
+	GetRequest request;
+	for (auto it = paths.cbegin(); it != paths.cend(); ++it) {
+		auto entry = request.add_entries();
+		entry->set_path(*it);
+		entry->set_view(View::VIEW_METADATA);
+		entry->add_fields(Field::FIELD_PATH);
+		entry->add_fields(Field::FIELD_METADATA);
+	}
+
+	ClientContext *context = new ClientContext();
+	if (!context) {
+		handleCriticalFailure("Could not create ClientContext");
+		return;
+	}
+
+	GetResponse *response = new GetResponse();
+	if (!response) {
+		handleCriticalFailure("Could not create GetResponse");
+		delete context;
+		return;
+	}
+
+	callGet(context, request, response, [this, done, context, response](const Status &s) {
+		if (s.ok()) {
+			auto cache = std::make_shared<MetadataMap>();
+			for (auto it = response->entries().cbegin(); it != response->entries().cend(); ++it) {
+				if (it->path().empty() || !it->has_metadata())
+					continue;
+				KuksaSignalMetadata &md = (*cache)[it->path()];
+				md.data_type = it->metadata().data_type();
+				md.entry_type = it->metadata().entry_type();
 			}
-			stub->async()->Subscribe(&context_, request, this);
-			StartRead(&response_);
-			StartCall();
+			for (auto it = response->errors().cbegin(); it != response->errors().cend(); ++it)
+				Logger::warning("KuksaClient", "No metadata for {}: {}", it->path(), it->error().reason());
+			if (m_config.verbose())
+				Logger::info("KuksaClient", "Cached metadata of {} signal(s)", cache->size());
+			std::atomic_store(&m_metadata, std::shared_ptr<const MetadataMap>(cache));
 		}
-		void OnReadDone(bool ok) override {
-			std::unique_lock<std::mutex> lock(mutex_);
-			if (ok) {
-				if (client_)
-					client_->handleSubscribeResponse(&response_, cb_);
-				StartRead(&response_);
-			}
+		if (done)
+			done(s);
+		delete response;
+		delete context;
+	});
+}
+
+bool KuksaClient::metadata(const std::string &path, KuksaSignalMetadata &md) const
+{
+	auto cache = std::atomic_load(&m_metadata);
+	if (!cache)
+		return false;
+	auto it = cache->find(path);
+	if (it == cache->end())
+		return false;
+	md = it->second;
+	return true;
+}
+
+std::vector<std::string> KuksaClient::discover(const std::string &branch, EntryType type) const
+{
+	std::vector<std::string> paths;
+	auto cache = std::atomic_load(&m_metadata);
+	if (!cache)
+		return paths;
+
+	std::string prefix = branch + ".";
+	for (auto it = cache->lower_bound(prefix); it != cache->end(); ++it) {
+		if (it->first.compare(0, prefix.size(), prefix))
+			break;
+		if (it->second.entry_type == type)
+			paths.push_back(it->first);
+	}
+	return paths;
+}
+
+void KuksaClient::invalidateMetadata()
+{
+	std::atomic_store(&m_metadata, std::shared_ptr<const MetadataMap>());
+}
+
+bool KuksaClient::toDatapoint(DataType type, const std::string &value, Datapoint &dp)
+{
+	const char *s = value.c_str();
+	char *end = NULL;
+	errno = 0;
+
+	switch (type) {
+	case DataType::DATA_TYPE_STRING:
+		dp.set_string(value);
+		return true;
+	case DataType::DATA_TYPE_BOOLEAN:
+		if (value == "true" || value == "1")
+			dp.set_bool_(true);
+		else if (value == "false" || value == "0")
+			dp.set_bool_(false);
+		else
+			return false;
+		return true;
+	case DataType::DATA_TYPE_INT8:
+	case DataType::DATA_TYPE_INT16:
+	case DataType::DATA_TYPE_INT32:
+	case DataType::DATA_TYPE_INT64: {
+		long long v = strtoll(s, &end, 0);
+		if (errno || end == s || *end)
+			return false;
+		if (type == DataType::DATA_TYPE_INT64) {
+			dp.set_int64(v);
+			return true;
 		}
-		void OnDone(const Status& s) override {
-			status_ = s;
-			if (client_) {
-				if (config_.verbose() > 1)
-					std::cerr << "KuksaClient::subscribe::Reader done" << std::endl;
-				client_->handleSubscribeDone(request_, status_, done_cb_);
-			}
+		int bits = type == DataType::DATA_TYPE_INT8 ? 8 : (type == DataType::DATA_TYPE_INT16 ? 16 : 32);
+		if (v < -(1LL << (bits - 1)) || v >= (1LL << (bits - 1)))
+			return false;
+		dp.set_int32((int32_t) v);
+		return true;
+	}
+	case DataType::DATA_TYPE_UINT8:
+	case DataType::DATA_TYPE_UINT16:
+	case DataType::DATA_TYPE_UINT32:
+	case DataType::DATA_TYPE_UINT64: {
+		// strtoull takes "-1" as the largest value
+		if (value.find('-') != std::string::npos)
+			return false;
+		unsigned long long v = strtoull(s, &end, 0);
+		if (errno || end == s || *end)
+			return false;
+		if (type == DataType::DATA_TYPE_UINT64) {
+			dp.set_uint64(v);
+			return true;
+		}
+		int bits = type == DataType::DATA_TYPE_UINT8 ? 8 : (type == DataType::DATA_TYPE_UINT16 ? 16 : 32);
+		if (v >= (1ULL << bits))
+			return false;
+		dp.set_uint32((uint32_t) v);
+		return true;
+	}
+	case DataType::DATA_TYPE_FLOAT: {
+		float v = strtof(s, &end);
+		if (errno || end == s || *end)
+			return false;
+		dp.set_float_(v);
+		return true;
+	}
+	case DataType::DATA_TYPE_DOUBLE: {
+		double v = strtod(s, &end);
+		if (errno || end == s || *end)
+			return false;
+		dp.set_double_(v);
+		return true;
+	}
+	default:
+		// Timestamps and arrays are not handled
+		return false;
+	}
+}
 
-			// gRPC engine is done with us, safe to self-delete
-			delete request_;
-			delete this;
+void KuksaClient::cancelSubscriptions()
+{
+	const std::lock_guard<std::recursive_mutex> lock(m_readers_mutex);
+	m_subscriptions_cancelled = true;
+	std::vector<SubscribeReader*> readers;
+	for (auto it = m_readers.cbegin(); it != m_readers.cend(); ++it)
+		readers.push_back(it->second);
+	for (auto it = readers.begin(); it != readers.end(); ++it)
+		(*it)->cancel();
+}
+
+void KuksaClient::rotateSubscriptions()
+{
+	// Start a replacement for every active stream first; the old stream
+	// is only cancelled once its replacement has delivered data, so
+	// there is no window in which updates are missed.
+	std::vector<SubscribeReader*> started;
+	{
+		const std::lock_guard<std::recursive_mutex> lock(m_readers_mutex);
+		if (m_subscriptions_cancelled)
+			return;
+		std::vector<SubscribeReader*> active;
+		for (auto it = m_readers.cbegin(); it != m_readers.cend(); ++it) {
+			SubscribeReader *reader = it->second;
+			if (!(reader->superseded_ || reader->successor_ || reader->predecessor_))
+				active.push_back(reader);
 		}
 
-	private:
-		KuksaClient *client_;
-		KuksaConfig config_;
-		const SubscribeRequest *request_;
-		SubscribeResponseCallback cb_;
-		SubscribeDoneCallback done_cb_;
-
-		ClientContext context_;
-		SubscribeResponse response_;
-		std::mutex mutex_;
-		Status status_;
-	};
-	Reader *reader = new Reader(m_stub.get(), this, m_config, request, cb, done_cb);
-	if (!reader)
-		handleCriticalFailure("Could not create Subscribe reader");
+		for (auto it = active.begin(); it != active.end(); ++it) {
+			SubscribeReader *reader = createReader(new SubscribeRequest(*(*it)->request_),
+							       (*it)->cb_,
+							       (*it)->done_cb_);
+			registerReader(reader, (*it)->id_);
+			started.push_back(reader);
+		}
+	}
+
+	if (!started.empty())
+		Logger::info("KuksaClient", "Rotating {} subscription(s) to the new authorization token", started.size());
+
+	for (auto it = started.begin(); it != started.end(); ++it)
+		startReader(*it);
+}
+
+Task<KuksaGetResult> KuksaClient::get(std::vector<std::string> paths,
+				      bool actuator,
+				      KuksaCallOptions options)
+{
+	GetRequest request;
+	for (auto it = paths.cbegin(); it != paths.cend(); ++it) {
+		auto entry = request.add_entries();
+		entry->set_path(*it);
+		entry->add_fields(Field::FIELD_PATH);
+		if (actuator)
+			entry->add_fields(Field::FIELD_ACTUATOR_TARGET);
+		else
+			entry->add_fields(Field::FIELD_VALUE);
+	}
+
+	GetResponse response;
+	KuksaGetResult result;
+	result.status = co_await UnaryAwaiter<GetResponse>(options, &response,
+		[this, &request](ClientContext *context, GetResponse *response, DoneFunc done) {
+			callGet(context, request, response, done);
+		});
+	if (result.status.ok()) {
+		handleGetResponse(&response, [&result](const std::string &path, const Datapoint &dp) {
+			result.values[path] = dp;
+		});
+	}
+	co_return result;
+}
+
+Task<KuksaSetResult> KuksaClient::set(std::map<std::string, Datapoint> updates,
+				      bool actuator,
+				      KuksaCallOptions options)
+{
+	SetRequest request;
+	for (auto it = updates.cbegin(); it != updates.cend(); ++it)
+		addUpdate(request, it->first, it->second, actuator);
+
+	SetResponse response;
+	KuksaSetResult result;
+	result.status = co_await UnaryAwaiter<SetResponse>(options, &response,
+		[this, &request](ClientContext *context, SetResponse *response, DoneFunc done) {
+			callSet(context, request, response, done);
+		});
+	if (result.status.ok()) {
+		handleSetResponse(&response, [&result](const std::string &path, const Error &error) {
+			result.errors[path] = error;
+		});
+	}
+	co_return result;
+}
+
+KuksaSubscribeStream KuksaClient::subscribeStream(const std::map<std::string, bool> &signals,
+						  const CancelToken *cancel)
+{
+	KuksaSubscribeStream stream;
+	std::shared_ptr<KuksaSubscribeStream::State> state = stream.m_state;
+	state->client = this;
+
+	SubscribeRequest *request = new SubscribeRequest();
+	for (auto it = signals.cbegin(); it != signals.cend(); ++it) {
+		auto entry = request->add_entries();
+		entry->set_path(it->first);
+		entry->add_fields(Field::FIELD_PATH);
+		if (it->second)
+			entry->add_fields(Field::FIELD_ACTUATOR_TARGET);
+		else
+			entry->add_fields(Field::FIELD_VALUE);
+	}
+
+	// Attached before the stream starts, so that finish() is sure to
+	// detach it; until there is a handle a cancel is only noted
+	if (cancel) {
+		state->cancel = cancel;
+		uint64_t id = cancel->attach([state]() { state->cancelByToken(); });
+		const std::lock_guard<std::mutex> lock(state->mutex);
+		state->cancel_id = id;
+		if (!id)
+			state->cancelled = true;
+	}
+
+	// The callbacks keep the state alive until the stream is done
+	uint64_t handle = startSubscribe(request,
+					 [state](const std::string &path, const Datapoint &dp) {
+						 state->push(path, dp);
+					 },
+					 [state](const SubscribeRequest *request, const Status &status) {
+						 state->finish(status);
+					 });
+	bool cancelled;
+	{
+		const std::lock_guard<std::mutex> lock(state->mutex);
+		state->handle = handle;
+		cancelled = state->cancelled;
+	}
+	if (cancelled)
+		cancelSubscription(handle);
+
+	return stream;
+}
+
+void KuksaClient::buildSet(const std::string &path, const Datapoint &dp, bool actuator)
+{
+	releaseSetCall(newSetCall(path, dp, actuator));
 }
 
 // Private
 
-void KuksaClient::set(const std::string &path, const Datapoint &dp, SetResponseCallback cb, const bool actuator)
+uint64_t KuksaClient::startSubscribe(const SubscribeRequest *request,
+				     SubscribeResponseCallback cb,
+				     SubscribeDoneCallback done_cb)
 {
-	ClientContext *context = new ClientContext();
-	if (!context) {
-		handleCriticalFailure("Could not create ClientContext");
+	if (!(request && cb))
+		return 0;
+
+	SubscribeReader *reader = createReader(request, cb, done_cb);
+	if (!reader) {
+		handleCriticalFailure("Could not create Subscribe reader");
+		return 0;
+	}
+	uint64_t handle;
+	{
+		const std::lock_guard<std::recursive_mutex> lock(m_readers_mutex);
+		registerReader(reader, 0);
+		handle = reader->handle_;
+	}
+	startReader(reader);
+	return handle;
+}
+
+void KuksaClient::cancelSubscription(uint64_t handle)
+{
+	// Includes a replacement started by a rotation in progress
+	const std::lock_guard<std::recursive_mutex> lock(m_readers_mutex);
+	std::vector<SubscribeReader*> readers;
+	for (auto it = m_readers.cbegin(); it != m_readers.cend(); ++it) {
+		if (it->second->handle_ == handle)
+			readers.push_back(it->second);
+	}
+	for (auto it = readers.begin(); it != readers.end(); ++it)
+		(*it)->cancel();
+}
+
+void KuksaClient::AsyncQueue::pump()
+{
+	void *tag;
+	bool ok;
+	while (cq_.Next(&tag, &ok)) {
+		AsyncCall *call = (AsyncCall*) tag;
+		if (shutdown_.load()) {
+			delete call;
+			continue;
+		}
+		loop_->post([call, ok]() { call->proceed(ok); });
+	}
+}
+
+KuksaClient::SubscribeReader *KuksaClient::createReader(const SubscribeRequest *request,
+							 SubscribeResponseCallback cb,
+							 SubscribeDoneCallback done_cb)
+{
+	if (m_cq)
+		return new AsyncSubscribeReader(this, request, cb, done_cb);
+
+	return new CallbackSubscribeReader(this, request, cb, done_cb);
+}
+
+void KuksaClient::registerReader(SubscribeReader *reader, uint64_t predecessor)
+{
+	reader->id_ = ++m_next_reader_id;
+	reader->handle_ = reader->id_;
+	m_readers[reader->id_] = reader;
+
+	auto it = m_readers.find(predecessor);
+	if (predecessor && it != m_readers.end()) {
+		reader->predecessor_ = predecessor;
+		reader->handle_ = it->second->handle_;
+		it->second->successor_ = reader->id_;
+	}
+}
+
+void KuksaClient::startReader(SubscribeReader *reader)
+{
+	reader->endpoint_ = selectEndpoint();
+	reader->start(m_stubs[reader->endpoint_].get());
+}
+
+void KuksaClient::completeRotation(SubscribeReader *reader)
+{
+	const std::lock_guard<std::recursive_mutex> lock(m_readers_mutex);
+	if (!reader->predecessor_)
+		return;
+
+	auto it = m_readers.find(reader->predecessor_);
+	reader->predecessor_ = 0;
+	if (it == m_readers.end())
 		return;
+
+	// Held across the cancel so the old reader cannot be freed under
+	// us; its OnDone may run inline, hence the recursive mutex.
+	it->second->superseded_ = true;
+	it->second->successor_ = 0;
+	it->second->cancel();
+}
+
+bool KuksaClient::finishReader(SubscribeReader *reader, const Status &status)
+{
+	SubscribeReader *moved = NULL;
+	{
+		const std::lock_guard<std::recursive_mutex> lock(m_readers_mutex);
+		if (!endReader(reader, status))
+			return false;
+
+		// The broker went away, carry on with a standby; bounded in
+		// case the standbys fail right away as well
+		if (status.error_code() == grpc::UNAVAILABLE &&
+		    !m_subscriptions_cancelled &&
+		    reader->moves_ < m_stubs.size() - 1 &&
+		    failover(reader->endpoint_)) {
+			moved = createReader(new SubscribeRequest(*reader->request_), reader->cb_, reader->done_cb_);
+			registerReader(moved, 0);
+			moved->handle_ = reader->handle_;
+			moved->moves_ = reader->moves_ + 1;
+		}
 	}
-	std::string token = m_config.authToken();
-	if (!token.empty()) {
-		token.insert(0, std::string("Bearer "));
-		context->AddMetadata(std::string("authorization"), token);
+	if (!moved) {
+		// Lost the broker, which may have a different tree once back
+		if (!status.ok() && status.error_code() != grpc::CANCELLED)
+			invalidateMetadata();
+		return true;
 	}
 
-	SetRequest request;
-	auto update = request.add_updates();
-	auto entry = update->mutable_entry();
-	entry->set_path(path);
-	if (actuator) {
-		auto target = entry->mutable_actuator_target();
-		*target = dp;
-		update->add_fields(Field::FIELD_ACTUATOR_TARGET);
+	Logger::warning("KuksaClient", "Subscription lost ({}), moving it to {}", status.error_message(), endpoint());
+	startReader(moved);
+	return false;
+}
+
+bool KuksaClient::endReader(SubscribeReader *reader, const Status &status)
+{
+	m_readers.erase(reader->id_);
+
+	if (reader->superseded_)
+		return false;
+
+	if (reader->successor_) {
+		auto it = m_readers.find(reader->successor_);
+		if (it != m_readers.end()) {
+			Logger::warning("KuksaClient", "Subscription ended during rotation ({}), continuing with replacement",
+					status.error_message());
+			it->second->predecessor_ = 0;
+			return false;
+		}
+	}
+
+	if (reader->predecessor_) {
+		auto it = m_readers.find(reader->predecessor_);
+		if (it != m_readers.end()) {
+			Logger::warning("KuksaClient", "Subscription rotation failed ({}), keeping existing stream",
+					status.error_message());
+			it->second->successor_ = 0;
+			return false;
+		}
+	}
+
+	return true;
+}
+
+bool KuksaClient::failover(size_t failed)
+{
+	const std::lock_guard<std::mutex> lock(m_failover_mutex);
+	if (m_active.load() != failed)
+		return true;
+
+	for (size_t i = 0; i < m_channels.size(); i++) {
+		if (i == failed || m_channels[i]->GetState(true) != GRPC_CHANNEL_READY)
+			continue;
+		Logger::warning("KuksaClient", "Databroker {} unavailable, failing over to {}",
+				m_endpoints[failed], m_endpoints[i]);
+		m_active.store(i);
+		return true;
+	}
+
+	// Have it reconnect, it may well be the first one back
+	m_channels[failed]->GetState(true);
+	return false;
+}
+
+size_t KuksaClient::selectEndpoint()
+{
+	size_t active = m_active.load();
+	if (m_channels.size() > 1 && m_channels[active]->GetState(true) != GRPC_CHANNEL_READY)
+		failover(active);
+	return m_active.load();
+}
+
+void KuksaClient::checkEndpoints()
+{
+	for (auto it = m_channels.begin(); it != m_channels.end(); ++it)
+		(*it)->GetState(true);
+}
+
+void KuksaClient::addAuthHeader(ClientContext *context)
+{
+	auto header = authHeader();
+	if (header && !header->empty())
+		context->AddMetadata(std::string("authorization"), *header);
+}
+
+void KuksaClient::set(const std::string &path, const Datapoint &dp, SetResponseCallback cb, const bool actuator,
+		      CallStatusCallback status_cb)
+{
+	PendingSet pending;
+	pending.dp = dp;
+	pending.actuator = actuator;
+	pending.cb = std::move(cb);
+	pending.status_cb = std::move(status_cb);
+
+	enum { START, WAIT, REFUSE } action = START;
+	Status refused;
+	CallStatusCallback superseded;
+	{
+		const std::lock_guard<std::recursive_mutex> lock(m_calls_mutex);
+		unsigned limit = m_config.maxInFlight();
+		if (!m_shutdown && limit && m_in_flight >= limit) {
+			// Only the newest value matters once the broker is
+			// behind, so there is at most one waiting per signal
+			auto it = m_pending_sets.find(path);
+			if (it == m_pending_sets.end())
+				it = m_pending_sets.emplace(path, PendingSet()).first;
+			bool waiting = it->second.waiting;
+			if (waiting)
+				superseded = std::move(it->second.status_cb);
+			else
+				m_pending_order.push_back(it);
+			it->second = std::move(pending);
+			it->second.waiting = true;
+			if (m_config.verbose() > 1)
+				Logger::debug("KuksaClient", "Set: {} calls in flight, {} waiting",
+					      m_in_flight, m_pending_order.size() - m_pending_head);
+			action = WAIT;
+		} else if (!reserveCall(refused)) {
+			action = REFUSE;
+		}
+	}
+
+	if (superseded)
+		superseded(path, superseded_status);
+
+	if (action == START)
+		startSet(path, pending);
+	else if (action == REFUSE && pending.status_cb)
+		pending.status_cb(path, refused);
+}
+
+void KuksaClient::startSet(const std::string &path, const PendingSet &pending)
+{
+	SetCall *call = newSetCall(path, pending.dp, pending.actuator);
+	call->cb_ = pending.cb;
+	call->status_cb_ = pending.status_cb;
+	sendSet(call);
+}
+
+KuksaClient::SetCall *KuksaClient::newSetCall(const std::string &path, const Datapoint &dp, bool actuator)
+{
+	SetCall *call = acquireSetCall();
+	call->path_ = path;
+	call->replays_ = 0;
+	addUpdate(*call->newRequest(), path, dp, actuator);
+	return call;
+}
+
+void KuksaClient::sendSet(SetCall *call)
+{
+	call->response_.Clear();
+
+	ClientContext *context = &call->context_.emplace();
+	prepareCall(context);
+
+	call->endpoint_ = m_active.load();
+	VAL::Stub *stub = m_stubs[call->endpoint_].get();
+	if (m_cq) {
+		call->rpc_ = stub->PrepareAsyncSet(context, *call->request_, m_cq);
+		call->rpc_->StartCall();
+		call->rpc_->Finish(&call->response_, &call->status_, call->tag());
+		return;
+	}
+
+	SetCall::Reactor *reactor = &call->reactor_.emplace(call);
+	stub->async()->Set(context, call->request_, &call->response_, reactor);
+	reactor->StartCall();
+}
+
+KuksaClient::SetCall *KuksaClient::acquireSetCall()
+{
+	{
+		const std::lock_guard<std::recursive_mutex> lock(m_calls_mutex);
+		if (!m_free_set_calls.empty()) {
+			SetCall *call = m_free_set_calls.back();
+			m_free_set_calls.pop_back();
+			return call;
+		}
+	}
+
+	SetCall *call = new SetCall(this);
+	if (!call)
+		handleCriticalFailure("Could not create SetCall");
+	return call;
+}
+
+void KuksaClient::releaseSetCall(SetCall *call)
+{
+	call->context_.reset();
+	call->rpc_.reset();
+	call->cb_ = nullptr;
+	call->status_cb_ = nullptr;
+	bool keep;
+	{
+		const std::lock_guard<std::recursive_mutex> lock(m_calls_mutex);
+		keep = m_free_set_calls.size() < SET_CALL_POOL;
+		if (keep)
+			m_free_set_calls.push_back(call);
+	}
+	if (!keep)
+		delete call;
+}
+
+void KuksaClient::finishSet(SetCall *call)
+{
+	untrackCall(&*call->context_);
+
+	// Lost the broker with the write in flight, send it to a standby
+	// within the same in-flight slot
+	bool shutdown;
+	{
+		const std::lock_guard<std::recursive_mutex> lock(m_calls_mutex);
+		shutdown = m_shutdown;
+	}
+	SetCall *replay = NULL;
+	if (call->status_.error_code() == grpc::UNAVAILABLE &&
+	    !shutdown &&
+	    call->replays_ < m_stubs.size() - 1 &&
+	    failover(call->endpoint_)) {
+		replay = acquireSetCall();
+		replay->path_ = call->path_;
+		replay->cb_ = call->cb_;
+		replay->status_cb_ = call->status_cb_;
+		replay->replays_ = call->replays_ + 1;
+		*replay->newRequest() = *call->request_;
 	} else {
-		auto value = entry->mutable_value();
-		*value = dp;
-		update->add_fields(Field::FIELD_VALUE);		
+		if (call->status_.ok())
+			handleSetResponse(&call->response_, call->cb_);
+		if (call->status_cb_)
+			call->status_cb_(call->path_, call->status_);
 	}
 
-	SetResponse *response = new SetResponse();
-	if (!response) {
-		handleCriticalFailure("Could not create SetResponse");
-		delete context;
+	// The reactor (if any) is still in OnDone, but no longer used by
+	// gRPC, so the call can be reused right away
+	releaseSetCall(call);
+
+	if (replay)
+		sendSet(replay);
+	else
+		releaseCall();
+}
+
+bool KuksaClient::reserveCall(Status &refused)
+{
+	const std::lock_guard<std::recursive_mutex> lock(m_calls_mutex);
+	if (m_shutdown) {
+		refused = Status(grpc::CANCELLED, "Client shutting down");
+		return false;
+	}
+
+	unsigned limit = m_config.maxInFlight();
+	if (limit && m_in_flight >= limit) {
+		refused = Status(grpc::RESOURCE_EXHAUSTED, "Too many calls in flight");
+		return false;
+	}
+
+	m_in_flight++;
+	return true;
+}
+
+void KuksaClient::releaseCall()
+{
+	const std::string *path;
+	PendingSet pending;
+	{
+		const std::lock_guard<std::recursive_mutex> lock(m_calls_mutex);
+		if (m_shutdown || m_pending_head == m_pending_order.size()) {
+			m_in_flight--;
+			return;
+		}
+
+		// The slot passes straight on to the oldest waiting write;
+		// entries stay, so the path does as well
+		auto it = m_pending_order[m_pending_head++];
+		if (m_pending_head == m_pending_order.size()) {
+			m_pending_order.clear();
+			m_pending_head = 0;
+		} else if (m_pending_head >= m_pending_sets.size()) {
+			// At most one per signal is waiting, this keeps the
+			// queue within twice that
+			m_pending_order.erase(m_pending_order.begin(), m_pending_order.begin() + m_pending_head);
+			m_pending_head = 0;
+		}
+		path = &it->first;
+		pending = std::move(it->second);
+		it->second.waiting = false;
+	}
+	startSet(*path, pending);
+}
+
+void KuksaClient::prepareCall(ClientContext *context)
+{
+	addAuthHeader(context);
+
+	// Unless the caller has set its own
+	unsigned timeout = m_config.rpcTimeout();
+	if (timeout && context->deadline() == std::chrono::system_clock::time_point::max())
+		context->set_deadline(std::chrono::system_clock::now() + std::chrono::milliseconds(timeout));
+
+	const std::lock_guard<std::recursive_mutex> lock(m_calls_mutex);
+	m_calls.push_back(context);
+}
+
+void KuksaClient::untrackCall(ClientContext *context)
+{
+	const std::lock_guard<std::recursive_mutex> lock(m_calls_mutex);
+	auto it = std::find(m_calls.begin(), m_calls.end(), context);
+	if (it != m_calls.end()) {
+		*it = m_calls.back();
+		m_calls.pop_back();
+	}
+}
+
+KuksaClient::DoneFunc KuksaClient::trackCall(ClientContext *context, DoneFunc done)
+{
+	prepareCall(context);
+
+	return [this, context, done](const Status &s) {
+		untrackCall(context);
+		if (done)
+			done(s);
+		releaseCall();
+	};
+}
+
+bool KuksaClient::idle()
+{
+	{
+		const std::lock_guard<std::recursive_mutex> lock(m_calls_mutex);
+		if (m_in_flight)
+			return false;
+	}
+	const std::lock_guard<std::recursive_mutex> lock(m_readers_mutex);
+	return m_readers.empty();
+}
+
+void KuksaClient::callGet(ClientContext *context, const GetRequest &request, GetResponse *response, DoneFunc done,
+			  bool reserved)
+{
+	Status refused;
+	if (!(reserved || reserveCall(refused))) {
+		done(refused);
+		return;
+	}
+	done = trackCall(context, done);
+
+	if (m_cq) {
+		auto call = new AsyncUnaryCall<GetResponse>(done);
+		call->rpc_ = stub()->PrepareAsyncGet(context, request, m_cq);
+		call->rpc_->StartCall();
+		call->rpc_->Finish(response, &call->status_, call->tag());
+		return;
+	}
+
+	auto reactor = new UnaryReactor(done);
+	stub()->async()->Get(context, &request, response, reactor);
+	reactor->StartCall();
+}
+
+void KuksaClient::callSet(ClientContext *context, const SetRequest &request, SetResponse *response, DoneFunc done,
+			  bool reserved)
+{
+	Status refused;
+	if (!(reserved || reserveCall(refused))) {
+		done(refused);
+		return;
+	}
+	done = trackCall(context, done);
+
+	if (m_cq) {
+		auto call = new AsyncUnaryCall<SetResponse>(done);
+		call->rpc_ = stub()->PrepareAsyncSet(context, request, m_cq);
+		call->rpc_->StartCall();
+		call->rpc_->Finish(response, &call->status_, call->tag());
 		return;
 	}
 
-	// NOTE: Using ClientUnaryReactor instead of the shortcut method
-	//       would allow getting detailed errors.
-	m_stub->async()->Set(context, &request, response,
-				       [this, cb, context, response](Status s) {
-					       if (s.ok())
-						       handleSetResponse(response, cb);
-					       delete response;
-					       delete context;
-				       });
+	auto reactor = new UnaryReactor(done);
+	stub()->async()->Set(context, &request, response, reactor);
+	reactor->StartCall();
 }
 
 void KuksaClient::handleGetResponse(const GetResponse *response, GetResponseCallback cb)
@@ -319,12 +1478,7 @@ void KuksaClient::handleGetResponse(const GetResponse *response, GetResponseCall
 		if (!it->path().size())
 			continue;
 
-		Datapoint dp;
-		if (it->has_actuator_target())
-			dp = it->actuator_target();
-		else
-			dp = it->value();
-		cb(it->path(), dp);
+		cb(it->path(), it->has_actuator_target() ? it->actuator_target() : it->value());
 	}
 }
 
@@ -349,17 +1503,26 @@ void KuksaClient::handleSubscribeResponse(const SubscribeResponse *response, Sub
 		if (!(it->has_entry() && it->entry().path().size()))
 			continue;
 
-		auto entry = it->entry();
-		if (m_config.verbose())
-			std::cout << "KuksaClient::handleSubscribeResponse: got value for " << entry.path() << std::endl;
+		// Passed on as is, without copying path or value
+		const DataEntry &entry = it->entry();
+		if (Logger::verbose())
+			Logger::debug("KuksaClient", "Got value for {}", entry.path());
 
-		Datapoint dp;
-		if (entry.has_actuator_target())
-			dp = entry.actuator_target();
-		else
-			dp = entry.value();
+		cb(entry.path(), entry.has_actuator_target() ? entry.actuator_target() : entry.value());
+	}
+}
 
-		cb(entry.path(), dp);
+void KuksaClient::addUpdate(SetRequest &request, const std::string &path, const Datapoint &dp, bool actuator)
+{
+	auto update = request.add_updates();
+	auto entry = update->mutable_entry();
+	entry->set_path(path);
+	if (actuator) {
+		*entry->mutable_actuator_target() = dp;
+		update->add_fields(Field::FIELD_ACTUATOR_TARGET);
+	} else {
+		*entry->mutable_value() = dp;
+		update->add_fields(Field::FIELD_VALUE);
 	}
 }
 
@@ -374,7 +1537,133 @@ void KuksaClient::handleSubscribeDone(const SubscribeRequest *request,
 void KuksaClient::handleCriticalFailure(const std::string &error)
 {
 	if (error.size())
-		std::cerr << error << std::endl;
+		Logger::error("KuksaClient", "{}", error);
 	exit(1);
 }
 
+
+//
+// KuksaSubscribeStream
+//
+
+void KuksaSubscribeStream::State::push(const std::string &path, const Datapoint &dp)
+{
+	std::coroutine_handle<> handle;
+	{
+		// Whatever was in flight when the token fired is not wanted
+		const std::lock_guard<std::mutex> lock(mutex);
+		if (cancelled)
+			return;
+		KuksaSignalUpdate update;
+		update.path = path;
+		update.dp = dp;
+		updates.push_back(update);
+		handle = std::exchange(waiter, nullptr);
+	}
+	if (handle)
+		handle.resume();
+}
+
+void KuksaSubscribeStream::State::finish(const Status &s)
+{
+	uint64_t id;
+	std::coroutine_handle<> handle;
+	{
+		const std::lock_guard<std::mutex> lock(mutex);
+		id = std::exchange(cancel_id, 0);
+		done = true;
+		status = s;
+		handle = std::exchange(waiter, nullptr);
+	}
+	if (id)
+		cancel->detach(id);
+	if (handle)
+		handle.resume();
+}
+
+void KuksaSubscribeStream::State::cancelByToken()
+{
+	uint64_t id;
+	{
+		const std::lock_guard<std::mutex> lock(mutex);
+		cancelled = true;
+		id = handle;
+	}
+	if (id)
+		client->cancelSubscription(id);
+}
+
+KuksaSubscribeStream::KuksaSubscribeStream() :
+	m_state(std::make_shared<State>())
+{
+}
+
+KuksaSubscribeStream::~KuksaSubscribeStream()
+{
+	cancel();
+}
+
+KuksaSubscribeStream &KuksaSubscribeStream::operator=(KuksaSubscribeStream &&other)
+{
+	if (this != &other) {
+		cancel();
+		m_state = std::move(other.m_state);
+	}
+	return *this;
+}
+
+Status KuksaSubscribeStream::status() const
+{
+	if (!m_state)
+		return Status(grpc::CANCELLED, "No stream");
+
+	const std::lock_guard<std::mutex> lock(m_state->mutex);
+	return m_state->status;
+}
+
+void KuksaSubscribeStream::cancel()
+{
+	if (!m_state || !m_state->client)
+		return;
+
+	uint64_t handle;
+	{
+		const std::lock_guard<std::mutex> lock(m_state->mutex);
+		if (m_state->done)
+			return;
+		handle = m_state->handle;
+	}
+	m_state->client->cancelSubscription(handle);
+}
+
+bool KuksaSubscribeStream::NextAwaiter::await_ready()
+{
+	if (!m_state)
+		return true;
+
+	const std::lock_guard<std::mutex> lock(m_state->mutex);
+	return !m_state->updates.empty() || m_state->done;
+}
+
+bool KuksaSubscribeStream::NextAwaiter::await_suspend(std::coroutine_handle<> handle)
+{
+	// Something may have arrived since await_ready()
+	const std::lock_guard<std::mutex> lock(m_state->mutex);
+	if (!m_state->updates.empty() || m_state->done)
+		return false;
+	m_state->waiter = handle;
+	return true;
+}
+
+std::optional<KuksaSignalUpdate> KuksaSubscribeStream::NextAwaiter::await_resume()
+{
+	if (!m_state)
+		return std::nullopt;
+
+	const std::lock_guard<std::mutex> lock(m_state->mutex);
+	if (m_state->updates.empty())
+		return std::nullopt;
+	KuksaSignalUpdate update = std::move(m_state->updates.front());
+	m_state->updates.pop_front();
+	return update;
+}
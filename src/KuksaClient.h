@@ -8,7 +8,15 @@
 #define KUKSA_CLIENT_H
 
 #include <string>
+#include <vector>
+#include <deque>
 #include <map>
+#include <memory>
+#include <mutex>
+#include <chrono>
+#include <optional>
+#include <atomic>
+#include <coroutine>
 #include <grpcpp/grpcpp.h>
 #include "kuksa/val/v1/val.grpc.pb.h"
 
@@ -16,9 +24,16 @@
 // definitions that may potentially be needed.
 using namespace kuksa::val::v1;
 
+using grpc::ClientContext;
 using grpc::Status;
 
 #include "KuksaConfig.h"
+#include "AuthTokenProvider.h"
+#include "EventLoop.h"
+#include "SubscribeRecorder.h"
+#include "KuksaCoroutine.h"
+#include "KuksaSignal.h"
+#include "Watchdog.h"
 
 // API response callback types
 typedef std::function<void(const std::string &path, const Datapoint &dp)> GetResponseCallback;
@@ -26,27 +41,203 @@ typedef std::function<void(const std::string &path, const Error &error)> SetResp
 typedef std::function<void(const std::string &path, const Datapoint &dp)> SubscribeResponseCallback;
 typedef std::function<void(const SubscribeRequest *request, const Status &status)> SubscribeDoneCallback;
 
+// Final status of a get or set call, including failures (deadline
+// exceeded, cancellation, shed by the in-flight limit) that never reach
+// the response callback
+typedef std::function<void(const std::string &path, const Status &status)> CallStatusCallback;
+
+typedef std::function<void(const Status &status)> MetadataDoneCallback;
+
+// What the broker says about a signal
+struct KuksaSignalMetadata {
+	DataType data_type;
+	EntryType entry_type;
+};
+
+class KuksaClient;
+
+// Per-call options of the coroutine API
+struct KuksaCallOptions {
+	// Deadline relative to the start of the call, 0 for none
+	std::chrono::milliseconds timeout = std::chrono::milliseconds(0);
+
+	// Needs to stay valid until the call completes
+	const CancelToken *cancel = NULL;
+};
+
+struct KuksaGetResult {
+	Status status;
+	std::map<std::string, Datapoint> values;
+};
+
+struct KuksaSetResult {
+	Status status;
+	std::map<std::string, Error> errors;	// per signal errors
+};
+
+struct KuksaSignalUpdate {
+	std::string path;
+	Datapoint dp;
+};
+
+// Subscription as an async generator:
+//
+//	auto stream = client.subscribeStream(signals);
+//	while (auto update = co_await stream.next())
+//		...
+//
+// next() resolves to nothing once the stream has ended, status() then
+// says why.  Destroying the stream cancels the subscription; it must not
+// outlive the client.
+
+class KuksaSubscribeStream
+{
+public:
+	KuksaSubscribeStream();
+
+	KuksaSubscribeStream(KuksaSubscribeStream &&other) : m_state(std::move(other.m_state)) {};
+
+	KuksaSubscribeStream &operator=(KuksaSubscribeStream &&other);
+
+	~KuksaSubscribeStream();
+
+	class NextAwaiter;
+
+	NextAwaiter next();
+
+	Status status() const;
+
+	void cancel();
+
+private:
+	friend class KuksaClient;
+
+	struct State {
+		std::mutex mutex;
+		std::deque<KuksaSignalUpdate> updates;
+		bool done = false;
+		Status status;
+		std::coroutine_handle<> waiter;
+
+		// handle, cancel_id and cancelled are under mutex as well,
+		// the token may fire on any thread
+		KuksaClient *client = NULL;
+		uint64_t handle = 0;
+		const CancelToken *cancel = NULL;
+		uint64_t cancel_id = 0;
+		bool cancelled = false;		// by the token
+
+		void push(const std::string &path, const Datapoint &dp);
+		void finish(const Status &s);
+		void cancelByToken();
+	};
+
+	std::shared_ptr<State> m_state;
+};
+
+class KuksaSubscribeStream::NextAwaiter
+{
+public:
+	explicit NextAwaiter(std::shared_ptr<State> state) : m_state(state) {};
+
+	bool await_ready();
+	bool await_suspend(std::coroutine_handle<> handle);
+	std::optional<KuksaSignalUpdate> await_resume();
+
+private:
+	std::shared_ptr<State> m_state;
+};
+
+inline KuksaSubscribeStream::NextAwaiter KuksaSubscribeStream::next()
+{
+	return NextAwaiter(m_state);
+}
+
 // KUKSA.val databroker "VAL" gRPC API client class
+//
+// By default the gRPC callback API is used and response callbacks run on
+// gRPC's own threads.  If an event loop is given, the CompletionQueue API
+// is used instead and all callbacks are invoked on the loop thread.  In
+// either case the gRPC threads are shared by all clients in the process,
+// in the latter the clients using the same loop also share one queue.
+//
+// The coroutine API (get/set taking several signals, subscribeStream)
+// resumes the awaiting coroutine on those same threads.
+//
+// Given several channels (primary first, then standbys), calls go to the
+// first one that is connected, the others are kept connected as well.
+// When the broker in use becomes unavailable, its subscriptions move to
+// the first connected standby and the writes it had in flight are sent
+// there again, without the subscriber seeing the stream end.  Switching
+// back only happens once the standby fails in turn.
 
 class KuksaClient
 {
 public:
-	explicit KuksaClient(const std::shared_ptr< ::grpc::ChannelInterface>& channel, const KuksaConfig &config);
-
-	void get(const std::string &path, GetResponseCallback cb, const bool actuator = false);
-
-	void set(const std::string &path, const std::string &value, SetResponseCallback cb, const bool actuator = false);
-	void set(const std::string &path, const bool value, SetResponseCallback cb, const bool actuator = false);
-	void set(const std::string &path, const int8_t value, SetResponseCallback cb, const bool actuator = false);
-	void set(const std::string &path, const int16_t value, SetResponseCallback cb, const bool actuator = false);
-	void set(const std::string &path, const int32_t value, SetResponseCallback cb, const bool actuator = false);
-	void set(const std::string &path, const int64_t value, SetResponseCallback cb, const bool actuator = false);
-	void set(const std::string &path, const uint8_t value, SetResponseCallback cb, const bool actuator = false);
-	void set(const std::string &path, const uint16_t value, SetResponseCallback cb, const bool actuator = false);
-	void set(const std::string &path, const uint32_t value, SetResponseCallback cb, const bool actuator = false);
-	void set(const std::string &path, const uint64_t value, SetResponseCallback cb, const bool actuator = false);
-	void set(const std::string &path, const float value, SetResponseCallback cb, const bool actuator = false);
-	void set(const std::string &path, const double value, SetResponseCallback cb, const bool actuator = false);
+	explicit KuksaClient(const std::shared_ptr< ::grpc::ChannelInterface>& channel,
+			     const KuksaConfig &config,
+			     EventLoop *loop = NULL);
+
+	// One channel per config.endpoints() entry, in the same order
+	explicit KuksaClient(const std::vector<std::shared_ptr< ::grpc::ChannelInterface>> &channels,
+			     const KuksaConfig &config,
+			     EventLoop *loop = NULL);
+
+	~KuksaClient();
+
+	// True if callbacks are delivered on the event loop thread
+	bool reactor() const { return m_cq != NULL; };
+
+	// Target of the channel in use
+	const std::string &endpoint() const { return m_endpoints[m_active.load()]; };
+
+	// Have disconnected standbys reconnect, gRPC leaves them idle
+	// otherwise; to be called periodically
+	void checkEndpoints();
+
+	// Swap the authorization token used for subsequent RPCs; active
+	// subscriptions are rotated onto the new token without a gap.
+	void setAuthToken(const std::string &token);
+
+	// Follow token updates from provider
+	void setTokenProvider(std::shared_ptr<AuthTokenProvider> provider);
+
+	// Record every subscribe response received from now on
+	void setRecorder(std::shared_ptr<SubscribeRecorder> recorder) { m_recorder = recorder; };
+
+	// Time the subscribe callbacks for stall detection
+	void setWatchdogProbe(std::shared_ptr<WatchdogProbe> probe) { std::atomic_store(&m_probe, probe); };
+
+	// Unary calls get the configured deadline (rpc-timeout).  At most
+	// max-in-flight of them are outstanding: further writes wait for a
+	// free slot, keeping only the newest value per signal (the replaced
+	// write completes with ABORTED), further reads fail right away with
+	// RESOURCE_EXHAUSTED.
+	void get(const std::string &path, GetResponseCallback cb, const bool actuator = false,
+		 CallStatusCallback status_cb = nullptr);
+
+	// Write the current value of a signal declared with Signal<>
+	template<class S, SignalValue<S> V>
+	void set(V value, SetResponseCallback cb, CallStatusCallback status_cb = nullptr) {
+		Datapoint dp;
+		S::encode(value, dp);
+		set(S::path(), dp, cb, false, status_cb);
+	};
+
+	// Request a new target value of an actuator
+	template<class S, SignalValue<S> V>
+	void setTarget(V value, SetResponseCallback cb, CallStatusCallback status_cb = nullptr) {
+		static_assert(S::actuator, "Only actuators have a target value");
+		Datapoint dp;
+		S::encode(value, dp);
+		set(S::path(), dp, cb, true, status_cb);
+	};
+
+	// Generic write, the value is converted to the signal's type as
+	// given by the metadata cache; signals not in it are taken to be
+	// strings.  Values that do not convert fail with INVALID_ARGUMENT.
+	void set(const std::string &path, const std::string &value, SetResponseCallback cb, const bool actuator = false,
+		 CallStatusCallback status_cb = nullptr);
 
 	void subscribe(const std::string &path,
 		       SubscribeResponseCallback cb,
@@ -59,18 +250,220 @@ public:
 		       SubscribeResponseCallback cb,
 		       SubscribeDoneCallback done_cb = nullptr);
 
+	// Awaitable versions, e.g.
+	//
+	//	KuksaGetResult r = co_await client.get({ "Vehicle.Speed" });
+	//
+	// The calls start when awaited and complete with the full status.
+	Task<KuksaGetResult> get(std::vector<std::string> paths,
+				 bool actuator = false,
+				 KuksaCallOptions options = KuksaCallOptions());
+
+	Task<KuksaSetResult> set(std::map<std::string, Datapoint> updates,
+				 bool actuator = false,
+				 KuksaCallOptions options = KuksaCallOptions());
+
+	// Streams run until cancelled, so there is no deadline
+	KuksaSubscribeStream subscribeStream(const std::map<std::string, bool> &signals,
+					     const CancelToken *cancel = NULL);
+
+	// Cancel all subscriptions, including streams; their done
+	// callbacks still run (with CANCELLED)
+	void cancelSubscriptions();
+
+	// True once no calls or subscriptions are outstanding, i.e. all
+	// callbacks have run
+	bool idle();
+
+	// Fill the metadata cache with one Get for everything at or below
+	// paths (a branch covers all signals under it), replacing what was
+	// cached.  The cache is dropped when a subscription fails, as the
+	// broker may come back with a different tree; lookups never go to
+	// the broker.
+	void loadMetadata(const std::vector<std::string> &paths, MetadataDoneCallback done);
+
+	bool metadata(const std::string &path, KuksaSignalMetadata &md) const;
+
+	// Cached signals of the given type below branch
+	std::vector<std::string> discover(const std::string &branch, EntryType type) const;
+
+	void invalidateMetadata();
+
+	// Parse value as a type, false if it does not fit
+	static bool toDatapoint(DataType type, const std::string &value, Datapoint &dp);
+
+	// Deliver the updates in a (possibly replayed) subscribe response
+	static void handleSubscribeResponse(const SubscribeResponse *response, SubscribeResponseCallback cb);
+
+	// Append the write of one signal to request, as set() sends it
+	static void addUpdate(SetRequest &request, const std::string &path, const Datapoint &dp, bool actuator);
+
+	// Build the write of one signal in a pooled call as set() does,
+	// then put it back unsent; for timing that part in the benchmarks
+	void buildSet(const std::string &path, const Datapoint &dp, bool actuator);
+
 private:
+	friend class KuksaSubscribeStream;
+
+	typedef std::function<void(const Status &status)> DoneFunc;
+
+	class AsyncQueue;
+	class AsyncCall;
+	class UnaryReactor;
+	class SetCall;
+	template<class Response> class AsyncUnaryCall;
+	template<class Response> class UnaryAwaiter;
+	class SubscribeReader;
+	class CallbackSubscribeReader;
+	class AsyncSubscribeReader;
+
 	KuksaConfig m_config;
-	std::shared_ptr<VAL::Stub> m_stub;
 
-	void set(const std::string &path, const Datapoint &dp, SetResponseCallback cb, const bool actuator);
+	// Per endpoint, fixed after construction; m_active is the one in
+	// use, switched under m_failover_mutex
+	std::vector<std::string> m_endpoints;
+	std::vector<std::shared_ptr< ::grpc::ChannelInterface>> m_channels;
+	std::vector<std::unique_ptr<VAL::Stub>> m_stubs;
+	std::atomic<size_t> m_active;
+	std::mutex m_failover_mutex;
+
+	VAL::Stub *stub() { return m_stubs[m_active.load()].get(); };
+
+	// Switch away from failed to the first connected endpoint, unless
+	// that happened already; true if another endpoint is in use now
+	bool failover(size_t failed);
+
+	// The active endpoint, or a connected one if it is not
+	size_t selectEndpoint();
+
+	// CompletionQueue mode: gRPC has no pollable fd, so a single thread
+	// blocks on the queue and hands completions over to the loop.
+	std::shared_ptr<AsyncQueue> m_queue;
+	grpc::CompletionQueue *m_cq;
+
+	// "Bearer <token>" header value, empty if no token; only accessed
+	// via std::atomic_load/std::atomic_store.
+	std::shared_ptr<const std::string> m_auth_header;
+
+	std::shared_ptr<const std::string> authHeader() const { return std::atomic_load(&m_auth_header); };
+
+	void addAuthHeader(ClientContext *context);
+
+	std::shared_ptr<AuthTokenProvider> m_token_provider;
+
+	std::shared_ptr<SubscribeRecorder> m_recorder;
+
+	// Only accessed via std::atomic_load/std::atomic_store
+	std::shared_ptr<WatchdogProbe> m_probe;
+
+	// Replaced as a whole, only accessed via std::atomic_load/std::atomic_store
+	typedef std::map<std::string, KuksaSignalMetadata> MetadataMap;
+	std::shared_ptr<const MetadataMap> m_metadata;
+
+	// A write waiting for an in-flight slot
+	struct PendingSet {
+		Datapoint dp;
+		bool actuator = false;
+		SetResponseCallback cb;
+		CallStatusCallback status_cb;
+		bool waiting = false;		// in m_pending_order
+	};
+	typedef std::map<std::string, PendingSet> PendingMap;
+
+	// Outstanding unary calls (by context, for cancellation) and the
+	// writes waiting for one of them to finish; recursive since a
+	// cancelled call may complete inline.  Waiting writes are kept per
+	// signal once it had one, and queued from m_pending_head on, so
+	// that a broker falling behind does not mean allocating.
+	std::recursive_mutex m_calls_mutex;
+	std::vector<ClientContext*> m_calls;
+	unsigned m_in_flight;
+	PendingMap m_pending_sets;
+	std::vector<PendingMap::iterator> m_pending_order;
+	size_t m_pending_head;
+	bool m_shutdown;
+
+	// Finished write calls, for reuse
+	std::vector<SetCall*> m_free_set_calls;
+
+	// Takes an in-flight slot, or returns false with the reason
+	bool reserveCall(Status &refused);
+
+	// Hands the slot to a waiting write, or frees it
+	void releaseCall();
+
+	// Deadline, authorization and tracking for a call about to start
+	void prepareCall(ClientContext *context);
+
+	void untrackCall(ClientContext *context);
+
+	// prepareCall(), with done wrapped to untrack and release the slot
+	DoneFunc trackCall(ClientContext *context, DoneFunc done);
+
+	// Needs a reserved slot
+	void startSet(const std::string &path, const PendingSet &pending);
+
+	// Send the request of call on the active endpoint
+	void sendSet(SetCall *call);
+
+	SetCall *acquireSetCall();
+
+	// Back to the pool, or deleted if that is full
+	void releaseSetCall(SetCall *call);
+
+	// From the pool, with the request built
+	SetCall *newSetCall(const std::string &path, const Datapoint &dp, bool actuator);
+
+	void finishSet(SetCall *call);
+
+	// Active subscribe streams by id, for token rotation
+	std::recursive_mutex m_readers_mutex;
+	std::map<uint64_t, SubscribeReader*> m_readers;
+	uint64_t m_next_reader_id;
+	bool m_subscriptions_cancelled;		// no more rotations
+
+	// Returns a handle for cancelSubscription(), stable across token
+	// rotations
+	uint64_t startSubscribe(const SubscribeRequest *request,
+				SubscribeResponseCallback cb,
+				SubscribeDoneCallback done_cb);
+
+	void cancelSubscription(uint64_t handle);
+
+	// Unary calls shared by the callback and coroutine APIs, context
+	// and response need to stay valid until done is called.  Unless
+	// reserved, an in-flight slot is taken (or the call refused).
+	void callGet(ClientContext *context, const GetRequest &request, GetResponse *response, DoneFunc done,
+		     bool reserved = false);
+
+	void callSet(ClientContext *context, const SetRequest &request, SetResponse *response, DoneFunc done,
+		     bool reserved = false);
+
+	SubscribeReader *createReader(const SubscribeRequest *request,
+				      SubscribeResponseCallback cb,
+				      SubscribeDoneCallback done_cb);
+
+	void registerReader(SubscribeReader *reader, uint64_t predecessor);
+
+	void startReader(SubscribeReader *reader);
+
+	void rotateSubscriptions();
+
+	void completeRotation(SubscribeReader *reader);
+
+	// Returns true if the stream is over for its subscriber
+	bool finishReader(SubscribeReader *reader, const Status &status);
+
+	// Rotation bookkeeping of finishReader(), with m_readers_mutex held
+	bool endReader(SubscribeReader *reader, const Status &status);
+
+	void set(const std::string &path, const Datapoint &dp, SetResponseCallback cb, const bool actuator,
+		 CallStatusCallback status_cb);
 
 	void handleGetResponse(const GetResponse *response, GetResponseCallback cb);
 
 	void handleSetResponse(const SetResponse *response, SetResponseCallback cb);
 
-	void handleSubscribeResponse(const SubscribeResponse *response, SubscribeResponseCallback cb);
-
 	void handleSubscribeDone(const SubscribeRequest *request, const Status &status, SubscribeDoneCallback cb);
 
 	void handleCriticalFailure(const std::string &error);
@@ -8,6 +8,8 @@
 #define _KUKSA_CONFIG_H
 
 #include <string>
+#include <vector>
+#include "HvacConfig.h"
 
 class KuksaConfig
 {
@@ -17,27 +19,41 @@ public:
 			     const std::string &caCert,
 			     const std::string &tlsServerName,
 			     const std::string &authToken);
-        explicit KuksaConfig(const std::string &appname);
+        explicit KuksaConfig(const HvacConfig &config);
         ~KuksaConfig() {};
 
 	std::string hostname() { return m_hostname; };
 	unsigned port() { return m_port; };
+
+	// gRPC targets of the primary databroker and its standbys, in order
+	// of preference
+	std::vector<std::string> endpoints() { return m_endpoints; };
 	std::string caCert() { return m_caCert; };
 	std::string tlsServerName() { return m_tlsServerName; };
 	std::string authToken() { return m_authToken; };
 	bool valid() { return m_valid; };
 	unsigned verbose() { return m_verbose; };
 
+	// Empty when not read from a configuration file
+	std::string authTokenFile() { return m_authTokenFile; };
+	unsigned authTokenRefresh() { return m_authTokenRefresh; };
+
+	unsigned rpcTimeout() { return m_rpcTimeout; };
+	unsigned maxInFlight() { return m_maxInFlight; };
+
 private:
 	std::string m_hostname;
 	unsigned m_port;
+	std::vector<std::string> m_endpoints;
 	std::string m_caCert;
 	std::string m_tlsServerName;
 	std::string m_authToken;
+	std::string m_authTokenFile;
+	unsigned m_authTokenRefresh;
+	unsigned m_rpcTimeout;
+	unsigned m_maxInFlight;
 	unsigned m_verbose;
 	bool m_valid;
-
-	void readFile(const std::string &filename, std::string &data);
 };
 
 #endif // _KUKSA_CONFIG_H
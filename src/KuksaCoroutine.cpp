@@ -0,0 +1,111 @@
+/*
+ * Copyright (C) 2023 Konsulko Group
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#include <new>
+
+#include "KuksaCoroutine.h"
+
+// Frames are rounded up to 64 byte size classes; larger ones, and blocks
+// beyond what a class keeps around, go back to the heap.
+#define POOL_GRANULE	64
+#define POOL_CLASSES	32		// up to 2 KB
+#define POOL_KEEP	64		// free blocks kept per class
+
+namespace {
+
+struct FreeBlock {
+	FreeBlock *next;
+};
+
+struct FramePool {
+	std::mutex mutex;
+	FreeBlock *free[POOL_CLASSES] = {};
+	unsigned count[POOL_CLASSES] = {};
+};
+
+FramePool &pool()
+{
+	// Never destroyed, frames may be released during static destruction
+	static FramePool *pool = new FramePool();
+	return *pool;
+}
+
+inline size_t size_class(size_t size)
+{
+	return (size + POOL_GRANULE - 1) / POOL_GRANULE - 1;
+}
+
+} // namespace
+
+void *CoroutineFramePool::allocate(size_t size)
+{
+	size_t cls = size_class(size);
+	if (cls < POOL_CLASSES) {
+		FramePool &p = pool();
+		const std::lock_guard<std::mutex> lock(p.mutex);
+		FreeBlock *block = p.free[cls];
+		if (block) {
+			p.free[cls] = block->next;
+			p.count[cls]--;
+			return block;
+		}
+		return ::operator new((cls + 1) * POOL_GRANULE);
+	}
+	return ::operator new(size);
+}
+
+void CoroutineFramePool::deallocate(void *ptr, size_t size)
+{
+	size_t cls = size_class(size);
+	if (cls < POOL_CLASSES) {
+		FramePool &p = pool();
+		const std::lock_guard<std::mutex> lock(p.mutex);
+		if (p.count[cls] < POOL_KEEP) {
+			FreeBlock *block = (FreeBlock*) ptr;
+			block->next = p.free[cls];
+			p.free[cls] = block;
+			p.count[cls]++;
+			return;
+		}
+	}
+	::operator delete(ptr);
+}
+
+void CancelToken::cancel()
+{
+	const std::lock_guard<std::recursive_mutex> lock(m_state->mutex);
+	if (m_state->cancelled)
+		return;
+	m_state->cancelled = true;
+
+	// A canceller may complete its call inline, which detaches
+	std::map<uint64_t, std::function<void()>> cancellers;
+	cancellers.swap(m_state->cancellers);
+	for (auto it = cancellers.begin(); it != cancellers.end(); ++it)
+		it->second();
+}
+
+bool CancelToken::cancelled() const
+{
+	const std::lock_guard<std::recursive_mutex> lock(m_state->mutex);
+	return m_state->cancelled;
+}
+
+uint64_t CancelToken::attach(std::function<void()> fn) const
+{
+	const std::lock_guard<std::recursive_mutex> lock(m_state->mutex);
+	if (m_state->cancelled)
+		return 0;
+	uint64_t id = ++m_state->next_id;
+	m_state->cancellers[id] = fn;
+	return id;
+}
+
+void CancelToken::detach(uint64_t id) const
+{
+	const std::lock_guard<std::recursive_mutex> lock(m_state->mutex);
+	m_state->cancellers.erase(id);
+}
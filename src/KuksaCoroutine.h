@@ -0,0 +1,190 @@
+/*
+ * Copyright (C) 2023 Konsulko Group
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#ifndef _KUKSA_COROUTINE_H
+#define _KUKSA_COROUTINE_H
+
+#include <coroutine>
+#include <exception>
+#include <optional>
+#include <utility>
+#include <memory>
+#include <mutex>
+#include <map>
+#include <functional>
+#include <cstddef>
+#include <cstdint>
+
+// Minimal C++20 coroutine support for the KuksaClient awaitable API
+//
+// Task<T> is a lazily started coroutine: nothing runs until it is
+// co_await'ed (or handed to spawn()), and completion resumes the awaiting
+// coroutine directly.  Exceptions are not used in this code base, one
+// escaping a coroutine terminates the process.
+//
+// Coroutine frames come from CoroutineFramePool rather than the general
+// heap, a steady stream of RPCs keeps reusing the same few blocks.
+
+class CoroutineFramePool
+{
+public:
+	static void *allocate(size_t size);
+
+	static void deallocate(void *ptr, size_t size);
+};
+
+// Gives a promise type pooled frame allocation
+struct PooledPromise {
+	static void *operator new(size_t size) { return CoroutineFramePool::allocate(size); };
+	static void operator delete(void *ptr, size_t size) { CoroutineFramePool::deallocate(ptr, size); };
+};
+
+template<typename T = void> class Task;
+
+namespace detail {
+
+template<typename T>
+struct TaskPromiseBase : PooledPromise {
+	std::coroutine_handle<> continuation;
+
+	struct FinalAwaiter {
+		bool await_ready() noexcept { return false; };
+		template<typename Promise>
+		std::coroutine_handle<> await_suspend(std::coroutine_handle<Promise> h) noexcept {
+			auto next = h.promise().continuation;
+			return next ? next : std::noop_coroutine();
+		};
+		void await_resume() noexcept {};
+	};
+
+	std::suspend_always initial_suspend() noexcept { return {}; };
+	FinalAwaiter final_suspend() noexcept { return {}; };
+	void unhandled_exception() noexcept { std::terminate(); };
+};
+
+template<typename T>
+struct TaskPromise : TaskPromiseBase<T> {
+	std::optional<T> value;
+
+	Task<T> get_return_object() noexcept;
+	void return_value(T v) { value.emplace(std::move(v)); };
+	T result() { return std::move(*value); };
+};
+
+template<>
+struct TaskPromise<void> : TaskPromiseBase<void> {
+	Task<void> get_return_object() noexcept;
+	void return_void() noexcept {};
+	void result() {};
+};
+
+} // namespace detail
+
+template<typename T>
+class Task
+{
+public:
+	typedef detail::TaskPromise<T> promise_type;
+
+	Task() : m_handle(nullptr) {};
+	explicit Task(std::coroutine_handle<promise_type> h) : m_handle(h) {};
+	Task(Task &&other) noexcept : m_handle(std::exchange(other.m_handle, nullptr)) {};
+	Task &operator=(Task &&other) noexcept {
+		if (this != &other) {
+			if (m_handle)
+				m_handle.destroy();
+			m_handle = std::exchange(other.m_handle, nullptr);
+		}
+		return *this;
+	};
+	Task(const Task&) = delete;
+	Task &operator=(const Task&) = delete;
+
+	~Task() {
+		if (m_handle)
+			m_handle.destroy();
+	};
+
+	bool await_ready() const noexcept { return !m_handle || m_handle.done(); };
+
+	std::coroutine_handle<> await_suspend(std::coroutine_handle<> caller) noexcept {
+		m_handle.promise().continuation = caller;
+		return m_handle;
+	};
+
+	T await_resume() { return m_handle.promise().result(); };
+
+private:
+	std::coroutine_handle<promise_type> m_handle;
+};
+
+namespace detail {
+
+template<typename T>
+inline Task<T> TaskPromise<T>::get_return_object() noexcept
+{
+	return Task<T>(std::coroutine_handle<TaskPromise<T>>::from_promise(*this));
+}
+
+inline Task<void> TaskPromise<void>::get_return_object() noexcept
+{
+	return Task<void>(std::coroutine_handle<TaskPromise<void>>::from_promise(*this));
+}
+
+// Fire and forget wrapper, frees itself when done
+struct Detached {
+	struct promise_type : PooledPromise {
+		Detached get_return_object() noexcept { return {}; };
+		std::suspend_never initial_suspend() noexcept { return {}; };
+		std::suspend_never final_suspend() noexcept { return {}; };
+		void return_void() noexcept {};
+		void unhandled_exception() noexcept { std::terminate(); };
+	};
+};
+
+inline Detached run_detached(Task<void> task)
+{
+	co_await task;
+}
+
+} // namespace detail
+
+// Start a top-level coroutine; it runs until its first suspension right
+// away and on whichever thread resumes it afterwards
+inline void spawn(Task<void> task)
+{
+	detail::run_detached(std::move(task));
+}
+
+// Cancels the calls it is passed to (see KuksaCallOptions), including
+// ones started after cancel()
+class CancelToken
+{
+public:
+	CancelToken() : m_state(std::make_shared<State>()) {};
+
+	void cancel();
+
+	bool cancelled() const;
+
+	// Run fn on cancel(); returns 0 (without calling fn) if already
+	// cancelled.  fn runs with the token locked, so it must not block.
+	uint64_t attach(std::function<void()> fn) const;
+
+	void detach(uint64_t id) const;
+
+private:
+	struct State {
+		std::recursive_mutex mutex;
+		bool cancelled = false;
+		uint64_t next_id = 0;
+		std::map<uint64_t, std::function<void()>> cancellers;
+	};
+
+	std::shared_ptr<State> m_state;
+};
+
+#endif // _KUKSA_COROUTINE_H
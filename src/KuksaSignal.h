@@ -0,0 +1,117 @@
+/*
+ * Copyright (C) 2023 Konsulko Group
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#ifndef _KUKSA_SIGNAL_H
+#define _KUKSA_SIGNAL_H
+
+#include <string>
+#include <algorithm>
+#include <type_traits>
+#include <cstddef>
+#include <cstdint>
+
+#include "kuksa/val/v1/types.pb.h"
+
+// Compile-time signal descriptors
+//
+// A signal is declared once as a type, e.g.
+//
+//	typedef Signal<uint8_t, "Vehicle.Cabin.HVAC.Station.Row1.Driver.FanSpeed", 0, 100> DriverFanSpeed;
+//
+// which fixes its path, value type, valid range and whether it is an
+// actuator.  The Datapoint field it is carried in follows from the type
+// (the VAL API has no 8 and 16 bit fields, those travel as 32 bit), so
+// KuksaClient::set<DriverFanSpeed>(value, ...) and
+// SignalDispatcher::add<DriverFanSpeed>(...) need no per-signal checks;
+// writing a value that does not fit the type (e.g. a float or int to it)
+// does not compile.
+
+// String literal usable as a template argument
+template<size_t N>
+struct SignalPath {
+	constexpr SignalPath(const char (&s)[N]) { std::copy_n(s, N, value); };
+
+	char value[N];
+};
+
+enum class SignalKind {
+	SENSOR,
+	ACTUATOR
+};
+
+namespace detail {
+
+// Datapoint field for each supported value type, deliberately left
+// undefined for anything else
+template<typename T> struct DatapointField;
+
+#define DATAPOINT_FIELD(type, wire, field, value_case)					\
+	template<> struct DatapointField<type> {					\
+		typedef wire Wire;							\
+		static const kuksa::val::v1::Datapoint::ValueCase CASE =		\
+			kuksa::val::v1::Datapoint::value_case;				\
+		static void set(kuksa::val::v1::Datapoint &dp, type v) { dp.set_##field(v); };	\
+		static Wire get(const kuksa::val::v1::Datapoint &dp) { return dp.field(); };	\
+	}
+
+DATAPOINT_FIELD(bool, bool, bool_, kBool);
+DATAPOINT_FIELD(int8_t, int32_t, int32, kInt32);
+DATAPOINT_FIELD(int16_t, int32_t, int32, kInt32);
+DATAPOINT_FIELD(int32_t, int32_t, int32, kInt32);
+DATAPOINT_FIELD(int64_t, int64_t, int64, kInt64);
+DATAPOINT_FIELD(uint8_t, uint32_t, uint32, kUint32);
+DATAPOINT_FIELD(uint16_t, uint32_t, uint32, kUint32);
+DATAPOINT_FIELD(uint32_t, uint32_t, uint32, kUint32);
+DATAPOINT_FIELD(uint64_t, uint64_t, uint64, kUint64);
+DATAPOINT_FIELD(float, float, float_, kFloat);
+DATAPOINT_FIELD(double, double, double_, kDouble);
+
+#undef DATAPOINT_FIELD
+
+} // namespace detail
+
+template<typename T, SignalPath Path, T Min, T Max, SignalKind Kind = SignalKind::ACTUATOR>
+struct Signal {
+	static_assert(std::is_arithmetic_v<T>, "Signal values need to be scalars");
+	static_assert(!(Max < Min), "Empty signal range");
+
+	typedef T Type;
+	typedef detail::DatapointField<T> Field;
+
+	static constexpr T min = Min;
+	static constexpr T max = Max;
+	static constexpr SignalKind kind = Kind;
+	static constexpr bool actuator = Kind == SignalKind::ACTUATOR;
+
+	static const std::string &path() {
+		static const std::string path(Path.value);
+		return path;
+	};
+
+	static constexpr T clamp(T value) { return std::clamp(value, Min, Max); };
+
+	// Out of range values are clamped
+	static void encode(T value, kuksa::val::v1::Datapoint &dp) { Field::set(dp, clamp(value)); };
+
+	// False for a value of another type or outside the range, value is
+	// only meaningful otherwise
+	static bool decode(const kuksa::val::v1::Datapoint &dp, T &value) {
+		typename Field::Wire wire = Field::get(dp);
+		value = (T) wire;
+		return (dp.value_case() == Field::CASE) &
+			(wire >= (typename Field::Wire) Min) &
+			(wire <= (typename Field::Wire) Max);
+	};
+};
+
+// Values that convert to the type of signal S without narrowing
+template<typename V, class S>
+concept SignalValue = requires(V v) { { typename S::Type{v} }; };
+
+template<SignalPath Path, SignalKind Kind = SignalKind::ACTUATOR>
+using BoolSignal = Signal<bool, Path, false, true, Kind>;
+
+#endif // _KUKSA_SIGNAL_H
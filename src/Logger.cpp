@@ -0,0 +1,314 @@
+/*
+ * Copyright (C) 2023 Konsulko Group
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <cstdio>
+#include <cstdlib>
+#include <ctime>
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <systemd/sd-journal.h>
+
+#include "Logger.h"
+
+// Must be a power of two
+#define RING_SIZE 1024
+
+std::atomic<unsigned> Logger::s_verbose(0);
+
+// Bounded multi-producer ring (Vyukov style), the writer thread is the
+// only consumer.  A slot's sequence number tells whether it is free for
+// the producer at position pos (seq == pos) or holds a committed record
+// for the consumer (seq == pos + 1).
+
+namespace {
+
+struct LogRing {
+	LogRing() {
+		for (size_t i = 0; i < RING_SIZE; i++)
+			records[i].seq.store(i, std::memory_order_relaxed);
+	}
+
+	LogRecord records[RING_SIZE];
+	std::atomic<size_t> enqueue_pos{0};
+	size_t dequeue_pos = 0;
+	std::atomic<uint64_t> dropped{0};
+};
+
+LogRing &ring()
+{
+	static LogRing s_ring;
+	return s_ring;
+}
+
+std::string s_identifier("agl-service-hvac");
+std::thread s_thread;
+std::mutex s_mutex;
+std::condition_variable s_cv;
+std::atomic<bool> s_waiting(false);
+std::atomic<bool> s_stop(false);
+bool s_use_stderr = false;
+
+uint32_t current_tid()
+{
+	static thread_local uint32_t tid = (uint32_t) syscall(SYS_gettid);
+	return tid;
+}
+
+uint64_t monotonic_usec()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+// Render the next encoded argument at offset, returns false when the
+// record has no more arguments.
+bool format_arg(const LogRecord &record, size_t &offset, std::string &out)
+{
+	if (offset >= record.length)
+		return false;
+
+	uint8_t type = record.data[offset++];
+	switch (type) {
+	case LogRecord::ARG_INT: {
+		int64_t v;
+		memcpy(&v, &record.data[offset], sizeof(v));
+		offset += sizeof(v);
+		out += std::to_string(v);
+		break;
+	}
+	case LogRecord::ARG_UINT: {
+		uint64_t v;
+		memcpy(&v, &record.data[offset], sizeof(v));
+		offset += sizeof(v);
+		out += std::to_string(v);
+		break;
+	}
+	case LogRecord::ARG_DOUBLE: {
+		double v;
+		memcpy(&v, &record.data[offset], sizeof(v));
+		offset += sizeof(v);
+		char buf[32];
+		snprintf(buf, sizeof(buf), "%g", v);
+		out += buf;
+		break;
+	}
+	case LogRecord::ARG_BOOL:
+		out += record.data[offset++] ? "true" : "false";
+		break;
+	case LogRecord::ARG_STRING: {
+		uint16_t len;
+		memcpy(&len, &record.data[offset], sizeof(len));
+		offset += sizeof(len);
+		out.append((const char*) &record.data[offset], len);
+		offset += len;
+		break;
+	}
+	default:
+		offset = record.length;
+		return false;
+	}
+	return true;
+}
+
+std::string format_record(const LogRecord &record)
+{
+	std::string message;
+	size_t offset = 0;
+	const char *p = record.format;
+	while (p && *p) {
+		if (p[0] == '{' && p[1] == '}') {
+			if (!format_arg(record, offset, message))
+				message += "{}";
+			p += 2;
+		} else {
+			message += *p++;
+		}
+	}
+	if (record.truncated)
+		message += " [truncated]";
+
+	return message;
+}
+
+void write_record(const LogRecord &record)
+{
+	std::string message = format_record(record);
+	const char *subsystem = record.subsystem ? record.subsystem : "";
+
+	if (!s_use_stderr) {
+		int rc = sd_journal_send("MESSAGE=%s", message.c_str(),
+					 "PRIORITY=%i", record.priority,
+					 "SYSLOG_IDENTIFIER=%s", s_identifier.c_str(),
+					 "HVAC_SUBSYSTEM=%s", subsystem,
+					 "TID=%u", record.tid,
+					 "HVAC_MONOTONIC_USEC=%llu", (unsigned long long) record.timestamp_usec,
+					 NULL);
+		if (rc >= 0)
+			return;
+	}
+
+	// No journal (or running from a terminal), fall back to stderr
+	if (*subsystem)
+		fprintf(stderr, "%s: %s\n", subsystem, message.c_str());
+	else
+		fprintf(stderr, "%s\n", message.c_str());
+}
+
+// Write out everything committed so far, returns the number of records
+size_t drain()
+{
+	LogRing &r = ring();
+	size_t count = 0;
+	for (;;) {
+		LogRecord &record = r.records[r.dequeue_pos & (RING_SIZE - 1)];
+		size_t seq = record.seq.load(std::memory_order_seq_cst);
+		if (seq != r.dequeue_pos + 1)
+			break;
+
+		write_record(record);
+
+		record.seq.store(r.dequeue_pos + RING_SIZE, std::memory_order_release);
+		r.dequeue_pos++;
+		count++;
+	}
+
+	uint64_t dropped = r.dropped.exchange(0, std::memory_order_relaxed);
+	if (dropped) {
+		LogRecord note;
+		note.priority = LOG_WARNING;
+		note.subsystem = "Logger";
+		note.format = "Log ring full, dropped {} messages";
+		note.timestamp_usec = monotonic_usec();
+		note.tid = current_tid();
+		note.length = 0;
+		note.truncated = false;
+		note.encode(dropped);
+		write_record(note);
+	}
+
+	return count;
+}
+
+bool ring_empty()
+{
+	LogRing &r = ring();
+	const LogRecord &record = r.records[r.dequeue_pos & (RING_SIZE - 1)];
+	return record.seq.load(std::memory_order_seq_cst) != r.dequeue_pos + 1;
+}
+
+void writer_thread()
+{
+	for (;;) {
+		drain();
+
+		if (s_stop.load(std::memory_order_acquire)) {
+			drain();
+			break;
+		}
+
+		std::unique_lock<std::mutex> lock(s_mutex);
+		s_waiting.store(true, std::memory_order_seq_cst);
+		// Re-check after advertising that we are about to sleep so a
+		// producer that missed the flag cannot strand its record; the
+		// timeout is only a backstop.
+		if (ring_empty() && !s_stop.load(std::memory_order_acquire))
+			s_cv.wait_for(lock, std::chrono::milliseconds(100));
+		s_waiting.store(false, std::memory_order_relaxed);
+	}
+}
+
+} // namespace
+
+void Logger::start(const std::string &identifier)
+{
+	if (s_thread.joinable())
+		return;
+
+	if (!identifier.empty())
+		s_identifier = identifier;
+
+	// Keep interactive runs readable, and do not silently lose
+	// everything when there is no journald to talk to
+	s_use_stderr = isatty(STDERR_FILENO) ||
+		access("/run/systemd/journal/socket", W_OK) != 0;
+
+	// Construct the ring before registering the exit handler
+	ring();
+
+	s_stop.store(false);
+	s_thread = std::thread(writer_thread);
+
+	// Make sure messages logged right before an exit() still get out
+	static bool registered = false;
+	if (!registered) {
+		atexit(Logger::stop);
+		registered = true;
+	}
+}
+
+void Logger::stop()
+{
+	if (!s_thread.joinable())
+		return;
+
+	{
+		std::lock_guard<std::mutex> lock(s_mutex);
+		s_stop.store(true, std::memory_order_release);
+	}
+	s_cv.notify_one();
+	s_thread.join();
+}
+
+void Logger::setVerbose(unsigned level)
+{
+	unsigned old = s_verbose.exchange(level, std::memory_order_relaxed);
+	if (old != level)
+		info("Logger", "Verbose level changed from {} to {}", old, level);
+}
+
+// Private
+
+LogRecord *Logger::acquire()
+{
+	LogRing &r = ring();
+	size_t pos = r.enqueue_pos.load(std::memory_order_relaxed);
+	LogRecord *record;
+	for (;;) {
+		record = &r.records[pos & (RING_SIZE - 1)];
+		size_t seq = record->seq.load(std::memory_order_acquire);
+		intptr_t diff = (intptr_t) seq - (intptr_t) pos;
+		if (diff == 0) {
+			if (r.enqueue_pos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed))
+				break;
+		} else if (diff < 0) {
+			// Full, the writer has fallen behind
+			r.dropped.fetch_add(1, std::memory_order_relaxed);
+			return nullptr;
+		} else {
+			pos = r.enqueue_pos.load(std::memory_order_relaxed);
+		}
+	}
+
+	record->timestamp_usec = monotonic_usec();
+	record->tid = current_tid();
+	record->length = 0;
+	record->truncated = false;
+	return record;
+}
+
+void Logger::commit(LogRecord *record)
+{
+	// seq is still the claimed position, publishing makes it pos + 1
+	size_t pos = record->seq.load(std::memory_order_relaxed);
+	record->seq.store(pos + 1, std::memory_order_seq_cst);
+
+	if (s_waiting.load(std::memory_order_seq_cst))
+		s_cv.notify_one();
+}
@@ -0,0 +1,182 @@
+/*
+ * Copyright (C) 2023 Konsulko Group
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#ifndef _LOGGER_H
+#define _LOGGER_H
+
+#include <atomic>
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <type_traits>
+#include <syslog.h>
+
+// Binary log record as stored in the ring buffer.  Arguments are
+// encoded as tagged values and only formatted into text by the
+// background writer thread, so the hot path does no string formatting,
+// no allocation and no syscalls.
+
+class LogRecord
+{
+public:
+	enum ArgType : uint8_t {
+		ARG_INT = 1,
+		ARG_UINT,
+		ARG_DOUBLE,
+		ARG_BOOL,
+		ARG_STRING
+	};
+
+	static const size_t DATA_SIZE = 192;
+
+	std::atomic<size_t> seq;
+
+	int priority;
+	const char *subsystem;
+	const char *format;
+	uint64_t timestamp_usec;
+	uint32_t tid;
+	uint16_t length;
+	bool truncated;
+	uint8_t data[DATA_SIZE];
+
+	void encode() {}
+
+	template<typename T, typename... Rest>
+	void encode(const T &value, const Rest&... rest) {
+		put(value);
+		encode(rest...);
+	}
+
+private:
+	void put(bool value) {
+		uint8_t v = value ? 1 : 0;
+		append(ARG_BOOL, &v, sizeof(v));
+	}
+
+	void put(const char *value) {
+		put_string(value ? value : "(null)", value ? strlen(value) : 6);
+	}
+
+	void put(const std::string &value) {
+		put_string(value.data(), value.size());
+	}
+
+	template<typename T>
+	typename std::enable_if<std::is_integral<T>::value || std::is_enum<T>::value>::type
+	put(const T &value) {
+		if (std::is_signed<T>::value || std::is_enum<T>::value) {
+			int64_t v = (int64_t) value;
+			append(ARG_INT, &v, sizeof(v));
+		} else {
+			uint64_t v = (uint64_t) value;
+			append(ARG_UINT, &v, sizeof(v));
+		}
+	}
+
+	template<typename T>
+	typename std::enable_if<std::is_floating_point<T>::value>::type
+	put(const T &value) {
+		double v = value;
+		append(ARG_DOUBLE, &v, sizeof(v));
+	}
+
+	void put_string(const char *str, size_t len) {
+		// Clip to whatever is left after the tag and length
+		size_t avail = DATA_SIZE - length;
+		if (avail < 1 + sizeof(uint16_t)) {
+			truncated = true;
+			return;
+		}
+		avail -= 1 + sizeof(uint16_t);
+		if (len > avail) {
+			len = avail;
+			truncated = true;
+		}
+		uint16_t l = (uint16_t) len;
+		data[length++] = ARG_STRING;
+		memcpy(&data[length], &l, sizeof(l));
+		length += sizeof(l);
+		memcpy(&data[length], str, len);
+		length += len;
+	}
+
+	void append(ArgType type, const void *value, size_t size) {
+		if (length + 1 + size > DATA_SIZE) {
+			truncated = true;
+			return;
+		}
+		data[length++] = type;
+		memcpy(&data[length], value, size);
+		length += size;
+	}
+};
+
+// Asynchronous structured logger
+//
+// Messages use "{}" placeholders that are replaced in order by the
+// arguments, e.g.:
+//
+//	Logger::info("HvacCanHelper", "Write to {} failed!", m_port);
+//
+// Records are appended to a lock-free ring buffer and written out to
+// journald by a background thread with PRIORITY, HVAC_SUBSYSTEM, TID and
+// monotonic timestamp fields.  If the ring is full the record is dropped
+// and counted rather than blocking the caller.
+
+class Logger
+{
+public:
+	// Start the writer thread; records logged before this are buffered
+	static void start(const std::string &identifier);
+
+	// Drain outstanding records and stop the writer thread
+	static void stop();
+
+	static unsigned verbose() { return s_verbose.load(std::memory_order_relaxed); };
+	static void setVerbose(unsigned level);
+
+	template<typename... Args>
+	static void log(int priority, const char *subsystem, const char *format, const Args&... args) {
+		LogRecord *record = acquire();
+		if (!record)
+			return;
+		record->priority = priority;
+		record->subsystem = subsystem;
+		record->format = format;
+		record->encode(args...);
+		commit(record);
+	}
+
+	template<typename... Args>
+	static void error(const char *subsystem, const char *format, const Args&... args) {
+		log(LOG_ERR, subsystem, format, args...);
+	}
+
+	template<typename... Args>
+	static void warning(const char *subsystem, const char *format, const Args&... args) {
+		log(LOG_WARNING, subsystem, format, args...);
+	}
+
+	template<typename... Args>
+	static void info(const char *subsystem, const char *format, const Args&... args) {
+		log(LOG_INFO, subsystem, format, args...);
+	}
+
+	template<typename... Args>
+	static void debug(const char *subsystem, const char *format, const Args&... args) {
+		log(LOG_DEBUG, subsystem, format, args...);
+	}
+
+private:
+	static std::atomic<unsigned> s_verbose;
+
+	static LogRecord *acquire();
+
+	static void commit(LogRecord *record);
+};
+
+#endif // _LOGGER_H
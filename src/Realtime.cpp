@@ -0,0 +1,58 @@
+/*
+ * Copyright (C) 2023 Konsulko Group
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#include <cerrno>
+#include <cstring>
+#include <pthread.h>
+#include <sched.h>
+#include <sys/mman.h>
+
+#include "Realtime.h"
+#include "Logger.h"
+
+bool Realtime::apply(const HvacConfig::Sched &sched, const std::string &name)
+{
+	bool result = true;
+
+	if (!sched.cpus.empty()) {
+		cpu_set_t set;
+		CPU_ZERO(&set);
+		for (auto it = sched.cpus.cbegin(); it != sched.cpus.cend(); ++it)
+			CPU_SET(*it, &set);
+		int rc = pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+		if (rc) {
+			Logger::warning("Realtime", "Could not set {} CPU affinity: {}", name, strerror(rc));
+			result = false;
+		}
+	}
+
+	if (sched.priority) {
+		struct sched_param param = {};
+		param.sched_priority = sched.priority;
+		int rc = pthread_setschedparam(pthread_self(), SCHED_FIFO, &param);
+		if (rc) {
+			Logger::warning("Realtime", "Could not set {} SCHED_FIFO priority {}: {}",
+					name, sched.priority, strerror(rc));
+			result = false;
+		}
+	}
+
+	if (result && Logger::verbose())
+		Logger::info("Realtime", "Applied {} scheduling (priority {}, {} CPU(s))",
+			     name, sched.priority, sched.cpus.size());
+
+	return result;
+}
+
+bool Realtime::lockMemory()
+{
+	if (mlockall(MCL_CURRENT | MCL_FUTURE) < 0) {
+		Logger::warning("Realtime", "Could not lock memory: {}", strerror(errno));
+		return false;
+	}
+
+	return true;
+}
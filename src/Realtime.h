@@ -0,0 +1,31 @@
+/*
+ * Copyright (C) 2023 Konsulko Group
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#ifndef _REALTIME_H
+#define _REALTIME_H
+
+#include <string>
+
+#include "HvacConfig.h"
+
+// Thread scheduling and memory locking helpers
+//
+// Failures (typically missing CAP_SYS_NICE / CAP_IPC_LOCK) are logged and
+// otherwise ignored.
+
+class Realtime
+{
+public:
+	// Apply CPU affinity and SCHED_FIFO priority to the calling thread;
+	// threads it creates afterwards inherit both.
+	static bool apply(const HvacConfig::Sched &sched, const std::string &name);
+
+	// Lock current and future mappings so the steady state does not
+	// page fault
+	static bool lockMemory();
+};
+
+#endif // _REALTIME_H
@@ -0,0 +1,274 @@
+/*
+ * Copyright (C) 2023 Konsulko Group
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#include <ctime>
+#include <climits>
+#include <algorithm>
+
+#include "SignalDispatcher.h"
+#include "Logger.h"
+
+// Updates queued per high lane signal before the newest is overwritten
+#define HIGH_LANE_DEPTH 4
+
+SignalDispatcher::SignalDispatcher(EventLoop *loop, unsigned report_interval) :
+	m_loop(loop),
+	m_report_source(0),
+	m_high_head(0),
+	m_high_count(0),
+	m_scheduled(false),
+	m_received(0)
+{
+	if (m_loop && report_interval) {
+		m_report_source = m_loop->addTimeout(report_interval * 1000, [this]() {
+			if (Logger::verbose()) {
+				report();
+			} else {
+				const std::lock_guard<std::mutex> lock(m_mutex);
+				for (unsigned i = 0; i < LANES; i++)
+					m_stats[i] = LaneStats();
+			}
+			return true;
+		});
+	}
+}
+
+SignalDispatcher::~SignalDispatcher()
+{
+	if (m_loop)
+		m_loop->remove(m_report_source);
+}
+
+void SignalDispatcher::add(const std::string &path, Lane lane, SignalHandler handler, bool actuator)
+{
+	Entry &signal = m_signals[path];
+	signal.lane = lane;
+	signal.handler = handler;
+	signal.actuator = actuator;
+	signal.queued = 0;
+
+	// At most one pending update per normal signal and a few per high
+	// one, so neither lane ever needs to grow
+	m_normal.reserve(m_signals.size());
+	size_t high = std::count_if(m_signals.cbegin(), m_signals.cend(), [](const auto &it) {
+		return it.second.lane == HIGH;
+	});
+	m_high.resize(high * HIGH_LANE_DEPTH);
+}
+
+std::map<std::string, bool> SignalDispatcher::signals() const
+{
+	std::map<std::string, bool> signals;
+	for (auto it = m_signals.cbegin(); it != m_signals.cend(); ++it)
+		signals[it->first] = it->second.actuator;
+	return signals;
+}
+
+bool SignalDispatcher::dispatch(const std::string &path, const kuksa::val::v1::Datapoint &dp)
+{
+	auto it = m_signals.find(path);
+	if (it == m_signals.end())
+		return false;
+	Entry *signal = &it->second;
+	uint64_t now = now_ns();
+
+	bool schedule = false;
+	{
+		const std::lock_guard<std::mutex> lock(m_mutex);
+		if (signal->lane == HIGH && signal->queued == HIGH_LANE_DEPTH) {
+			// Replace the newest update of the signal, keeping its
+			// place in the queue
+			for (size_t i = m_high_count; i-- > 0;) {
+				Pending &pending = m_high[(m_high_head + i) % m_high.size()];
+				if (pending.signal == signal) {
+					copyValue(dp, pending.dp);
+					break;
+				}
+			}
+			m_stats[HIGH].coalesced++;
+		} else if (signal->lane == HIGH) {
+			Pending &pending = m_high[(m_high_head + m_high_count) % m_high.size()];
+			pending.signal = signal;
+			copyValue(dp, pending.dp);
+			pending.queued = now;
+			m_high_count++;
+			signal->queued++;
+		} else {
+			// Keeps the time of the oldest update it replaces
+			auto pending = std::find_if(m_normal.begin(), m_normal.end(), [signal](const Pending &p) {
+				return p.signal == signal;
+			});
+			if (pending != m_normal.end()) {
+				copyValue(dp, pending->dp);
+				m_stats[NORMAL].coalesced++;
+			} else {
+				m_normal.emplace_back();
+				Pending &added = m_normal.back();
+				added.signal = signal;
+				copyValue(dp, added.dp);
+				added.queued = now;
+			}
+		}
+		if (!m_scheduled)
+			m_scheduled = schedule = true;
+	}
+
+	if (schedule)
+		m_loop->post([this]() { run(); });
+
+	return true;
+}
+
+bool SignalDispatcher::handle(const std::string &path, const kuksa::val::v1::Datapoint &dp)
+{
+	auto it = m_signals.find(path);
+	if (it == m_signals.end())
+		return false;
+
+	m_received = now_ns();
+	it->second.handler(dp);
+	m_received = 0;
+	return true;
+}
+
+void SignalDispatcher::flush()
+{
+	drain(UINT_MAX);
+}
+
+SignalDispatcher::LaneStats SignalDispatcher::stats(Lane lane)
+{
+	const std::lock_guard<std::mutex> lock(m_mutex);
+	return m_stats[lane];
+}
+
+void SignalDispatcher::report()
+{
+	LaneStats stats[LANES];
+	{
+		const std::lock_guard<std::mutex> lock(m_mutex);
+		for (unsigned i = 0; i < LANES; i++) {
+			stats[i] = m_stats[i];
+			m_stats[i] = LaneStats();
+		}
+	}
+
+	for (unsigned i = 0; i < LANES; i++) {
+		if (!stats[i].count)
+			continue;
+		Logger::info("SignalDispatcher", "{} lane: {} updates ({} coalesced), latency avg {} us, max {} us",
+			     laneName((Lane) i),
+			     stats[i].count,
+			     stats[i].coalesced,
+			     stats[i].total_ns / stats[i].count / 1000,
+			     stats[i].max_ns / 1000);
+	}
+}
+
+const char *SignalDispatcher::laneName(Lane lane)
+{
+	switch (lane) {
+	case HIGH:
+		return "high";
+	case NORMAL:
+		return "normal";
+	default:
+		return "unknown";
+	}
+}
+
+// Private
+
+uint64_t SignalDispatcher::now_ns()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+void SignalDispatcher::copyValue(const kuksa::val::v1::Datapoint &from, kuksa::val::v1::Datapoint &to)
+{
+	using kuksa::val::v1::Datapoint;
+
+	// Scalars are set directly, which also leaves out the timestamp
+	switch (from.value_case()) {
+	case Datapoint::kBool:
+		to.set_bool_(from.bool_());
+		break;
+	case Datapoint::kInt32:
+		to.set_int32(from.int32());
+		break;
+	case Datapoint::kInt64:
+		to.set_int64(from.int64());
+		break;
+	case Datapoint::kUint32:
+		to.set_uint32(from.uint32());
+		break;
+	case Datapoint::kUint64:
+		to.set_uint64(from.uint64());
+		break;
+	case Datapoint::kFloat:
+		to.set_float_(from.float_());
+		break;
+	case Datapoint::kDouble:
+		to.set_double_(from.double_());
+		break;
+	case Datapoint::VALUE_NOT_SET:
+		to.clear_value();
+		break;
+	default:
+		to = from;
+		to.clear_timestamp();
+		break;
+	}
+}
+
+void SignalDispatcher::run()
+{
+	// Give the loop's other sources a look in between passes if the
+	// normal lane is kept busy
+	if (drain(m_signals.size()))
+		m_loop->post([this]() { run(); });
+}
+
+bool SignalDispatcher::drain(unsigned max_normal)
+{
+	unsigned normal = 0;
+	for (;;) {
+		Pending pending;
+		{
+			const std::lock_guard<std::mutex> lock(m_mutex);
+
+			// The high lane goes first, including whatever arrived
+			// while the previous handler ran
+			if (m_high_count) {
+				pending = m_high[m_high_head];
+				m_high_head = (m_high_head + 1) % m_high.size();
+				m_high_count--;
+				pending.signal->queued--;
+			} else if (!m_normal.empty() && normal < max_normal) {
+				pending = m_normal.front();
+				m_normal.erase(m_normal.begin());
+				normal++;
+			} else {
+				// Still scheduled if there is more to do
+				m_scheduled = !m_normal.empty();
+				return m_scheduled;
+			}
+		}
+
+		m_received = pending.queued;
+		pending.signal->handler(pending.dp);
+		m_received = 0;
+
+		uint64_t latency = now_ns() - pending.queued;
+		const std::lock_guard<std::mutex> lock(m_mutex);
+		LaneStats &stats = m_stats[pending.signal->lane];
+		stats.count++;
+		stats.total_ns += latency;
+		stats.max_ns = std::max(stats.max_ns, latency);
+	}
+}
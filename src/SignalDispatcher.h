@@ -0,0 +1,139 @@
+/*
+ * Copyright (C) 2023 Konsulko Group
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#ifndef _SIGNAL_DISPATCHER_H
+#define _SIGNAL_DISPATCHER_H
+
+#include <string>
+#include <vector>
+#include <map>
+#include <mutex>
+#include <functional>
+#include <cstdint>
+
+#include "EventLoop.h"
+#include "KuksaSignal.h"
+#include "kuksa/val/v1/types.pb.h"
+
+typedef std::function<void(const kuksa::val::v1::Datapoint &dp)> SignalHandler;
+
+// Registry of the handled signals and the queues between the broker
+// subscription and their handlers
+//
+// Every signal belongs to a priority lane.  The high lane is a FIFO that
+// is always emptied first, so e.g. a defroster request is never held up
+// by a flood of temperature slider updates.  It keeps a few updates per
+// signal so toggles are seen in order; beyond that the newest one queued
+// for the signal is replaced (and counted as coalesced), so a flood of
+// toggles cannot make it grow.  The normal lane only
+// keeps the latest value of each signal, a burst of updates to one
+// signal collapses into a single handler call.  Handlers run on the loop
+// thread, queueing can happen from any thread.
+//
+// Once the queues have grown to their working size, dispatching does not
+// allocate; only the value of an update is queued, not its timestamp.
+
+class SignalDispatcher
+{
+public:
+	enum Lane {
+		HIGH = 0,
+		NORMAL,
+		LANES
+	};
+
+	// Queue latency (received to handler done) since the last report
+	struct LaneStats {
+		uint64_t count = 0;
+		uint64_t coalesced = 0;
+		uint64_t total_ns = 0;
+		uint64_t max_ns = 0;
+	};
+
+	// A report is logged every report_interval seconds when running
+	// verbose, 0 disables it
+	SignalDispatcher(EventLoop *loop, unsigned report_interval = 60);
+
+	~SignalDispatcher();
+
+	// Set up before anything is dispatched.  Actuators are subscribed to
+	// by target value, other signals by current value.
+	void add(const std::string &path, Lane lane, SignalHandler handler, bool actuator = true);
+
+	// Typed handler for a signal declared with Signal<>, only called
+	// with values of the right type and in range
+	template<class S>
+	void add(Lane lane, std::function<void(typename S::Type value)> handler) {
+		add(S::path(), lane,
+		    [handler](const kuksa::val::v1::Datapoint &dp) {
+			    typename S::Type value;
+			    if (S::decode(dp, value))
+				    handler(value);
+		    },
+		    S::actuator);
+	};
+
+	// Path to actuator flag, as taken by KuksaClient::subscribe()
+	std::map<std::string, bool> signals() const;
+
+	// Queue an update, returns false for signals that are not handled
+	bool dispatch(const std::string &path, const kuksa::val::v1::Datapoint &dp);
+
+	// Run the handler right away, on the loop thread
+	bool handle(const std::string &path, const kuksa::val::v1::Datapoint &dp);
+
+	// Handle everything queued so far, on the loop thread
+	void flush();
+
+	// While a handler runs: when its update came in (CLOCK_MONOTONIC
+	// ns), 0 otherwise
+	uint64_t received() const { return m_received; };
+
+	LaneStats stats(Lane lane);
+
+	// Log and reset the per-lane statistics
+	void report();
+
+	static const char *laneName(Lane lane);
+
+private:
+	struct Entry {
+		Lane lane;
+		SignalHandler handler;
+		bool actuator;
+		unsigned queued;	// in the high lane
+	};
+
+	struct Pending {
+		Entry *signal;
+		kuksa::val::v1::Datapoint dp;
+		uint64_t queued;
+	};
+
+	static uint64_t now_ns();
+
+	static void copyValue(const kuksa::val::v1::Datapoint &from, kuksa::val::v1::Datapoint &to);
+
+	void run();
+
+	// Returns false once the queues are empty
+	bool drain(unsigned max_normal);
+
+	EventLoop *m_loop;
+	unsigned m_report_source;
+	std::map<std::string, Entry> m_signals;
+
+	std::mutex m_mutex;
+	std::vector<Pending> m_high;		// ring buffer, sized by add()
+	size_t m_high_head;
+	size_t m_high_count;
+	std::vector<Pending> m_normal;		// in order of first arrival
+	bool m_scheduled;
+	LaneStats m_stats[LANES];
+	uint64_t m_received;
+};
+
+#endif // _SIGNAL_DISPATCHER_H
@@ -0,0 +1,143 @@
+/*
+ * Copyright (C) 2023 Konsulko Group
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#include <ctime>
+#include <cerrno>
+#include <cstring>
+#include <unistd.h>
+#include <fcntl.h>
+
+#include "SubscribeRecorder.h"
+#include "Logger.h"
+
+#define RECORDING_MAGIC "HVACREC1"
+#define RECORDING_MAGIC_SIZE 8
+
+// Well above gRPC's default 4 MB message limit, anything larger is garbage
+#define RECORD_MAX_SIZE (16 * 1024 * 1024)
+
+struct RecordHeader {
+	uint32_t length;
+	uint64_t timestamp;
+} __attribute__((packed));
+
+SubscribeRecorder::SubscribeRecorder(const std::string &path) :
+	m_path(path),
+	m_fd(-1),
+	m_count(0)
+{
+	m_fd = open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+	if (m_fd < 0) {
+		Logger::error("SubscribeRecorder", "Could not open {}: {}", path, strerror(errno));
+		return;
+	}
+
+	if (write(m_fd, RECORDING_MAGIC, RECORDING_MAGIC_SIZE) != RECORDING_MAGIC_SIZE) {
+		Logger::error("SubscribeRecorder", "Could not write {}", path);
+		close(m_fd);
+		m_fd = -1;
+		return;
+	}
+
+	Logger::info("SubscribeRecorder", "Recording subscribe stream to {}", path);
+}
+
+SubscribeRecorder::~SubscribeRecorder()
+{
+	if (m_fd < 0)
+		return;
+
+	close(m_fd);
+	Logger::info("SubscribeRecorder", "Recorded {} responses to {}", m_count, m_path);
+}
+
+void SubscribeRecorder::record(const kuksa::val::v1::SubscribeResponse &response)
+{
+	if (m_fd < 0)
+		return;
+
+	uint64_t timestamp = now_ns();
+
+	const std::lock_guard<std::mutex> lock(m_mutex);
+
+	// Header and message in one buffer (reused, so no allocation once
+	// it has grown to the largest response) and one write
+	size_t size = response.ByteSizeLong();
+	m_buffer.resize(sizeof(RecordHeader) + size);
+	RecordHeader header;
+	header.length = (uint32_t) size;
+	header.timestamp = timestamp;
+	memcpy(&m_buffer[0], &header, sizeof(header));
+	response.SerializeWithCachedSizesToArray((uint8_t*) &m_buffer[sizeof(header)]);
+
+	ssize_t rc = write(m_fd, m_buffer.data(), m_buffer.size());
+	if (rc != (ssize_t) m_buffer.size()) {
+		// Stop rather than leave a hole in the middle of the recording
+		Logger::error("SubscribeRecorder", "Could not write {}, recording stopped", m_path);
+		close(m_fd);
+		m_fd = -1;
+		return;
+	}
+	m_count++;
+}
+
+uint64_t SubscribeRecorder::now_ns()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+SubscribeRecording::SubscribeRecording(const std::string &path) :
+	m_file(NULL)
+{
+	m_file = fopen(path.c_str(), "rbe");
+	if (!m_file) {
+		Logger::error("SubscribeRecording", "Could not open {}: {}", path, strerror(errno));
+		return;
+	}
+
+	char magic[RECORDING_MAGIC_SIZE];
+	if (fread(magic, 1, sizeof(magic), m_file) != sizeof(magic) ||
+	    memcmp(magic, RECORDING_MAGIC, RECORDING_MAGIC_SIZE) != 0) {
+		Logger::error("SubscribeRecording", "{} is not a subscribe recording", path);
+		fclose(m_file);
+		m_file = NULL;
+	}
+}
+
+SubscribeRecording::~SubscribeRecording()
+{
+	if (m_file)
+		fclose(m_file);
+}
+
+bool SubscribeRecording::next(uint64_t &timestamp, kuksa::val::v1::SubscribeResponse &response)
+{
+	if (!m_file)
+		return false;
+
+	RecordHeader header;
+	if (fread(&header, 1, sizeof(header), m_file) != sizeof(header))
+		return false;
+	if (header.length > RECORD_MAX_SIZE) {
+		Logger::warning("SubscribeRecording", "Record of {} bytes, recording damaged", header.length);
+		return false;
+	}
+
+	m_buffer.resize(header.length);
+	if (header.length && fread(&m_buffer[0], 1, header.length, m_file) != header.length) {
+		Logger::warning("SubscribeRecording", "Recording ends with a partial record");
+		return false;
+	}
+	if (!response.ParseFromArray(m_buffer.data(), (int) m_buffer.size())) {
+		Logger::warning("SubscribeRecording", "Could not parse record, recording damaged");
+		return false;
+	}
+
+	timestamp = header.timestamp;
+	return true;
+}
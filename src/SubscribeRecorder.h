@@ -0,0 +1,70 @@
+/*
+ * Copyright (C) 2023 Konsulko Group
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#ifndef _SUBSCRIBE_RECORDER_H
+#define _SUBSCRIBE_RECORDER_H
+
+#include <cstdint>
+#include <cstdio>
+#include <string>
+#include <mutex>
+#include "kuksa/val/v1/val.pb.h"
+
+// Recording of the raw databroker subscribe stream, for replaying field
+// traffic without a broker (see replay.cpp)
+//
+// The file starts with the 8 byte magic "HVACREC1", followed by one
+// record per SubscribeResponse:
+//
+//   uint32_t length	serialized message size
+//   uint64_t timestamp	CLOCK_MONOTONIC receive time in ns
+//   uint8_t  data[length]
+//
+// in host byte order.  Each record goes out in a single write(), so a
+// recording cut short by a crash ends with at most one partial record,
+// which the reader drops.
+
+class SubscribeRecorder
+{
+public:
+	explicit SubscribeRecorder(const std::string &path);
+
+	~SubscribeRecorder();
+
+	bool valid() { return m_fd >= 0; };
+
+	// Safe to call from gRPC's threads
+	void record(const kuksa::val::v1::SubscribeResponse &response);
+
+	static uint64_t now_ns();
+
+private:
+	std::string m_path;
+	int m_fd;
+	uint64_t m_count;
+
+	std::mutex m_mutex;
+	std::string m_buffer;
+};
+
+class SubscribeRecording
+{
+public:
+	explicit SubscribeRecording(const std::string &path);
+
+	~SubscribeRecording();
+
+	bool valid() { return m_file != NULL; };
+
+	// Returns false at the end of the recording or on a damaged record
+	bool next(uint64_t &timestamp, kuksa::val::v1::SubscribeResponse &response);
+
+private:
+	FILE *m_file;
+	std::string m_buffer;
+};
+
+#endif // _SUBSCRIBE_RECORDER_H
@@ -0,0 +1,257 @@
+/*
+ * Copyright (C) 2023 Konsulko Group
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#include <ctime>
+#include <cerrno>
+#include <cstring>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/ioctl.h>
+#include <net/if.h>
+#include <netinet/in.h>
+#include <linux/errqueue.h>
+#include <linux/net_tstamp.h>
+#include <linux/sockios.h>
+#include <linux/can.h>
+#include <linux/can/raw.h>
+
+#include "TxTimestamper.h"
+#include "Logger.h"
+
+// Packets waiting for a timestamp; beyond that the oldest one is given
+// up on
+#define MAX_PENDING 64
+
+namespace {
+
+// The error queue message carrying the timestamp, per protocol
+bool is_extended_err(const struct cmsghdr *cmsg)
+{
+	return (cmsg->cmsg_level == SOL_CAN_RAW && cmsg->cmsg_type == SCM_CAN_RAW_ERRQUEUE) ||
+		(cmsg->cmsg_level == SOL_IP && cmsg->cmsg_type == IP_RECVERR) ||
+		(cmsg->cmsg_level == SOL_IPV6 && cmsg->cmsg_type == IPV6_RECVERR);
+}
+
+uint64_t timespec_ns(int64_t sec, int64_t nsec)
+{
+	return (uint64_t) sec * 1000000000 + nsec;
+}
+
+} // namespace
+
+bool TxTimestamper::parseMode(const std::string &value, Mode &mode)
+{
+	if (value == "off")
+		mode = OFF;
+	else if (value == "software")
+		mode = SOFTWARE;
+	else if (value == "hardware")
+		mode = HARDWARE;
+	else
+		return false;
+	return true;
+}
+
+TxTimestamper::TxTimestamper(EventLoop *loop, unsigned report_interval) :
+	m_loop(loop),
+	m_report_interval(report_interval),
+	m_report_source(0),
+	m_source(0),
+	m_fd(-1),
+	m_mode(OFF),
+	m_packets(MAX_PENDING),
+	m_head(0),
+	m_count(0),
+	m_lost(0)
+{
+}
+
+TxTimestamper::~TxTimestamper()
+{
+	stop();
+}
+
+bool TxTimestamper::start(int fd, Mode mode, const std::string &ifname)
+{
+	stop();
+	if (mode == OFF || !m_loop)
+		return false;
+	m_name = ifname;
+
+	if (mode == HARDWARE) {
+		struct hwtstamp_config hwconfig;
+		memset(&hwconfig, 0, sizeof(hwconfig));
+		hwconfig.tx_type = HWTSTAMP_TX_ON;
+		hwconfig.rx_filter = HWTSTAMP_FILTER_NONE;
+
+		struct ifreq ifr;
+		memset(&ifr, 0, sizeof(ifr));
+		strncpy(ifr.ifr_name, ifname.c_str(), IFNAMSIZ - 1);
+		ifr.ifr_data = (char*) &hwconfig;
+		if (ioctl(fd, SIOCSHWTSTAMP, &ifr) < 0) {
+			Logger::warning("TxTimestamper", "{}: no hardware timestamps ({}), using software ones",
+					m_name, strerror(errno));
+			mode = SOFTWARE;
+		}
+	}
+
+	// Only the timestamp comes back, not the packet
+	int flags = SOF_TIMESTAMPING_OPT_TSONLY;
+	if (mode == HARDWARE)
+		flags |= SOF_TIMESTAMPING_TX_HARDWARE | SOF_TIMESTAMPING_RAW_HARDWARE;
+	else
+		flags |= SOF_TIMESTAMPING_TX_SOFTWARE | SOF_TIMESTAMPING_SOFTWARE;
+	if (setsockopt(fd, SOL_SOCKET, SO_TIMESTAMPING, &flags, sizeof(flags)) < 0) {
+		Logger::warning("TxTimestamper", "{}: could not enable timestamping: {}", m_name, strerror(errno));
+		return false;
+	}
+
+	// The socket itself may be watched for writability at the same
+	// time, which epoll does not allow twice for one fd
+	m_fd = dup(fd);
+	if (m_fd < 0) {
+		Logger::warning("TxTimestamper", "{}: could not dup socket: {}", m_name, strerror(errno));
+		return false;
+	}
+	m_source = m_loop->addFd(m_fd, EventLoop::ERR, [this](uint32_t events) {
+		drain();
+		return true;
+	});
+	if (m_report_interval) {
+		m_report_source = m_loop->addTimeout(m_report_interval * 1000, [this]() {
+			report();
+			return true;
+		});
+	}
+
+	m_mode = mode;
+	Logger::info("TxTimestamper", "{}: {} transmit timestamps enabled", m_name,
+		     mode == HARDWARE ? "hardware" : "software");
+	return true;
+}
+
+void TxTimestamper::stop()
+{
+	if (m_source) {
+		m_loop->remove(m_source);
+		m_source = 0;
+	}
+	if (m_report_source) {
+		m_loop->remove(m_report_source);
+		m_report_source = 0;
+	}
+	if (m_fd >= 0) {
+		close(m_fd);
+		m_fd = -1;
+	}
+	m_mode = OFF;
+	m_count = 0;
+}
+
+void TxTimestamper::sent(uint64_t send_ns, uint64_t received_ns)
+{
+	if (m_mode == OFF)
+		return;
+
+	if (m_count == m_packets.size()) {
+		m_head = (m_head + 1) % m_packets.size();
+		m_count--;
+		m_lost++;
+	}
+	Packet &packet = m_packets[(m_head + m_count) % m_packets.size()];
+	packet.sent_ns = send_ns;
+	packet.received_ns = received_ns;
+	m_count++;
+}
+
+void TxTimestamper::report()
+{
+	if (m_queue.count) {
+		Logger::info("TxTimestamper", "{}: send to wire: {} frames, avg {} us, max {} us ({})",
+			     m_name, m_queue.count,
+			     m_queue.total_ns / m_queue.count / 1000,
+			     m_queue.max_ns / 1000,
+			     m_queue.format());
+	}
+	if (m_total.count) {
+		Logger::info("TxTimestamper", "{}: update to wire: {} frames, avg {} us, max {} us ({})",
+			     m_name, m_total.count,
+			     m_total.total_ns / m_total.count / 1000,
+			     m_total.max_ns / 1000,
+			     m_total.format());
+	}
+	if (m_lost)
+		Logger::warning("TxTimestamper", "{}: {} frames without timestamp", m_name, m_lost);
+
+	m_queue = LatencyHistogram();
+	m_total = LatencyHistogram();
+	m_lost = 0;
+}
+
+// Private
+
+uint64_t TxTimestamper::now_ns(clockid_t clock)
+{
+	struct timespec ts;
+	clock_gettime(clock, &ts);
+	return timespec_ns(ts.tv_sec, ts.tv_nsec);
+}
+
+void TxTimestamper::drain()
+{
+	// Timestamps are on the system clock, the packets on the monotonic
+	int64_t offset = (int64_t) (now_ns(CLOCK_REALTIME) - now_ns(CLOCK_MONOTONIC));
+
+	for (;;) {
+		char data[64];
+		struct iovec iov = { data, sizeof(data) };
+		char control[512];
+		struct msghdr msg;
+		memset(&msg, 0, sizeof(msg));
+		msg.msg_iov = &iov;
+		msg.msg_iovlen = 1;
+		msg.msg_control = control;
+		msg.msg_controllen = sizeof(control);
+		if (recvmsg(m_fd, &msg, MSG_ERRQUEUE | MSG_DONTWAIT) < 0)
+			break;
+
+		uint64_t stamp = 0;
+		bool tx_done = false;
+		for (struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg); cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+			if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SO_TIMESTAMPING_OLD) {
+				struct scm_timestamping ts;
+				memcpy(&ts, CMSG_DATA(cmsg), sizeof(ts));
+				int i = m_mode == HARDWARE ? 2 : 0;
+				stamp = timespec_ns(ts.ts[i].tv_sec, ts.ts[i].tv_nsec);
+#ifdef SO_TIMESTAMPING_NEW
+			} else if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SO_TIMESTAMPING_NEW) {
+				struct scm_timestamping64 ts;
+				memcpy(&ts, CMSG_DATA(cmsg), sizeof(ts));
+				int i = m_mode == HARDWARE ? 2 : 0;
+				stamp = timespec_ns(ts.ts[i].tv_sec, ts.ts[i].tv_nsec);
+#endif
+			} else if (is_extended_err(cmsg)) {
+				struct sock_extended_err err;
+				memcpy(&err, CMSG_DATA(cmsg), sizeof(err));
+				tx_done = err.ee_origin == SO_EE_ORIGIN_TIMESTAMPING &&
+					err.ee_info == SCM_TSTAMP_SND;
+			}
+		}
+		if (!(tx_done && stamp && m_count))
+			continue;
+
+		Packet packet = m_packets[m_head];
+		m_head = (m_head + 1) % m_packets.size();
+		m_count--;
+
+		uint64_t wire = stamp - offset;
+		if (wire < packet.sent_ns)
+			continue;
+		m_queue.add(wire - packet.sent_ns);
+		if (packet.received_ns && wire >= packet.received_ns)
+			m_total.add(wire - packet.received_ns);
+	}
+}
@@ -0,0 +1,97 @@
+/*
+ * Copyright (C) 2023 Konsulko Group
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#ifndef _TX_TIMESTAMPER_H
+#define _TX_TIMESTAMPER_H
+
+#include <cstdint>
+#include <ctime>
+#include <string>
+#include <vector>
+
+#include "EventLoop.h"
+#include "Watchdog.h"
+
+// Kernel transmit timestamps (SO_TIMESTAMPING) of a socket
+//
+// The kernel reports on its error queue when a packet was handed to the
+// device (software), or went out according to the device (hardware).
+// Those are matched first in, first out to the packets sent, which holds
+// for CAN where frames leave in order and each produces one timestamp,
+// and give two per-packet latency histograms: send() to wire, i.e. the
+// time spent in the qdisc and driver queue, and receipt of the update
+// that caused the packet to wire.  Both are logged every report_interval
+// seconds.
+//
+// Software timestamps work on any interface whose driver provides them
+// (vcan since Linux 6.1).  Hardware ones need driver support, and are
+// taken to be on the system clock as most CAN drivers keep it.  All
+// calls are made on the loop thread.
+
+class TxTimestamper
+{
+public:
+	enum Mode {
+		OFF = 0,
+		SOFTWARE,
+		HARDWARE
+	};
+
+	// "off", "software" or "hardware"
+	static bool parseMode(const std::string &value, Mode &mode);
+
+	explicit TxTimestamper(EventLoop *loop, unsigned report_interval = 60);
+
+	~TxTimestamper();
+
+	// Enable on a bound socket of interface ifname; hardware falls back
+	// to software if the device cannot do it
+	bool start(int fd, Mode mode, const std::string &ifname);
+
+	void stop();
+
+	bool enabled() const { return m_mode != OFF; };
+
+	// CLOCK_MONOTONIC in ns
+	static uint64_t now() { return now_ns(CLOCK_MONOTONIC); };
+
+	// After a packet went into the socket; send_ns is now() from right
+	// before the send call, as software timestamps are taken within it,
+	// received_ns when the update behind it came in, 0 if unknown
+	void sent(uint64_t send_ns, uint64_t received_ns);
+
+	// Log and reset the histograms
+	void report();
+
+private:
+	struct Packet {
+		uint64_t sent_ns;
+		uint64_t received_ns;
+	};
+
+	static uint64_t now_ns(clockid_t clock);
+
+	void drain();
+
+	EventLoop *m_loop;
+	std::string m_name;		// interface
+	unsigned m_report_interval;
+	unsigned m_report_source;
+	unsigned m_source;
+	int m_fd;			// dup of the socket, for the error queue watch
+	Mode m_mode;
+
+	// Sent and waiting for their timestamp, a ring buffer
+	std::vector<Packet> m_packets;
+	size_t m_head;
+	size_t m_count;
+	uint64_t m_lost;
+
+	LatencyHistogram m_queue;	// send() to wire
+	LatencyHistogram m_total;	// update received to wire
+};
+
+#endif // _TX_TIMESTAMPER_H
@@ -0,0 +1,297 @@
+/*
+ * Copyright (C) 2023 Konsulko Group
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#include <ctime>
+#include <csignal>
+#include <cstring>
+#include <algorithm>
+#include <unistd.h>
+#include <execinfo.h>
+#include <systemd/sd-daemon.h>
+
+#include "Watchdog.h"
+#include "Logger.h"
+
+#define STACK_DUMP_FRAMES	64
+
+//
+// LatencyHistogram
+//
+
+void LatencyHistogram::add(uint64_t ns)
+{
+	unsigned bucket = 0;
+	uint64_t limit = 100000;	// 100 us
+	while (bucket < BUCKETS - 1 && ns >= limit) {
+		bucket++;
+		limit *= 10;
+	}
+	counts[bucket]++;
+	count++;
+	total_ns += ns;
+	max_ns = std::max(max_ns, ns);
+}
+
+std::string LatencyHistogram::format() const
+{
+	static const char *names[BUCKETS] = { "<0.1ms", "<1ms", "<10ms", "<100ms", "<1s", ">=1s" };
+	std::string s;
+	for (unsigned i = 0; i < BUCKETS; i++) {
+		if (i)
+			s += ", ";
+		s += names[i];
+		s += " ";
+		s += std::to_string(counts[i]);
+	}
+	return s;
+}
+
+//
+// WatchdogProbe
+//
+
+WatchdogProbe::WatchdogProbe(const std::string &name) :
+	m_name(name),
+	m_since(0),
+	m_thread(0),
+	m_stalled(false)
+{
+}
+
+void WatchdogProbe::begin(pthread_t thread)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	const std::lock_guard<std::mutex> lock(m_mutex);
+	m_since = (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+	m_thread = thread;
+}
+
+void WatchdogProbe::end()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	uint64_t now = (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+
+	uint64_t duration;
+	bool stalled;
+	{
+		const std::lock_guard<std::mutex> lock(m_mutex);
+		if (!m_since)
+			return;
+		duration = now - m_since;
+		m_histogram.add(duration);
+		m_since = 0;
+		stalled = m_stalled;
+		m_stalled = false;
+	}
+
+	if (stalled)
+		Logger::info("Watchdog", "{} recovered after {} ms", m_name, duration / 1000000);
+}
+
+//
+// Watchdog
+//
+
+Watchdog::Watchdog(unsigned stall_ms, unsigned report_interval) :
+	m_stall_ns((uint64_t) stall_ms * 1000000),
+	m_ping_ns(0),
+	m_report_ns((uint64_t) report_interval * 1000000000),
+	m_quit(false)
+{
+	// Pinging at half the interval systemd expects
+	uint64_t usec = 0;
+	if (sd_watchdog_enabled(0, &usec) > 0 && usec) {
+		m_ping_ns = usec * 1000 / 2;
+		Logger::info("Watchdog", "Pinging systemd every {} ms", m_ping_ns / 1000000);
+		if (m_stall_ns >= usec * 1000)
+			Logger::warning("Watchdog", "Stall threshold of {} ms not below WatchdogSec", stall_ms);
+	}
+
+	if (!(m_stall_ns || m_ping_ns))
+		return;
+
+	if (m_stall_ns)
+		installStackDump();
+
+	m_thread = std::thread([this]() { run(); });
+}
+
+Watchdog::~Watchdog()
+{
+	{
+		const std::lock_guard<std::mutex> lock(m_mutex);
+		m_quit = true;
+	}
+	m_cond.notify_one();
+	if (m_thread.joinable())
+		m_thread.join();
+}
+
+std::shared_ptr<WatchdogProbe> Watchdog::add(const std::string &name)
+{
+	auto probe = std::make_shared<WatchdogProbe>(name);
+	const std::lock_guard<std::mutex> lock(m_mutex);
+	m_probes.push_back(probe);
+	return probe;
+}
+
+void Watchdog::addLoop(const std::string &name, EventLoop *loop, pthread_t thread)
+{
+	LoopProbe lp;
+	lp.loop = loop;
+	lp.thread = thread;
+	lp.probe = std::make_shared<WatchdogProbe>(name);
+
+	const std::lock_guard<std::mutex> lock(m_mutex);
+	m_probes.push_back(lp.probe);
+	m_loops.push_back(lp);
+}
+
+void Watchdog::report()
+{
+	std::vector<std::shared_ptr<WatchdogProbe>> probes;
+	{
+		const std::lock_guard<std::mutex> lock(m_mutex);
+		probes = m_probes;
+	}
+
+	for (auto it = probes.begin(); it != probes.end(); ++it) {
+		LatencyHistogram histogram;
+		{
+			const std::lock_guard<std::mutex> lock((*it)->m_mutex);
+			histogram = (*it)->m_histogram;
+			(*it)->m_histogram = LatencyHistogram();
+		}
+		if (!histogram.count)
+			continue;
+		Logger::info("Watchdog", "{}: {} samples, avg {} us, max {} us ({})",
+			     (*it)->name(),
+			     histogram.count,
+			     histogram.total_ns / histogram.count / 1000,
+			     histogram.max_ns / 1000,
+			     histogram.format());
+	}
+}
+
+// Private
+
+uint64_t Watchdog::now_ns()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+void Watchdog::installStackDump()
+{
+	static std::once_flag once;
+	std::call_once(once, []() {
+		// The first backtrace() call loads libgcc, which is not
+		// something to do in a signal handler
+		void *frames[1];
+		backtrace(frames, 1);
+
+		struct sigaction sa;
+		memset(&sa, 0, sizeof(sa));
+		sa.sa_handler = [](int signo) {
+			static const char header[] = "Watchdog: stack of stalled thread:\n";
+			void *frames[STACK_DUMP_FRAMES];
+			int count = backtrace(frames, STACK_DUMP_FRAMES);
+			if (write(STDERR_FILENO, header, sizeof(header) - 1) < 0)
+				return;
+			backtrace_symbols_fd(frames, count, STDERR_FILENO);
+		};
+		sigemptyset(&sa.sa_mask);
+		sa.sa_flags = SA_RESTART;
+		sigaction(STACK_DUMP_SIGNAL, &sa, NULL);
+	});
+}
+
+void Watchdog::run()
+{
+	uint64_t tick = m_stall_ns ? m_stall_ns / 4 : m_ping_ns;
+	if (m_ping_ns)
+		tick = std::min(tick, m_ping_ns / 2);
+
+	uint64_t next_ping = 0;
+	uint64_t next_report = now_ns() + m_report_ns;
+	std::unique_lock<std::mutex> lock(m_mutex);
+	while (!m_quit) {
+		// Posted again once the previous one has been handled,
+		// so a stuck loop holds one probe rather than a pile
+		std::vector<LoopProbe> loops = m_loops;
+		lock.unlock();
+
+		for (auto it = loops.begin(); it != loops.end(); ++it) {
+			bool idle;
+			{
+				const std::lock_guard<std::mutex> probe_lock(it->probe->m_mutex);
+				idle = !it->probe->m_since;
+			}
+			if (idle && m_stall_ns) {
+				std::shared_ptr<WatchdogProbe> probe = it->probe;
+				probe->begin(it->thread);
+				it->loop->post([probe]() { probe->end(); });
+			}
+		}
+
+		uint64_t now = now_ns();
+		bool healthy = check(now);
+		if (m_ping_ns && healthy && now >= next_ping) {
+			sd_notify(0, "WATCHDOG=1");
+			next_ping = now + m_ping_ns;
+		}
+		if (m_report_ns && now >= next_report) {
+			if (Logger::verbose())
+				report();
+			next_report = now + m_report_ns;
+		}
+
+		lock.lock();
+		m_cond.wait_for(lock, std::chrono::nanoseconds(tick), [this]() { return m_quit; });
+	}
+}
+
+bool Watchdog::check(uint64_t now)
+{
+	if (!m_stall_ns)
+		return true;
+
+	std::vector<std::shared_ptr<WatchdogProbe>> probes;
+	{
+		const std::lock_guard<std::mutex> lock(m_mutex);
+		probes = m_probes;
+	}
+
+	bool healthy = true;
+	for (auto it = probes.begin(); it != probes.end(); ++it) {
+		WatchdogProbe *probe = it->get();
+		uint64_t since;
+		bool first;
+		{
+			const std::lock_guard<std::mutex> lock(probe->m_mutex);
+			since = probe->m_since;
+			if (!since || now < since || now - since < m_stall_ns)
+				continue;
+			first = !probe->m_stalled;
+			probe->m_stalled = true;
+
+			// Still stuck in the work while locked, so the thread
+			// is known to be around
+			if (first)
+				pthread_kill(probe->m_thread, STACK_DUMP_SIGNAL);
+		}
+		healthy = false;
+
+		if (first)
+			Logger::warning("Watchdog", "{} stalled for {} ms, withholding watchdog pings",
+					probe->name(), (now - since) / 1000000);
+	}
+	return healthy;
+}
@@ -0,0 +1,128 @@
+/*
+ * Copyright (C) 2023 Konsulko Group
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#ifndef _WATCHDOG_H
+#define _WATCHDOG_H
+
+#include <string>
+#include <vector>
+#include <memory>
+#include <mutex>
+#include <condition_variable>
+#include <thread>
+#include <cstdint>
+#include <csignal>
+#include <pthread.h>
+
+#include "EventLoop.h"
+
+// Durations in decade buckets from 100 us up to 1 s and above
+struct LatencyHistogram {
+	static const unsigned BUCKETS = 6;
+
+	uint64_t counts[BUCKETS] = {};
+	uint64_t count = 0;
+	uint64_t total_ns = 0;
+	uint64_t max_ns = 0;
+
+	void add(uint64_t ns);
+
+	// e.g. "<0.1ms 10, <1ms 2, <10ms 0, <100ms 0, <1s 0, >=1s 0"
+	std::string format() const;
+};
+
+// A piece of work that has to keep making progress: begin() and end()
+// bracket it, and it counts as stalled once it has been running for
+// longer than the watchdog's threshold.  Durations go into a histogram.
+
+class WatchdogProbe
+{
+public:
+	explicit WatchdogProbe(const std::string &name);
+
+	const std::string &name() const { return m_name; };
+
+	// On the thread doing the work
+	void begin() { begin(pthread_self()); };
+
+	// For work done on another thread, e.g. a posted callback
+	void begin(pthread_t thread);
+
+	void end();
+
+private:
+	friend class Watchdog;
+
+	std::mutex m_mutex;
+	std::string m_name;
+	uint64_t m_since;		// 0 if idle
+	pthread_t m_thread;
+	bool m_stalled;			// stall already reported
+	LatencyHistogram m_histogram;
+};
+
+// Liveness monitoring and systemd watchdog pings
+//
+// A thread of its own regularly posts a probe to every watched event loop
+// (measuring how long the loop takes to get to it) and looks at the
+// probes timed by their users (e.g. subscribe callbacks).  The
+// WATCHDOG=1 pings systemd expects with WatchdogSec are only sent while
+// none of them is stalled, so a wedged thread gets the service restarted.
+// When a probe first stalls, the thread it is stuck on logs its stack to
+// stderr.
+
+class Watchdog
+{
+public:
+	// Sent to a stalled thread to have it print its stack, threads
+	// that block signals should leave it unblocked
+	static const int STACK_DUMP_SIGNAL = SIGUSR2;
+
+	// stall_ms 0 disables the stall detection (pings are then sent
+	// regardless).  Histograms are logged every report_interval
+	// seconds when running verbose.
+	Watchdog(unsigned stall_ms, unsigned report_interval = 60);
+
+	~Watchdog();
+
+	// Probe timed by the caller
+	std::shared_ptr<WatchdogProbe> add(const std::string &name);
+
+	// Probe posted to loop, which runs on thread
+	void addLoop(const std::string &name, EventLoop *loop, pthread_t thread);
+
+	// Log and reset the histograms
+	void report();
+
+private:
+	struct LoopProbe {
+		EventLoop *loop;
+		pthread_t thread;
+		std::shared_ptr<WatchdogProbe> probe;
+	};
+
+	static uint64_t now_ns();
+
+	static void installStackDump();
+
+	void run();
+
+	// Returns false if something is stalled
+	bool check(uint64_t now);
+
+	uint64_t m_stall_ns;
+	uint64_t m_ping_ns;		// 0 if systemd does not want pings
+	uint64_t m_report_ns;
+
+	std::mutex m_mutex;
+	std::condition_variable m_cond;
+	bool m_quit;
+	std::vector<std::shared_ptr<WatchdogProbe>> m_probes;
+	std::vector<LoopProbe> m_loops;
+	std::thread m_thread;
+};
+
+#endif // _WATCHDOG_H
@@ -0,0 +1,228 @@
+/*
+ * Copyright (C) 2023 Konsulko Group
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+// Counts heap allocations on the update path once it is warmed up:
+// subscribe response handling, dispatch, the simulated CAN and LED
+// outputs and the write-back of every changed signal to the broker.
+//
+// Twice: first with a broker that is a socket listened on but never
+// answered, so the first writes stay in flight and the rest are coalesced
+// behind them, the steady state of a broker that is behind.  Then with a
+// stub broker answering every batch of writes, so that they complete and
+// the pooled calls are reused.  Only this thread is counted; whatever
+// gRPC does on its own threads is outside the budget.
+//
+// Run through "meson test"; exits non-zero if the budget is exceeded.
+
+#include <cstdio>
+#include <cstdlib>
+#include <new>
+#include <string>
+#include <vector>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <grpcpp/grpcpp.h>
+
+#include "HvacService.h"
+#include "EpollEventLoop.h"
+#include "Logger.h"
+#include "test_support.h"
+
+// Responses handled before letting the loop run, as the replay tool does
+#define LOOP_BATCH 64
+
+// Responses to get the pools, rings and maps to their working size
+#define WARMUP_RESPONSES 256
+
+#define MEASURED_RESPONSES 4096
+
+// Allocations allowed over all of the measured responses
+#define ALLOCATION_BUDGET 0
+
+// Allowed per write sent with the answering broker: gRPC's own for
+// starting a call (6 with gRPC 1.51: call stack, load balancing pick,
+// authorization metadata, request slice) and the path in the request,
+// which is too long for a std::string to keep inline
+#define ALLOCATIONS_PER_WRITE 7
+
+// And over all of them, for gRPC's occasional timers and the like
+#define ANSWERED_SLACK 64
+
+namespace {
+
+thread_local bool counting = false;
+unsigned long allocations = 0;
+
+void *allocate(size_t size)
+{
+	if (counting)
+		allocations++;
+	void *p = malloc(size ? size : 1);
+	if (!p)
+		throw std::bad_alloc();
+	return p;
+}
+
+void *allocate_aligned(size_t size, std::align_val_t align)
+{
+	if (counting)
+		allocations++;
+	size_t alignment = (size_t) align;
+	void *p = aligned_alloc(alignment, (size + alignment - 1) / alignment * alignment);
+	if (!p)
+		throw std::bad_alloc();
+	return p;
+}
+
+// Accepts connections into the backlog and never says anything
+int silent_broker(const std::string &path)
+{
+	int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (fd < 0) {
+		perror("socket");
+		return -1;
+	}
+	struct sockaddr_un addr = {};
+	addr.sun_family = AF_UNIX;
+	snprintf(addr.sun_path, sizeof(addr.sun_path), "%s", path.c_str());
+	if (bind(fd, (struct sockaddr *) &addr, sizeof(addr)) < 0 || listen(fd, 16) < 0) {
+		perror(path.c_str());
+		close(fd);
+		return -1;
+	}
+	return fd;
+}
+
+// Lets the loop run after each batch of responses
+typedef void (*WaitFunc)(EpollEventLoop *loop);
+
+void run(HvacService *service, EpollEventLoop *loop, const std::vector<SubscribeResponse> &responses,
+	 unsigned count, WaitFunc wait = turn)
+{
+	for (unsigned n = 0; n < count; n++) {
+		service->Replay(responses[n % responses.size()]);
+		if (n % LOOP_BATCH == LOOP_BATCH - 1)
+			wait(loop);
+	}
+}
+
+// Until something quits it
+void run_loop(EpollEventLoop *loop)
+{
+	loop->run();
+}
+
+} // namespace
+
+void *operator new(size_t size) { return allocate(size); }
+void *operator new[](size_t size) { return allocate(size); }
+void *operator new(size_t size, const std::nothrow_t &) noexcept { return malloc(size ? size : 1); }
+void *operator new[](size_t size, const std::nothrow_t &) noexcept { return malloc(size ? size : 1); }
+void *operator new(size_t size, std::align_val_t align) { return allocate_aligned(size, align); }
+void *operator new[](size_t size, std::align_val_t align) { return allocate_aligned(size, align); }
+void operator delete(void *p) noexcept { free(p); }
+void operator delete[](void *p) noexcept { free(p); }
+void operator delete(void *p, size_t) noexcept { free(p); }
+void operator delete[](void *p, size_t) noexcept { free(p); }
+void operator delete(void *p, std::align_val_t) noexcept { free(p); }
+void operator delete[](void *p, std::align_val_t) noexcept { free(p); }
+void operator delete(void *p, size_t, std::align_val_t) noexcept { free(p); }
+void operator delete[](void *p, size_t, std::align_val_t) noexcept { free(p); }
+
+int main(int argc, char** argv)
+{
+	Logger::start("agl-hvac-alloc-test");
+
+	TestDirectory dir("alloc-test");
+	std::string socket_path = dir.file("broker.sock");
+	int broker_fd = silent_broker(socket_path);
+	if (broker_fd < 0)
+		return 1;
+	auto config = dir.config("alloc-test", dir.brokerSection("unix:" + socket_path, "rpc-timeout=0\n"));
+
+	EpollEventLoop *loop = new EpollEventLoop();
+	auto channel = grpc::CreateChannel("unix:" + socket_path, grpc::InsecureChannelCredentials());
+	KuksaClient *broker = new KuksaClient(channel, KuksaConfig(*config), loop);
+	HvacService *service = new HvacService(config, loop, broker);
+
+	std::vector<SubscribeResponse> responses(LOOP_BATCH);
+	for (unsigned n = 0; n < LOOP_BATCH; n++)
+		fill_test_response(responses[n], test_signal_count, n);
+
+	run(service, loop, responses, WARMUP_RESPONSES);
+	turn(loop);
+
+	// Otherwise the writes never got as far as the client
+	bool writing = !broker->idle();
+
+	allocations = 0;
+	counting = true;
+	run(service, loop, responses, MEASURED_RESPONSES);
+	turn(loop);
+	counting = false;
+	unsigned long counted = allocations;
+
+	// The loop is not to run again once its clients are gone
+	delete service;
+	delete loop;
+	close(broker_fd);
+
+	// Same against a broker answering, with each batch of writes
+	// answered before the next: the calls complete on the loop and
+	// start the coalesced writes, cycling through the pooled calls
+	StubBroker *stub = new StubBroker(dir.file("stub.sock"));
+	loop = new EpollEventLoop();
+	auto stub_config = dir.config("alloc-test-stub", dir.brokerSection(stub->target()));
+	KuksaClient *client = new KuksaClient(stub->channel(), KuksaConfig(*stub_config), loop);
+	service = new HvacService(stub_config, loop, client);
+	unsigned settle_source = loop->addTimeout(1, [loop, client]() {
+		if (client->idle())
+			loop->quit();
+		return true;
+	});
+
+	run(service, loop, responses, WARMUP_RESPONSES, run_loop);
+	unsigned warmup_sets = stub->sets();
+
+	allocations = 0;
+	counting = true;
+	run(service, loop, responses, MEASURED_RESPONSES, run_loop);
+	counting = false;
+	unsigned long answered = allocations;
+	unsigned answered_sets = stub->sets() - warmup_sets;
+
+	loop->remove(settle_source);
+	delete service;
+	delete loop;
+	delete stub;
+
+	if (!writing) {
+		Logger::error("alloc_test", "No writes in flight, the write-back path was not exercised");
+		Logger::stop();
+		return 1;
+	}
+
+	if (!answered_sets) {
+		Logger::error("alloc_test", "No writes answered, the completion path was not exercised");
+		Logger::stop();
+		return 1;
+	}
+
+	bool ok = counted <= ALLOCATION_BUDGET;
+	Logger::info("alloc_test", "{} allocations over {} updates of {} signals, budget {}: {}",
+		     counted, MEASURED_RESPONSES, test_signal_count, ALLOCATION_BUDGET, ok ? "ok" : "exceeded");
+
+	unsigned long answered_budget = (unsigned long) answered_sets * ALLOCATIONS_PER_WRITE + ANSWERED_SLACK;
+	bool answered_ok = answered <= answered_budget;
+	Logger::info("alloc_test", "{} allocations over {} updates with {} writes answered, budget {}: {}",
+		     answered, MEASURED_RESPONSES, answered_sets, answered_budget,
+		     answered_ok ? "ok" : "exceeded");
+	ok = ok && answered_ok;
+
+	Logger::stop();
+	return ok ? 0 : 1;
+}
@@ -0,0 +1,161 @@
+/*
+ * Copyright (C) 2023 Konsulko Group
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+// Microbenchmarks of the code run for every signal update: subscribe
+// response handling, dispatch and write-back through an offline
+// HvacService, CAN frame packing, LED colour mapping and write request
+// construction.
+//
+// Run through "meson test --benchmark", which also leaves the results as
+// JSON in agl-hvac-bench.json in the build directory for comparing
+// releases, or directly with the usual Google Benchmark options.
+
+#include <string>
+#include <vector>
+#include <benchmark/benchmark.h>
+
+#include "HvacService.h"
+#include "HvacCanHelper.h"
+#include "HvacLedHelper.h"
+#include "EpollEventLoop.h"
+#include "Logger.h"
+#include "test_support.h"
+
+// Responses handled before letting the loop drain the outputs, as the
+// replay tool does
+#define LOOP_BATCH 64
+
+namespace {
+
+void BM_HandleSubscribeResponse(benchmark::State &state)
+{
+	SubscribeResponse response;
+	fill_test_response(response, state.range(0), 0);
+
+	uint64_t handled = 0;
+	SubscribeResponseCallback cb = [&handled](const std::string &path, const Datapoint &dp) {
+		benchmark::DoNotOptimize(dp);
+		handled++;
+	};
+	for (auto _ : state)
+		KuksaClient::handleSubscribeResponse(&response, cb);
+
+	state.SetItemsProcessed(handled);
+}
+BENCHMARK(BM_HandleSubscribeResponse)->Arg(1)->Arg(8)->Arg(64);
+
+// An offline service (as used by agl-hvac-replay) on the simulated
+// outputs, writing back to an in-process broker from the loop, its state
+// and config kept in a scratch directory
+class ServiceFixture : public benchmark::Fixture
+{
+public:
+	void SetUp(const benchmark::State &state) override {
+		m_dir = new TestDirectory("bench");
+		m_broker = new StubBroker(m_dir->file("broker.sock"));
+		auto config = m_dir->config("bench", m_dir->brokerSection(m_broker->target()));
+		m_loop = new EpollEventLoop();
+		m_service = new HvacService(config, m_loop,
+					    new KuksaClient(m_broker->channel(), KuksaConfig(*config), m_loop));
+	}
+
+	void TearDown(const benchmark::State &state) override {
+		delete m_service;
+		delete m_loop;
+		delete m_broker;
+		delete m_dir;
+	}
+
+	TestDirectory *m_dir;
+	StubBroker *m_broker;
+	EpollEventLoop *m_loop;
+	HvacService *m_service;
+};
+
+// Every response changes all of the signals
+BENCHMARK_F(ServiceFixture, BM_DispatchAllSignals)(benchmark::State &state)
+{
+	std::vector<SubscribeResponse> responses(LOOP_BATCH);
+	for (unsigned n = 0; n < LOOP_BATCH; n++)
+		fill_test_response(responses[n], test_signal_count, n);
+
+	unsigned n = 0;
+	for (auto _ : state) {
+		m_service->Replay(responses[n]);
+		if (++n == LOOP_BATCH) {
+			turn(m_loop);
+			n = 0;
+		}
+	}
+	state.SetItemsProcessed(state.iterations() * test_signal_count);
+	state.counters["written"] = m_broker->sets();
+}
+
+void BM_MakeFrame(benchmark::State &state)
+{
+	struct can_frame frame;
+	unsigned n = 0;
+	for (auto _ : state) {
+		HvacCanHelper::make_frame(15 + n % 16, 30 - n % 16, n % 101, frame);
+		benchmark::DoNotOptimize(frame);
+		n++;
+	}
+	state.SetItemsProcessed(state.iterations());
+}
+BENCHMARK(BM_MakeFrame);
+
+void BM_LedColour(benchmark::State &state)
+{
+	int rgb[3];
+	unsigned n = 0;
+	for (auto _ : state) {
+		HvacLedHelper::colour(15 + n % 16, 30 - n % 16, rgb);
+		benchmark::DoNotOptimize(rgb);
+		n++;
+	}
+	state.SetItemsProcessed(state.iterations());
+}
+BENCHMARK(BM_LedColour);
+
+// What KuksaClient::set() builds for each write, in a pooled call
+void BM_BuildSetRequest(benchmark::State &state)
+{
+	// Nothing is sent, so there is no need for a broker
+	TestDirectory dir("bench");
+	std::string target = "unix:" + dir.file("broker.sock");
+	auto config = dir.config("bench", dir.brokerSection(target));
+	KuksaClient *client = new KuksaClient(grpc::CreateChannel(target, grpc::InsecureChannelCredentials()),
+					      KuksaConfig(*config));
+
+	Datapoint dp;
+	unsigned n = 0;
+	for (auto _ : state) {
+		const TestSignal &signal = test_signals[n % test_signal_count];
+		set_test_value(signal, n, dp);
+		client->buildSet(signal.path, dp, state.range(0) != 0);
+		n++;
+	}
+	state.SetItemsProcessed(state.iterations());
+
+	delete client;
+}
+BENCHMARK(BM_BuildSetRequest)->ArgName("actuator")->Arg(0)->Arg(1);
+
+} // namespace
+
+int main(int argc, char** argv)
+{
+	Logger::start("agl-hvac-bench");
+
+	benchmark::Initialize(&argc, argv);
+	if (benchmark::ReportUnrecognizedArguments(argc, argv))
+		return 1;
+	benchmark::RunSpecifiedBenchmarks();
+	benchmark::Shutdown();
+
+	Logger::stop();
+	return 0;
+}
@@ -0,0 +1,181 @@
+/*
+ * Copyright (C) 2023 Konsulko Group
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+// Runs the awaitable KuksaClient API against the stub broker: a set and
+// a get of several signals, a subscription stream read and then ended by
+// its token, and calls and streams started with a token cancelled
+// already.  Once with the client in reactor mode, where the coroutines
+// run on the loop, and once in callback mode, where they run on gRPC's
+// threads.
+//
+// Run through "meson test"; exits non-zero if anything fails.
+
+#include <string>
+#include <vector>
+#include <map>
+#include <atomic>
+#include <thread>
+#include <chrono>
+
+#include "KuksaClient.h"
+#include "EpollEventLoop.h"
+#include "Logger.h"
+#include "test_support.h"
+
+// For each mode, the stub answers right away
+#define TEST_TIMEOUT_MS 10000
+
+namespace {
+
+std::atomic<unsigned> failures(0);
+
+void check(bool ok, const std::string &what)
+{
+	if (ok)
+		return;
+	Logger::error("coroutine_test", "Failed: {}", what);
+	failures++;
+}
+
+std::map<std::string, Datapoint> test_values(unsigned n)
+{
+	std::map<std::string, Datapoint> values;
+	for (size_t i = 0; i < test_signal_count; i++)
+		set_test_value(test_signals[i], n + i, values[test_signals[i].path]);
+	return values;
+}
+
+bool same_value(const Datapoint &a, const Datapoint &b)
+{
+	return a.value_case() == b.value_case() &&
+		a.int32() == b.int32() && a.uint32() == b.uint32() && a.bool_() == b.bool_();
+}
+
+Task<void> get_and_set(KuksaClient *client)
+{
+	auto values = test_values(3);
+	KuksaSetResult set = co_await client->set(values, true);
+	check(set.status.ok(), "set: " + set.status.error_message());
+	check(set.errors.empty(), "set: no errors");
+
+	std::vector<std::string> paths;
+	for (auto it = values.cbegin(); it != values.cend(); ++it)
+		paths.push_back(it->first);
+	KuksaGetResult get = co_await client->get(paths, true);
+	check(get.status.ok(), "get: " + get.status.error_message());
+	check(get.values.size() == values.size(), "get: all signals");
+	for (auto it = values.cbegin(); it != values.cend(); ++it) {
+		auto found = get.values.find(it->first);
+		check(found != get.values.end() && same_value(found->second, it->second),
+		      "get: value of " + it->first);
+	}
+}
+
+Task<void> stream(KuksaClient *client)
+{
+	auto values = test_values(3);
+	std::map<std::string, bool> signals;
+	for (auto it = values.cbegin(); it != values.cend(); ++it)
+		signals[it->first] = true;
+
+	CancelToken token;
+	KuksaSubscribeStream stream = client->subscribeStream(signals, &token);
+	std::map<std::string, Datapoint> received;
+	while (received.size() < values.size()) {
+		auto update = co_await stream.next();
+		if (!update)
+			break;
+		received[update->path] = update->dp;
+	}
+	check(received.size() == values.size(), "stream: all signals");
+	for (auto it = values.cbegin(); it != values.cend(); ++it) {
+		auto found = received.find(it->first);
+		check(found != received.end() && same_value(found->second, it->second),
+		      "stream: value of " + it->first);
+	}
+
+	// The stub keeps it open, the token ends it
+	token.cancel();
+	auto update = co_await stream.next();
+	check(!update, "stream: ends on cancel");
+	check(stream.status().error_code() == grpc::CANCELLED, "stream: cancelled status");
+}
+
+Task<void> cancelled_already(KuksaClient *client)
+{
+	CancelToken token;
+	token.cancel();
+
+	KuksaCallOptions options;
+	options.cancel = &token;
+	std::vector<std::string> paths(1, test_signals[0].path);
+	KuksaGetResult get = co_await client->get(paths, true, options);
+	check(get.status.error_code() == grpc::CANCELLED, "get: cancelled by token");
+	KuksaSetResult set = co_await client->set(test_values(5), true, options);
+	check(set.status.error_code() == grpc::CANCELLED, "set: cancelled by token");
+
+	std::map<std::string, bool> signals;
+	signals[paths[0]] = true;
+	KuksaSubscribeStream stream = client->subscribeStream(signals, &token);
+	auto update = co_await stream.next();
+	check(!update, "stream: cancelled by token");
+	check(stream.status().error_code() == grpc::CANCELLED, "stream: cancelled status");
+}
+
+Task<void> run(KuksaClient *client, std::function<void()> done)
+{
+	co_await get_and_set(client);
+	co_await stream(client);
+	co_await cancelled_already(client);
+	done();
+}
+
+} // namespace
+
+int main(int argc, char** argv)
+{
+	Logger::start("agl-hvac-coroutine-test");
+
+	TestDirectory dir("coroutine-test");
+	StubBroker *broker = new StubBroker(dir.file("broker.sock"));
+	auto config = dir.config("coroutine-test", dir.brokerSection(broker->target()));
+
+	EpollEventLoop *loop = new EpollEventLoop();
+	KuksaClient *client = new KuksaClient(broker->channel(), KuksaConfig(*config), loop);
+	bool done = false;
+	loop->addTimeout(TEST_TIMEOUT_MS, [loop]() {
+		loop->quit();
+		return false;
+	});
+	spawn(run(client, [loop, &done]() {
+		done = true;
+		loop->quit();
+	}));
+	loop->run();
+	check(done, "reactor mode: finished within " + std::to_string(TEST_TIMEOUT_MS) + " ms");
+	check(client->idle(), "reactor mode: nothing left outstanding");
+	delete client;
+	delete loop;
+
+	client = new KuksaClient(broker->channel(), KuksaConfig(*config));
+	std::atomic<bool> finished(false);
+	spawn(run(client, [&finished]() {
+		finished = true;
+	}));
+	auto deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(TEST_TIMEOUT_MS);
+	while (!finished && std::chrono::steady_clock::now() < deadline)
+		std::this_thread::sleep_for(std::chrono::milliseconds(10));
+	check(finished, "callback mode: finished within " + std::to_string(TEST_TIMEOUT_MS) + " ms");
+	check(client->idle(), "callback mode: nothing left outstanding");
+	delete client;
+
+	delete broker;
+
+	unsigned failed = failures;
+	Logger::info("coroutine_test", "{} failures", failed);
+	Logger::stop();
+	return failed ? 1 : 0;
+}
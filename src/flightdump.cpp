@@ -0,0 +1,102 @@
+/*
+ * Copyright (C) 2023 Konsulko Group
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+// Prints the actuator command history kept by the service's flight
+// recorder (see FlightRecorder.h), oldest first.  Works on the live file
+// as well as on one copied off a target.
+
+#include <cstdio>
+#include <cstdlib>
+#include <ctime>
+#include <string>
+#include <vector>
+#include <getopt.h>
+
+#include "FlightRecorder.h"
+#include "Logger.h"
+
+static std::string format_value(const FlightEvent &event)
+{
+	char buf[96];
+	if (event.signal == FlightRecorder::STATE || event.signal == FlightRecorder::CAN_FRAME) {
+		unsigned temp_left = event.value & 0xff;
+		unsigned temp_right = (event.value >> 8) & 0xff;
+		unsigned fan_speed = (event.value >> 16) & 0xff;
+		unsigned flags = (event.value >> 24) & 0xff;
+		if (event.signal == FlightRecorder::CAN_FRAME) {
+			snprintf(buf, sizeof(buf), "temp %u/%u fan %u", temp_left, temp_right, fan_speed);
+		} else {
+			snprintf(buf, sizeof(buf), "temp %u/%u fan %u ac %u defrost %u/%u recirc %u",
+				 temp_left, temp_right, fan_speed,
+				 flags & 1, (flags >> 1) & 1, (flags >> 2) & 1, (flags >> 3) & 1);
+		}
+	} else {
+		snprintf(buf, sizeof(buf), "%lld", (long long) event.value);
+	}
+	return buf;
+}
+
+static void print(const FlightEvent &event)
+{
+	time_t secs = event.time / 1000000000;
+	unsigned msecs = (event.time % 1000000000) / 1000000;
+	struct tm tm;
+	char when[32];
+	localtime_r(&secs, &tm);
+	strftime(when, sizeof(when), "%Y-%m-%d %H:%M:%S", &tm);
+
+	printf("%s.%03u %8llu %-8s %-15s %-10s %s",
+	       when, msecs,
+	       (unsigned long long) event.seq,
+	       FlightRecorder::sourceName(event.source),
+	       FlightRecorder::signalName(event.signal),
+	       FlightRecorder::outcomeName(event.outcome),
+	       format_value(event).c_str());
+	if (event.detail)
+		printf(" (%d)", event.detail);
+	printf("\n");
+}
+
+static void usage(const char *name)
+{
+	fprintf(stderr, "Usage: %s [--last N] [--vehicle NAME | FILE]\n", name);
+	exit(1);
+}
+
+int main(int argc, char** argv)
+{
+	size_t last = 0;
+	std::string vehicle;
+	static const struct option options[] = {
+		{ "last", required_argument, NULL, 'n' },
+		{ "vehicle", required_argument, NULL, 'v' },
+		{ NULL, 0, NULL, 0 }
+	};
+	int opt;
+	while ((opt = getopt_long(argc, argv, "n:v:", options, NULL)) != -1) {
+		if (opt == 'n')
+			last = strtoul(optarg, NULL, 10);
+		else if (opt == 'v')
+			vehicle = optarg;
+		else
+			usage(argv[0]);
+	}
+	if (optind < argc - 1 || (optind < argc && !vehicle.empty()))
+		usage(argv[0]);
+
+	Logger::start("agl-hvac-flightdump");
+
+	std::string path = optind < argc ? std::string(argv[optind]) : FlightRecorder::defaultPath(vehicle);
+	std::vector<FlightEvent> events;
+	if (!FlightRecorder::read(path, events))
+		exit(1);
+
+	size_t start = last && last < events.size() ? events.size() - last : 0;
+	for (size_t i = start; i < events.size(); i++)
+		print(events[i]);
+
+	return 0;
+}
@@ -4,49 +4,158 @@
  * SPDX-License-Identifier: Apache-2.0
  */
 
-#include <glib.h>
-#include <glib-unix.h>
+#include <cstdio>
+#include <csignal>
+#include <vector>
+#include <chrono>
+#include <getopt.h>
 #include <systemd/sd-daemon.h>
 
 #include "HvacService.h"
+#include "GLibEventLoop.h"
+#include "EpollEventLoop.h"
+#include "Realtime.h"
+#include "Watchdog.h"
+#include "Logger.h"
 
-static gboolean quit_cb(gpointer user_data)
+static void usage(const char *name)
 {
-	GMainLoop *loop = (GMainLoop*) user_data;
-
-	g_info("Quitting...");
-
-	if (loop)
-		g_idle_add(G_SOURCE_FUNC(g_main_loop_quit), loop);
-	else
-		exit(0);
-
-	return G_SOURCE_REMOVE;
+	fprintf(stderr, "Usage: %s [--vehicles DIR]\n", name);
+	exit(1);
 }
 
 int main(int argc, char** argv)
 {
-	GMainLoop *loop = NULL;
+	// Multi-vehicle mode, one vehicle per <name>.conf in the directory
+	std::string vehicles_dir;
+	static const struct option options[] = {
+		{ "vehicles", required_argument, NULL, 'v' },
+		{ NULL, 0, NULL, 0 }
+	};
+	int opt;
+	while ((opt = getopt_long(argc, argv, "v:", options, NULL)) != -1) {
+		if (opt == 'v')
+			vehicles_dir = optarg;
+		else
+			usage(argv[0]);
+	}
+
+	// The epoll reactor takes signals from a signalfd, which requires
+	// them to be blocked in every thread; do so before any (the logger's
+	// included) are created.
+	std::vector<int> signals = { SIGTERM, SIGINT, SIGUSR1 };
+	EpollEventLoop::blockSignals(signals);
+
+	Logger::start("agl-service-hvac");
+
+	std::shared_ptr<const HvacConfig> config = HvacConfig::load("agl-service-hvac");
+	Logger::setVerbose(config->kuksa().verbose);
+
+	if (config->kuksa().lockMemory)
+		Realtime::lockMemory();
 
-	loop = g_main_loop_new(NULL, FALSE);
-	if (!loop) {
-		std::cerr << "Could not create GLib event loop" << std::endl;
-		exit(1);
+	EventLoop *loop = NULL;
+	if (config->kuksa().eventLoop == "epoll") {
+		EpollEventLoop *epoll_loop = new EpollEventLoop();
+		if (!epoll_loop->valid()) {
+			Logger::error("main", "Could not create epoll event loop");
+			exit(1);
+		}
+		Logger::info("main", "Using epoll event loop");
+		loop = epoll_loop;
+	} else {
+		// GLib delivers signals via its own handler, the logger thread
+		// keeps them blocked so they end up on this one.
+		EpollEventLoop::unblockSignals(signals);
+
+		GLibEventLoop *glib_loop = new GLibEventLoop();
+		if (!glib_loop->valid()) {
+			Logger::error("main", "Could not create GLib event loop");
+			exit(1);
+		}
+		loop = glib_loop;
 	}
 
-	KuksaConfig config("agl-service-hvac");
+	// SIGUSR1 cycles the verbose level (0 -> 1 -> 2 -> 0) without a restart
+	loop->addSignal(SIGUSR1, []() {
+		Logger::setVerbose((Logger::verbose() + 1) % 3);
+		return true;
+	});
+
+	// gRPC starts its threads on demand, from this thread or its own
+	// ones; there is no hook to configure them, but they inherit the
+	// scheduling settings of the thread creating them.
+	if (config->kuksa().sched.enabled())
+		Realtime::apply(config->kuksa().sched, "main loop");
 
-	g_unix_signal_add(SIGTERM, quit_cb, (gpointer) loop);
-	g_unix_signal_add(SIGINT, quit_cb, (gpointer) loop);
+	// Pings systemd (WatchdogSec) for as long as nothing is stuck, from
+	// before the services start; they connect from the loop, so that is
+	// not held up by an absent broker either
+	Watchdog *watchdog = new Watchdog(config->kuksa().stallThreshold);
+	watchdog->addLoop("main loop", loop, pthread_self());
+
+	// The vehicles share this process' loop, gRPC threads and (in
+	// reactor mode) completion queue; the main configuration still
+	// provides the process wide settings.
+	std::vector<HvacService*> services;
+	if (!vehicles_dir.empty()) {
+		auto vehicles = HvacConfig::loadVehicles("agl-service-hvac", vehicles_dir);
+		if (vehicles.empty()) {
+			Logger::error("main", "No vehicle configurations in {}", vehicles_dir);
+			exit(1);
+		}
+		for (auto it = vehicles.cbegin(); it != vehicles.cend(); ++it) {
+			Logger::info("main", "Starting vehicle {}", (*it)->vehicle());
+			services.push_back(new HvacService(*it, loop));
+		}
+	} else {
+		services.push_back(new HvacService(config, loop));
+	}
 
-	HvacService service(config, loop);
+	for (auto it = services.begin(); it != services.end(); ++it)
+		(*it)->Watch(watchdog);
+
+	// The services drain before the loop is left, a second signal
+	// quits right away
+	bool stopping = false;
+	unsigned running = services.size();
+	std::chrono::steady_clock::time_point stop_start;
+	auto quit = [loop, &services, &stopping, &running, &stop_start]() {
+		if (stopping) {
+			Logger::warning("main", "Quitting without waiting for shutdown");
+			loop->quit();
+			return false;
+		}
+		Logger::info("main", "Quitting...");
+		sd_notify(0, "STOPPING=1");
+		stopping = true;
+		stop_start = std::chrono::steady_clock::now();
+		for (auto it = services.begin(); it != services.end(); ++it) {
+			(*it)->Shutdown([loop, &running]() {
+				if (--running == 0)
+					loop->quit();
+			});
+		}
+		return true;
+	};
+	loop->addSignal(SIGTERM, quit);
+	loop->addSignal(SIGINT, quit);
 
 	sd_notify(0, "READY=1");
 
-	g_main_loop_run(loop);
+	loop->run();
 
 	// Clean up
-	g_main_loop_unref(loop);
+	delete watchdog;
+	for (auto it = services.begin(); it != services.end(); ++it)
+		delete *it;
+	delete loop;
+
+	if (stopping) {
+		auto elapsed = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() -
+										     stop_start);
+		Logger::info("main", "Shutdown took {} ms", elapsed.count());
+	}
 
 	return 0;
 }
@@ -0,0 +1,179 @@
+/*
+ * Copyright (C) 2023 Konsulko Group
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+// Replays a subscribe stream recorded with the [kuksa-client]
+// record-subscriptions option into an offline HvacService, for
+// repeatable throughput and latency numbers of the dispatch and
+// hardware layers without a databroker.
+
+#include <cstdio>
+#include <cstdlib>
+#include <vector>
+#include <algorithm>
+#include <getopt.h>
+
+#include "HvacService.h"
+#include "EpollEventLoop.h"
+#include "SubscribeRecorder.h"
+#include "Logger.h"
+
+// Responses handled per pass when replaying as fast as possible, before
+// letting the loop run its own sources (LED updates, CAN retries)
+#define FAST_BATCH 64
+
+struct Replay {
+	EventLoop *loop;
+	HvacService *service;
+	SubscribeRecording *recording;
+	bool fast;
+
+	SubscribeResponse response;
+	uint64_t timestamp;
+	bool pending;
+
+	uint64_t first_recorded;
+	uint64_t first_replayed;
+	uint64_t end;
+	unsigned updates;
+
+	// Time spent handling each response, and how late it was handled
+	// compared to the recording
+	std::vector<uint64_t> latencies;
+	uint64_t max_lag;
+};
+
+static void step(Replay *r)
+{
+	unsigned batch = 0;
+	while (r->pending) {
+		uint64_t now = SubscribeRecorder::now_ns();
+		if (!r->fast) {
+			uint64_t due = r->first_replayed + (r->timestamp - r->first_recorded);
+			if (due > now) {
+				unsigned ms = (unsigned) ((due - now + 999999) / 1000000);
+				r->loop->addTimeout(ms, [r]() {
+					step(r);
+					return false;
+				});
+				return;
+			}
+			r->max_lag = std::max(r->max_lag, now - due);
+		} else if (++batch > FAST_BATCH) {
+			r->loop->post([r]() { step(r); });
+			return;
+		}
+
+		r->service->Replay(r->response);
+		r->latencies.push_back(SubscribeRecorder::now_ns() - now);
+		r->updates += r->response.updates_size();
+
+		r->pending = r->recording->next(r->timestamp, r->response);
+	}
+
+	r->end = SubscribeRecorder::now_ns();
+	r->loop->quit();
+}
+
+static void report(Replay *r)
+{
+	size_t count = r->latencies.size();
+	if (!count) {
+		printf("No responses replayed\n");
+		return;
+	}
+
+	double elapsed = (r->end - r->first_replayed) / 1e9;
+	std::sort(r->latencies.begin(), r->latencies.end());
+	uint64_t total = 0;
+	for (auto it = r->latencies.cbegin(); it != r->latencies.cend(); ++it)
+		total += *it;
+
+	printf("Replayed %zu responses (%u updates) in %.3f s, %.0f responses/s\n",
+	       count, r->updates, elapsed, elapsed > 0 ? count / elapsed : 0.0);
+	printf("Handling latency (us): avg %.1f, p50 %.1f, p99 %.1f, max %.1f\n",
+	       total / 1e3 / count,
+	       r->latencies[count / 2] / 1e3,
+	       r->latencies[std::min(count - 1, count * 99 / 100)] / 1e3,
+	       r->latencies[count - 1] / 1e3);
+	if (!r->fast)
+		printf("Maximum lag behind recording: %.1f us\n", r->max_lag / 1e3);
+}
+
+static void usage(const char *name)
+{
+	fprintf(stderr, "Usage: %s [--fast] [--config FILE] RECORDING\n", name);
+	exit(1);
+}
+
+int main(int argc, char** argv)
+{
+	bool fast = false;
+	std::string config_file;
+	static const struct option options[] = {
+		{ "fast", no_argument, NULL, 'f' },
+		{ "config", required_argument, NULL, 'c' },
+		{ NULL, 0, NULL, 0 }
+	};
+	int opt;
+	while ((opt = getopt_long(argc, argv, "fc:", options, NULL)) != -1) {
+		if (opt == 'f')
+			fast = true;
+		else if (opt == 'c')
+			config_file = optarg;
+		else
+			usage(argv[0]);
+	}
+	if (optind != argc - 1)
+		usage(argv[0]);
+
+	Logger::start("agl-hvac-replay");
+
+	// Outputs come from the configuration as usual, the sim-can and
+	// sim-leds backends allow running without the hardware
+	std::shared_ptr<const HvacConfig> config;
+	if (!config_file.empty())
+		config = HvacConfig::loadVehicle("agl-service-hvac", config_file);
+	else
+		config = HvacConfig::load("agl-service-hvac");
+	Logger::setVerbose(config->kuksa().verbose);
+
+	SubscribeRecording recording(argv[optind]);
+	if (!recording.valid())
+		exit(1);
+
+	EpollEventLoop loop;
+	if (!loop.valid()) {
+		Logger::error("main", "Could not create epoll event loop");
+		exit(1);
+	}
+
+	HvacService *service = new HvacService(config, &loop, false);
+
+	Replay r;
+	r.loop = &loop;
+	r.service = service;
+	r.recording = &recording;
+	r.fast = fast;
+	r.timestamp = 0;
+	r.pending = recording.next(r.timestamp, r.response);
+	r.first_recorded = r.timestamp;
+	r.first_replayed = SubscribeRecorder::now_ns();
+	r.end = r.first_replayed;
+	r.updates = 0;
+	r.max_lag = 0;
+
+	loop.post([&r]() { step(&r); });
+	loop.run();
+
+	service->ReportDispatchStats();
+
+	// Includes waiting for the outputs to finish
+	delete service;
+
+	report(&r);
+
+	return 0;
+}
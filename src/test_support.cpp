@@ -0,0 +1,341 @@
+/*
+ * Copyright (C) 2023 Konsulko Group
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#include "test_support.h"
+
+#include <cstdio>
+#include <cstdlib>
+#include <unistd.h>
+#include <dirent.h>
+#include <sys/mman.h>
+
+#include "HvacService.h"
+#include "HvacStatePublisher.h"
+
+const TestSignal test_signals[] = {
+	{ "Vehicle.Cabin.HVAC.Station.Row1.Driver.Temperature", INT32, 15, 30 },
+	{ "Vehicle.Cabin.HVAC.Station.Row1.Passenger.Temperature", INT32, 15, 30 },
+	{ "Vehicle.Cabin.HVAC.Station.Row1.Driver.FanSpeed", UINT32, 0, 100 },
+	{ "Vehicle.Cabin.HVAC.Station.Row1.Passenger.FanSpeed", UINT32, 0, 100 },
+	{ "Vehicle.Cabin.HVAC.IsAirConditioningActive", BOOL, 0, 1 },
+	{ "Vehicle.Cabin.HVAC.IsFrontDefrosterActive", BOOL, 0, 1 },
+	{ "Vehicle.Cabin.HVAC.IsRearDefrosterActive", BOOL, 0, 1 },
+	{ "Vehicle.Cabin.HVAC.IsRecirculationActive", BOOL, 0, 1 },
+};
+const size_t test_signal_count = sizeof(test_signals) / sizeof(test_signals[0]);
+
+void set_test_value(const TestSignal &signal, unsigned n, Datapoint &dp)
+{
+	int value = signal.min + (int) (n % (unsigned) (signal.max - signal.min + 1));
+	if (signal.kind == INT32)
+		dp.set_int32(value);
+	else if (signal.kind == UINT32)
+		dp.set_uint32(value);
+	else
+		dp.set_bool_(value != 0);
+	dp.mutable_timestamp()->set_seconds(1700000000 + n);
+	dp.mutable_timestamp()->set_nanos((n * 7919) % 1000000000);
+}
+
+void fill_test_response(SubscribeResponse &response, unsigned updates, unsigned n)
+{
+	response.Clear();
+	for (unsigned i = 0; i < updates; i++) {
+		const TestSignal &signal = test_signals[i % test_signal_count];
+		auto entry = response.add_updates()->mutable_entry();
+		entry->set_path(signal.path);
+		set_test_value(signal, n + i / test_signal_count, *entry->mutable_actuator_target());
+	}
+}
+
+void turn(EpollEventLoop *loop)
+{
+	loop->post([loop]() {
+		loop->quit();
+	});
+	loop->run();
+}
+
+TestDirectory::TestDirectory(const std::string &name)
+{
+	std::string path = "/tmp/agl-hvac-" + name + "-XXXXXX";
+	if (!mkdtemp(path.data())) {
+		perror("mkdtemp");
+		exit(1);
+	}
+	m_path = path;
+	setenv("STATE_DIRECTORY", m_path.c_str(), 1);
+}
+
+TestDirectory::~TestDirectory()
+{
+	// The segments outlive the services for their readers
+	for (auto it = m_configs.cbegin(); it != m_configs.cend(); ++it)
+		shm_unlink(HvacStatePublisher::segmentName(HvacService::instanceName(**it, false)).c_str());
+
+	DIR *dir = opendir(m_path.c_str());
+	if (dir) {
+		while (struct dirent *entry = readdir(dir)) {
+			if (entry->d_name[0] != '.')
+				unlink(file(entry->d_name).c_str());
+		}
+		closedir(dir);
+	}
+	rmdir(m_path.c_str());
+}
+
+void TestDirectory::write(const std::string &name, const std::string &contents)
+{
+	std::string path = file(name);
+	FILE *f = fopen(path.c_str(), "w");
+	if (!f) {
+		perror(path.c_str());
+		exit(1);
+	}
+	fputs(contents.c_str(), f);
+	fclose(f);
+}
+
+std::string TestDirectory::brokerSection(const std::string &target, const std::string &options)
+{
+	write("token", "test-token\n");
+	return "[kuksa-client]\nserver=" + target + "\nauthorization=" + file("token") + "\n" + options;
+}
+
+std::shared_ptr<const HvacConfig> TestDirectory::config(const std::string &name, const std::string &sections)
+{
+	write(name + ".conf", "[outputs]\nbackends=sim-can,sim-leds\nsim-leds-dir=" + m_path + "\n" + sections);
+	auto config = HvacConfig::loadVehicle("agl-service-hvac", file(name + ".conf"));
+	m_configs.push_back(config);
+	return config;
+}
+
+namespace {
+
+template<class M> bool parse(grpc::ByteBuffer &buffer, M &message)
+{
+	return grpc::SerializationTraits<M>::Deserialize(&buffer, &message).ok();
+}
+
+template<class M> void serialize(const M &message, grpc::ByteBuffer &buffer)
+{
+	bool own_buffer;
+	grpc::SerializationTraits<M>::Serialize(message, &buffer, &own_buffer);
+}
+
+bool has_field(const google::protobuf::RepeatedField<int> &fields, Field field)
+{
+	for (auto it = fields.cbegin(); it != fields.cend(); ++it) {
+		if (*it == field)
+			return true;
+	}
+	return false;
+}
+
+} // namespace
+
+class StubBroker::Service : public grpc::CallbackGenericService
+{
+public:
+	explicit Service(StubBroker *broker) : m_broker(broker) {};
+
+	grpc::ServerGenericBidiReactor *CreateReactor(grpc::GenericCallbackServerContext *context) override;
+
+private:
+	StubBroker *m_broker;
+};
+
+// One call of any of the methods; unary ones are answered right away,
+// a subscription finishes once the client cancels it
+
+class StubBroker::Call : public grpc::ServerGenericBidiReactor
+{
+public:
+	Call(StubBroker *broker, const std::string &method) :
+		m_broker(broker),
+		m_method(method),
+		m_writing(false),
+		m_cancelled(false),
+		m_finished(false) {
+		StartRead(&m_request);
+	}
+
+	void OnReadDone(bool ok) override {
+		if (!ok) {
+			finish(Status(grpc::INVALID_ARGUMENT, "No request"));
+			return;
+		}
+
+		if (m_method == "/kuksa.val.v1.VAL/Get") {
+			GetRequest request;
+			GetResponse response;
+			if (!parse(m_request, request)) {
+				finish(Status(grpc::INVALID_ARGUMENT, "Bad request"));
+				return;
+			}
+			m_broker->get(request, response);
+			reply(response);
+		} else if (m_method == "/kuksa.val.v1.VAL/Set") {
+			SetRequest request;
+			if (!parse(m_request, request)) {
+				finish(Status(grpc::INVALID_ARGUMENT, "Bad request"));
+				return;
+			}
+			m_broker->set(request);
+			reply(SetResponse());
+		} else if (m_method == "/kuksa.val.v1.VAL/Subscribe") {
+			SubscribeRequest request;
+			SubscribeResponse response;
+			if (!parse(m_request, request)) {
+				finish(Status(grpc::INVALID_ARGUMENT, "Bad request"));
+				return;
+			}
+			m_broker->subscribe(request, response);
+			if (response.updates_size()) {
+				const std::lock_guard<std::mutex> lock(m_mutex);
+				serialize(response, m_response);
+				m_writing = true;
+				StartWrite(&m_response);
+			}
+		} else {
+			finish(Status(grpc::UNIMPLEMENTED, m_method));
+		}
+	}
+
+	void OnWriteDone(bool ok) override {
+		const std::lock_guard<std::mutex> lock(m_mutex);
+		m_writing = false;
+		if (!ok || m_cancelled)
+			finishLocked(Status(grpc::CANCELLED, "Cancelled"));
+	}
+
+	void OnCancel() override {
+		const std::lock_guard<std::mutex> lock(m_mutex);
+		m_cancelled = true;
+		if (!m_writing)
+			finishLocked(Status(grpc::CANCELLED, "Cancelled"));
+	}
+
+	void OnDone() override {
+		delete this;
+	}
+
+private:
+	template<class M> void reply(const M &response) {
+		const std::lock_guard<std::mutex> lock(m_mutex);
+		if (m_finished)
+			return;
+		m_finished = true;
+		serialize(response, m_response);
+		StartWriteAndFinish(&m_response, grpc::WriteOptions(), Status::OK);
+	}
+
+	void finish(const Status &status) {
+		const std::lock_guard<std::mutex> lock(m_mutex);
+		finishLocked(status);
+	}
+
+	void finishLocked(const Status &status) {
+		if (m_finished)
+			return;
+		m_finished = true;
+		Finish(status);
+	}
+
+	StubBroker *m_broker;
+	std::string m_method;
+	grpc::ByteBuffer m_request;
+	grpc::ByteBuffer m_response;
+
+	std::mutex m_mutex;
+	bool m_writing;
+	bool m_cancelled;
+	bool m_finished;
+};
+
+grpc::ServerGenericBidiReactor *StubBroker::Service::CreateReactor(grpc::GenericCallbackServerContext *context)
+{
+	return new Call(m_broker, context->method());
+}
+
+StubBroker::StubBroker(const std::string &socket_path) :
+	m_target("unix:" + socket_path),
+	m_service(new Service(this)),
+	m_sets(0)
+{
+	grpc::ServerBuilder builder;
+	builder.AddListeningPort(m_target, grpc::InsecureServerCredentials());
+	builder.RegisterCallbackGenericService(m_service.get());
+	m_server = builder.BuildAndStart();
+	if (!m_server) {
+		fprintf(stderr, "Could not start the stub broker on %s\n", socket_path.c_str());
+		exit(1);
+	}
+}
+
+StubBroker::~StubBroker()
+{
+	// Cancels the subscriptions still open
+	m_server->Shutdown(std::chrono::system_clock::now());
+	m_server->Wait();
+}
+
+std::shared_ptr<grpc::ChannelInterface> StubBroker::channel() const
+{
+	return grpc::CreateChannel(m_target, grpc::InsecureChannelCredentials());
+}
+
+unsigned StubBroker::sets()
+{
+	const std::lock_guard<std::mutex> lock(m_mutex);
+	return m_sets;
+}
+
+void StubBroker::get(const GetRequest &request, GetResponse &response)
+{
+	const std::lock_guard<std::mutex> lock(m_mutex);
+	for (auto it = request.entries().cbegin(); it != request.entries().cend(); ++it) {
+		auto found = m_entries.find(it->path());
+		if (found == m_entries.end())
+			continue;
+		DataEntry *entry = response.add_entries();
+		entry->set_path(it->path());
+		if (has_field(it->fields(), Field::FIELD_ACTUATOR_TARGET))
+			*entry->mutable_actuator_target() = found->second.actuator_target();
+		else
+			*entry->mutable_value() = found->second.value();
+	}
+}
+
+void StubBroker::set(const SetRequest &request)
+{
+	const std::lock_guard<std::mutex> lock(m_mutex);
+	for (auto it = request.updates().cbegin(); it != request.updates().cend(); ++it) {
+		DataEntry &entry = m_entries[it->entry().path()];
+		entry.set_path(it->entry().path());
+		if (it->entry().has_actuator_target())
+			*entry.mutable_actuator_target() = it->entry().actuator_target();
+		if (it->entry().has_value())
+			*entry.mutable_value() = it->entry().value();
+	}
+	m_sets++;
+}
+
+void StubBroker::subscribe(const SubscribeRequest &request, SubscribeResponse &response)
+{
+	const std::lock_guard<std::mutex> lock(m_mutex);
+	for (auto it = request.entries().cbegin(); it != request.entries().cend(); ++it) {
+		auto found = m_entries.find(it->path());
+		if (found == m_entries.end())
+			continue;
+		DataEntry *entry = response.add_updates()->mutable_entry();
+		entry->set_path(it->path());
+		if (has_field(it->fields(), Field::FIELD_ACTUATOR_TARGET))
+			*entry->mutable_actuator_target() = found->second.actuator_target();
+		else
+			*entry->mutable_value() = found->second.value();
+	}
+}
@@ -0,0 +1,118 @@
+/*
+ * Copyright (C) 2023 Konsulko Group
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#ifndef _TEST_SUPPORT_H
+#define _TEST_SUPPORT_H
+
+// Shared by the tests and the benchmarks
+
+#include <string>
+#include <vector>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <grpcpp/grpcpp.h>
+#include <grpcpp/generic/async_generic_service.h>
+
+#include "HvacConfig.h"
+#include "KuksaClient.h"
+#include "EpollEventLoop.h"
+
+enum TestValueKind {
+	INT32,
+	UINT32,
+	BOOL
+};
+
+struct TestSignal {
+	const char *path;
+	TestValueKind kind;
+	int min;
+	int max;
+};
+
+// The signals HvacService handles, as the broker sends them
+extern const TestSignal test_signals[];
+extern const size_t test_signal_count;
+
+// Value number n of signal, going round its range
+void set_test_value(const TestSignal &signal, unsigned n, Datapoint &dp);
+
+// updates entries going round the signals, target values for the
+// actuators like the broker sends them to the provider
+void fill_test_response(SubscribeResponse &response, unsigned updates, unsigned n);
+
+// Run the loop until it gets to what is queued on it now
+void turn(EpollEventLoop *loop);
+
+// Scratch directory, used as the STATE_DIRECTORY; removed with its
+// contents and the state segments of the offline services configured in
+// it.  Exits if it can not be set up.
+
+class TestDirectory
+{
+public:
+	explicit TestDirectory(const std::string &name);
+
+	~TestDirectory();
+
+	const std::string &path() const { return m_path; };
+
+	std::string file(const std::string &name) const { return m_path + "/" + name; };
+
+	void write(const std::string &name, const std::string &contents);
+
+	// [kuksa-client] section for a broker at target, with a token for
+	// it and the options given
+	std::string brokerSection(const std::string &target, const std::string &options = "");
+
+	// Vehicle name.conf on the simulated outputs, with sections added
+	std::shared_ptr<const HvacConfig> config(const std::string &name, const std::string &sections = "");
+
+private:
+	std::string m_path;
+	std::vector<std::shared_ptr<const HvacConfig>> m_configs;
+};
+
+// Databroker on a unix socket, served from gRPC's threads: writes are
+// kept and succeed, reads return what was written, subscriptions get
+// the written values of their signals and then stay open until
+// cancelled.
+
+class StubBroker
+{
+public:
+	explicit StubBroker(const std::string &socket_path);
+
+	~StubBroker();
+
+	const std::string &target() const { return m_target; };
+
+	std::shared_ptr<grpc::ChannelInterface> channel() const;
+
+	// Set calls answered so far
+	unsigned sets();
+
+private:
+	class Service;
+	class Call;
+
+	std::string m_target;
+	std::unique_ptr<Service> m_service;
+	std::unique_ptr<grpc::Server> m_server;
+
+	std::mutex m_mutex;
+	std::map<std::string, DataEntry> m_entries;
+	unsigned m_sets;
+
+	void get(const GetRequest &request, GetResponse &response);
+
+	void set(const SetRequest &request);
+
+	void subscribe(const SubscribeRequest &request, SubscribeResponse &response);
+};
+
+#endif // _TEST_SUPPORT_H